@@ -0,0 +1,391 @@
+/*
+ * bench.c --- Microbenchmarks of the pool against malloc
+ *
+ * Build and run with `make bench`. Every case is run once with the pool and
+ * once with malloc()/free() doing the same work, over a sweep of block sizes,
+ * capacities and thread counts. To compare against jemalloc instead of glibc,
+ * preload it:
+ *
+ * 	LD_PRELOAD=libjemalloc.so.2 ./bench-bin
+ *
+ * Usage: ./bench-bin [ops per thread] [max threads]
+ *
+ * Each line is: case, allocator, block size, capacity, threads, million ops
+ * per second (an op is one alloc or one free, allocs that fail aren't counted),
+ * and the p50/p99/p99.9 latency of a single alloc in nanoseconds, from a
+ * sample of the allocs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include "mpool.h"
+
+/* Every SAMPLE_EVERY'th alloc is timed on its own for the percentiles */
+#define SAMPLE_EVERY 64
+
+/* Blocks each thread holds at once, so the pool isn't just ping-ponging one */
+#define BATCH 64
+
+/* Slots in the producer/consumer ring */
+#define RING_SIZE 1024
+
+static const size_t block_sizes[] = { 16, 64, 256 };
+static const int32_t capacities[] = { 1024, 1 << 16 };
+
+static long ops_per_thread = 1000000;
+static int max_threads = 4;
+
+
+/**
+ * struct allocator - What a case is run on
+ * @name: Name printed in the results
+ * @mpool: Whether this is a pool, else malloc()
+ * @flags: MPOOL_* flags used for the pool, see struct mpool_attr
+ * @tcache: Whether the pool gets thread caches
+ * @shards: Amount of shards of the pool, see init_mpool_sharded()
+ * @owner: Whether the producer thread owns the pool, see mpool_set_owner().
+ * Only used by the producer/consumer case.
+ * @pool: Pool to use, NULL for malloc()
+ * @size: Block size for malloc()
+ */
+struct allocator {
+	const char* name;
+	int mpool;
+	uint32_t flags;
+	int tcache;
+	int shards;
+	int owner;
+	struct mpool* pool;
+	size_t size;
+};
+
+static const struct allocator allocators[] = {
+	{ "mpool", 1, 0, 0, 0, 0, NULL, 0 },
+	{ "mpool-lockfree", 1, MPOOL_LOCK_FREE, 0, 0, 0, NULL, 0 },
+	{ "mpool-tcache", 1, 0, 1, 0, 0, NULL, 0 },
+	{ "mpool-sharded", 1, 0, 0, -1, 0, NULL, 0 },
+	{ "mpool-owner", 1, 0, 0, 0, 1, NULL, 0 },
+	{ "malloc", 0, 0, 0, 0, 0, NULL, 0 },
+};
+
+
+/**
+ * struct thread_result - What one thread of a case measured
+ * @samples: Alloc latencies in ns
+ * @nsamples: Amount of @samples filled
+ * @ops: Allocs and frees that were done
+ *
+ * Each is on its own cache line, so the threads don't share one while counting.
+ */
+struct thread_result {
+	uint32_t* samples;
+	long nsamples;
+	long ops;
+} __attribute__((aligned(64)));
+
+/**
+ * struct run - Shared state of one case
+ * @a: Allocator under test
+ * @start: Threads spin on this so they all start together
+ * @ring: Producer/consumer queue of blocks, one per consumer
+ * @head: Next slot the producer writes, per ring
+ * @tail: Next slot the consumer reads, per ring
+ * @results: Measurements, per thread
+ */
+struct run {
+	struct allocator* a;
+	atomic_int start;
+	void* (*ring)[RING_SIZE];
+	atomic_long* head;
+	atomic_long* tail;
+	struct thread_result* results;
+};
+
+struct worker {
+	struct run* run;
+	int id;
+};
+
+
+static inline uint64_t now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static inline void* bench_alloc (struct allocator* a)
+{
+	mpool_error err;
+	if (a->pool == NULL)
+		return malloc(a->size);
+	return mpool_alloc(a->pool, &err);
+}
+
+static inline void bench_free (struct allocator* a, void* p)
+{
+	if (a->pool == NULL)
+		free(p);
+	else
+		mpool_dealloc(p, a->pool);
+}
+
+/* Times one alloc in every SAMPLE_EVERY into the thread's samples */
+static inline void* timed_alloc (struct run* run, int id, long i)
+{
+	if (i % SAMPLE_EVERY != 0)
+		return bench_alloc(run->a);
+
+	struct thread_result* res = &run->results[id];
+	uint64_t t = now_ns();
+	void* p = bench_alloc(run->a);
+	uint64_t dt = now_ns() - t;
+	if (p != NULL)
+		res->samples[res->nsamples++] = (uint32_t) dt;
+	return p;
+}
+
+static void wait_start (struct run* run)
+{
+	while (!atomic_load_explicit(&run->start, memory_order_acquire))
+		;
+}
+
+
+/* Alloc a batch, free it, repeat. Run by every thread of the contention case */
+static void* alloc_free_worker (void* arg)
+{
+	struct worker* w = arg;
+	struct run* run = w->run;
+	void* held[BATCH];
+	long ops = 0;
+
+	wait_start(run);
+	for (long i = 0; i < ops_per_thread / 2; ) {
+		int n = 0;
+		/* Other threads may hold the rest of the pool, skip what didn't fit */
+		for (; n < BATCH && i < ops_per_thread / 2; i++)
+			if ((held[n] = timed_alloc(run, w->id, i)) != NULL)
+				n++;
+		ops += 2 * n;
+		while (n-- > 0)
+			bench_free(run->a, held[n]);
+	}
+	run->results[w->id].ops = ops;
+	if (run->a->pool)
+		mpool_thread_cache_flush(run->a->pool);
+	return NULL;
+}
+
+
+/* Same as alloc_free_worker() but through the bulk functions */
+static void* bulk_worker (void* arg)
+{
+	struct worker* w = arg;
+	struct run* run = w->run;
+	void* held[BATCH];
+	mpool_error err;
+	long ops = 0;
+
+	wait_start(run);
+	for (long i = 0; i < ops_per_thread / 2; i += BATCH) {
+		if (run->a->pool) {
+			int32_t got = mpool_alloc_bulk(run->a->pool, held, BATCH, &err);
+			mpool_dealloc_bulk(run->a->pool, held, got);
+			ops += 2 * got;
+		} else {
+			for (int n = 0; n < BATCH; n++)
+				held[n] = malloc(run->a->size);
+			for (int n = 0; n < BATCH; n++)
+				free(held[n]);
+			ops += 2 * BATCH;
+		}
+	}
+	run->results[w->id].ops = ops;
+	return NULL;
+}
+
+
+/* Even threads produce blocks into a ring, odd threads free them */
+static void* producer_consumer_worker (void* arg)
+{
+	struct worker* w = arg;
+	struct run* run = w->run;
+	int r = w->id / 2;
+	long total = ops_per_thread / 2;
+
+	if (w->id == 0 && run->a->owner)
+		mpool_set_owner(run->a->pool);
+	wait_start(run);
+	if (w->id % 2 == 0) {
+		for (long i = 0; i < total; i++) {
+			/* The pool may be empty while the consumer catches up */
+			void* p = timed_alloc(run, w->id, i);
+			while (p == NULL) {
+				sched_yield();
+				p = bench_alloc(run->a);
+			}
+			long head = atomic_load_explicit(&run->head[r], memory_order_relaxed);
+			while (head - atomic_load_explicit(&run->tail[r], memory_order_acquire) == RING_SIZE)
+				sched_yield();
+			run->ring[r][head % RING_SIZE] = p;
+			atomic_store_explicit(&run->head[r], head + 1, memory_order_release);
+		}
+	} else {
+		for (long i = 0; i < total; i++) {
+			long tail = atomic_load_explicit(&run->tail[r], memory_order_relaxed);
+			while (atomic_load_explicit(&run->head[r], memory_order_acquire) == tail)
+				sched_yield();
+			bench_free(run->a, run->ring[r][tail % RING_SIZE]);
+			atomic_store_explicit(&run->tail[r], tail + 1, memory_order_release);
+		}
+	}
+	/* Both sides retry until they're done, so every op is counted */
+	run->results[w->id].ops = total;
+	if (run->a->pool)
+		mpool_thread_cache_flush(run->a->pool);
+	return NULL;
+}
+
+
+static int cmp_u32 (const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * run_case() - Run one case and print its line of results
+ * @name: Name of the case
+ * @fn: Thread function
+ * @a: Allocator to use, its pool is created here
+ * @capacity: Capacity of the pool
+ * @threads: Amount of threads to run @fn on
+ */
+static void run_case (const char* name, void* (*fn)(void*), const struct allocator* a,
+		int32_t capacity, int threads)
+{
+	struct allocator alloc = *a;
+	struct run run = { 0 };
+	pthread_t tids[threads];
+	struct worker workers[threads];
+	int rings = (threads + 1) / 2;
+
+	if (alloc.mpool) {
+		struct mpool_attr attr = { 0 };
+		attr.flags = alloc.flags;
+		/* -1 is a shard per CPU */
+		attr.nshards = alloc.shards < 0 ? (int) sysconf(_SC_NPROCESSORS_ONLN) : alloc.shards;
+		if (init_mpool_attr(alloc.size, capacity, &attr, &alloc.pool) != MPOOL_SUCCESS) {
+			fprintf(stderr, "%s: init_mpool_attr failed\n", name);
+			return;
+		}
+		if (alloc.tcache)
+			mpool_thread_cache_enable(alloc.pool, 0);
+	}
+
+	run.a = &alloc;
+	atomic_init(&run.start, 0);
+	run.ring = calloc((size_t) rings, sizeof(*run.ring));
+	run.head = calloc((size_t) rings, sizeof(atomic_long));
+	run.tail = calloc((size_t) rings, sizeof(atomic_long));
+	run.results = aligned_alloc(64, sizeof(*run.results) * (size_t) threads);
+	for (int i = 0; i < threads; i++) {
+		run.results[i] = (struct thread_result) { 0 };
+		run.results[i].samples = malloc(sizeof(uint32_t) *
+			(size_t)(ops_per_thread / SAMPLE_EVERY + 1));
+	}
+
+	for (int i = 0; i < threads; i++) {
+		workers[i] = (struct worker) { &run, i };
+		pthread_create(&tids[i], NULL, fn, &workers[i]);
+	}
+	uint64_t start = now_ns();
+	atomic_store_explicit(&run.start, 1, memory_order_release);
+	for (int i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	uint64_t elapsed = now_ns() - start;
+
+	/* Gather the latency samples and op counts of all threads */
+	long total = 0, ops = 0;
+	for (int i = 0; i < threads; i++) {
+		total += run.results[i].nsamples;
+		ops += run.results[i].ops;
+	}
+	uint32_t* all = malloc(sizeof(uint32_t) * (size_t)(total + 1));
+	long n = 0;
+	for (int i = 0; i < threads; i++)
+		for (long j = 0; j < run.results[i].nsamples; j++)
+			all[n++] = run.results[i].samples[j];
+	qsort(all, (size_t) n, sizeof(uint32_t), cmp_u32);
+
+	double mops = (double) ops / ((double) elapsed / 1e3);
+	if (n > 0)
+		printf("%-18s %-15s %5zu %7d %3d %9.2f %7u %7u %7u\n", name, alloc.name,
+			alloc.size, capacity, threads, mops, all[n / 2], all[n * 99 / 100],
+			all[n * 999 / 1000]);
+	else
+		printf("%-18s %-15s %5zu %7d %3d %9.2f %7s %7s %7s\n", name, alloc.name,
+			alloc.size, capacity, threads, mops, "-", "-", "-");
+	fflush(stdout);
+
+	for (int i = 0; i < threads; i++)
+		free(run.results[i].samples);
+	free(all);
+	free(run.results);
+	free(run.ring);
+	free(run.head);
+	free(run.tail);
+	if (alloc.pool)
+		free_mpool(alloc.pool);
+}
+
+
+int main (int argc, char** argv)
+{
+	if (argc > 1)
+		ops_per_thread = atol(argv[1]);
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	else if (sysconf(_SC_NPROCESSORS_ONLN) > max_threads)
+		max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (ops_per_thread < 2 || max_threads < 1) {
+		fprintf(stderr, "Usage: %s [ops per thread] [max threads]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%-18s %-15s %5s %7s %3s %9s %7s %7s %7s\n", "case", "allocator",
+		"size", "cap", "thr", "Mops/s", "p50ns", "p99ns", "p999ns");
+
+	int nalloc = sizeof(allocators) / sizeof(allocators[0]);
+	for (size_t s = 0; s < sizeof(block_sizes) / sizeof(block_sizes[0]); s++) {
+		for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]); c++) {
+			for (int a = 0; a < nalloc; a++) {
+				struct allocator alloc = allocators[a];
+				alloc.size = block_sizes[s];
+
+				if (alloc.owner) {
+					run_case("producer-consumer", producer_consumer_worker, &alloc,
+						capacities[c], 2);
+					continue;
+				}
+
+				run_case("single-thread", alloc_free_worker, &alloc, capacities[c], 1);
+				for (int t = 2; t <= max_threads; t *= 2)
+					run_case("contention", alloc_free_worker, &alloc, capacities[c], t);
+				run_case("producer-consumer", producer_consumer_worker, &alloc,
+					capacities[c], 2);
+				run_case("bulk", bulk_worker, &alloc, capacities[c], 1);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,167 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <list>
+#include <map>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include "mpool.hpp"
+
+struct item {
+	static int live;
+	int id;
+	std::string name;
+
+	item (int i, const std::string& n) : id(i), name(n) { live++; }
+	~item () { live--; }
+};
+int item::live = 0;
+
+struct alignas(64) wide {
+	char bytes[100];
+};
+
+/* Sum of the blocks in use over every class of a set */
+static int64_t set_in_use (struct mpool_set* set)
+{
+	int64_t total = 0;
+	for (size_t size = 16; size <= 4096; size *= 2) {
+		struct mpool_stats stats;
+		mpool_get_stats(mpool_set_class(set, size), &stats);
+		total += stats.in_use;
+	}
+	return total;
+}
+
+void test_pool ()
+{
+	mpool_attr attr = {};
+	attr.flags = MPOOL_SAFE_MODE;
+	mp::pool<item> items(10, &attr);
+	item* ptrs[10];
+
+	for (int i = 0; i < 10; i++) {
+		ptrs[i] = items.construct(i, "item");
+		assert(ptrs[i]->id == i && ptrs[i]->name == "item");
+	}
+	assert(item::live == 10);
+
+	bool threw = false;
+	try {
+		items.construct(10, "one too many");
+	} catch (const std::bad_alloc&) {
+		threw = true;
+	}
+	assert(threw && item::live == 10);
+
+	for (int i = 0; i < 10; i++)
+		items.destroy(ptrs[i]);
+	assert(item::live == 0);
+
+	threw = false;
+	try {
+		items.deallocate(reinterpret_cast<item*>(&threw));
+	} catch (const mp::error& e) {
+		threw = e.code() == MPOOL_ERR_INVALID_ADDRESS;
+	}
+	assert(threw);
+
+	/* The alignment comes from the type */
+	mp::pool<wide> wides(4);
+	for (int i = 0; i < 4; i++)
+		assert(reinterpret_cast<uintptr_t>(wides.construct()) % 64 == 0);
+	assert(mpool_stride(wides.get()) == 128);
+
+	mp::pool<wide> moved(std::move(wides));
+	assert(moved.capacity() == 4 && wides.get() == nullptr);
+}
+
+void test_fixed_pool ()
+{
+	mp::fixed_pool<item, 8> items;
+	item* ptrs[8];
+
+	static_assert(sizeof(mp::fixed_pool<item, 8>::index_type) == 2, "");
+	static_assert(sizeof(mp::fixed_pool<char, 70000>::index_type) == 4, "");
+
+	for (int i = 0; i < 8; i++) {
+		ptrs[i] = items.construct(i, "fixed");
+		assert(items.contains(ptrs[i]) && ptrs[i]->id == i);
+	}
+	assert(ptrs[1] == ptrs[0] + 1);
+	assert(items.available() == 0 && items.allocate() == nullptr);
+
+	bool threw = false;
+	try {
+		items.construct(8, "one too many");
+	} catch (const std::bad_alloc&) {
+		threw = true;
+	}
+	assert(threw && item::live == 8);
+
+	/* Freed blocks are reused first */
+	items.destroy(ptrs[3]);
+	assert(items.available() == 1 && item::live == 7);
+	assert(items.construct(3, "again") == ptrs[3]);
+	for (int i = 0; i < 8; i++)
+		items.destroy(ptrs[i]);
+	assert(items.available() == 8 && item::live == 0);
+
+	item outside(0, "outside");
+	assert(!items.contains(&outside));
+
+	mp::fixed_pool<wide, 4> wides;
+	for (int i = 0; i < 4; i++)
+		assert(reinterpret_cast<uintptr_t>(wides.allocate()) % 64 == 0);
+}
+
+void test_allocator ()
+{
+	mp::allocator<int> alloc;
+
+	{
+		std::list<int, mp::allocator<int>> list(alloc);
+		for (int i = 0; i < 1000; i++)
+			list.push_back(i);
+		assert(set_in_use(alloc.set()) == 1000);
+
+		std::map<int, std::string, std::less<int>, 
+			mp::allocator<std::pair<const int, std::string>>> map(alloc);
+		for (int i = 0; i < 1000; i++)
+			map[i] = std::to_string(i);
+		assert(set_in_use(alloc.set()) == 2000);
+		assert(map[500] == "500");
+
+		std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, 
+			mp::allocator<std::pair<const int, int>>> hash(alloc);
+		for (int i = 0; i < 1000; i++)
+			hash[i] = i * 2;
+		assert(hash.size() == 1000 && hash[999] == 1998);
+		assert(set_in_use(alloc.set()) >= 3000);
+
+		list.clear();
+		map.clear();
+		hash.clear();
+		assert(set_in_use(alloc.set()) <= 1);
+	}
+
+	mp::allocator<int> other;
+	mp::allocator<long> rebound(alloc);
+	assert(rebound == alloc && other != alloc);
+
+	/* Too aligned for the classes, so it goes to operator new */
+	mp::allocator<wide> wides(alloc);
+	wide* w = wides.allocate(1);
+	assert(reinterpret_cast<uintptr_t>(w) % 64 == 0);
+	wides.deallocate(w, 1);
+}
+
+int main ()
+{
+	test_pool();
+	test_fixed_pool();
+	test_allocator();
+	printf("All tests passed\n");
+	return 0;
+}
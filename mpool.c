@@ -26,7 +26,26 @@
  * SOFTWARE.
  */
 
+#ifdef __linux__
+#	define _GNU_SOURCE
+#endif
+
 #include "mpool.h"
+#include <stdatomic.h>
+#include <errno.h>
+
+#if __APPLE__ || __linux__
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <time.h>
+#	define HAVE_MMAP 1
+#endif
+#ifdef __linux__
+#	include <sys/syscall.h>
+#	include <sched.h>
+#endif
 
 /* Defining some terminology used throughout the program:
  *
@@ -37,6 +56,10 @@
  * block -> A block of memory that is within the blob, and is equal in size to 
  * what the user has given (init_mpool() -> @block_size). 
  *
+ * slot index -> Every block in the pool has a number, counting up from 0 
+ * through the blobs in the order they were allocated. The lock-free free list
+ * uses these instead of pointers so a tag fits next to them in 64 bits.
+ *
  */
 
 /* Used internally to determine whether the pool is safe/unsafe */
@@ -44,488 +67,4525 @@
 #define UNSAFE 0
 
 /**
- * struct _block - Linked list holding all the blocks of memory.
+ * struct _block - Free list node stored inside the free block itself.
  * 
- * @next: Pointer to the next struct _block
- * @addr: Address of the block it points too.
+ * @next: Pointer to the next free struct _block
  *
+ *	While a block is sitting in the pool waiting to be handed out, its first
+ *	sizeof(void*) bytes are used to link it to the next free block. Once the
+ *	user alloc's the block, the whole block belongs to them again. This means
+ *	no extra memory is needed to keep track of the free blocks, and alloc/
+ *	dealloc are a single pointer swap.
  *
- *	This structure's purpose is to hold the location of a single block within a
- *	blob that has been allocated. When the user alloc's memory, a _block is 
- *	removed from the chain of _blocks, and the address it holds is returned to 
- *	the user. When the user dealloc's an address, it is put inside a currently
- *	empty _block and is added back into the chain.
- *
- *	Note there is a 1:1 ratio between _blocks and the pool's capacity, and this
- *	never changes. These _blocks are malloc'd when the pool is init, and only
- *	freed when free_mpool() is called. Once the _block's memory address is 
- *	given to the user, it is put into the unused_blocks list, until the user
- *	deallocates the space.
+ *	Because of this, every block must be able to hold a pointer, so blocks 
+ *	smaller than sizeof(struct _block) are padded up to that size inside the 
+ *	blob (see @stride in struct mpool).
  */
 struct _block {
 	struct _block* next;
-	void* addr;
+};
+
+
+/**
+ * struct _magazine - A small chain of free blocks held outside the pool lists.
+ *
+ * @head: First block of the chain
+ * @tail: Last block of the chain, so the chain can be spliced in O(1)
+ * @count: Number of blocks in the chain
+ *
+ * 	Magazines are how blocks move between the per-thread caches and the 
+ * 	pool. A thread cache holds two of them, and full ones are parked in the 
+ * 	pool's depot so that other threads may pick them up again with a single
+ * 	lock acquisition.
+ */
+struct _magazine {
+	struct _block* head;
+	struct _block* tail;
+	int32_t count;
+};
+
+/**
+ * struct _blob - One chunk of memory the blocks are carved out of.
+ *
+ * @base: First byte of the blob
+ * @size: Size of the blob in bytes
+ * @first: Slot index of the first block in the blob
+ * @count: Amount of blocks in the blob
+ * @free_map: One bit per block, set while the block is known to be free. Only
+ * kept up to date while safe mode is on, see _mark_free()
+ * @map_size: Size of the mapping if the blob was mmap'd, 0 if it was malloc'd
+ * @carved: High-water mark, the blocks before it have been handed out or put
+ * on the free list. The ones after it have never been touched, see _carve()
+ * @generation: One counter per block, bumped each time it is freed so stale 
+ * handles can be told apart. NULL unless the pool was init with MPOOL_HANDLES
+ * @fresh: Blocks from this slot on have never been handed out, so they still 
+ * hold the 0s a new mapping starts out with, apart from the free list link. 
+ * Starts at @count for blobs that weren't mmap'd, see mpool_calloc().
+ * @avail_map: One bit per block, set while the block is free, for pools init 
+ * with MPOOL_ADDRESS_ORDERED (else NULL). Protected by the first shard's mutex.
+ * @avail: Amount of bits set in @avail_map
+ * @avail_word: Every word of @avail_map before this one is 0
+ */
+struct _blob {
+	char* base;
+	size_t size;
+	int32_t first;
+	int32_t count;
+	_Atomic uint64_t* free_map;
+	size_t map_size;
+	_Atomic int32_t carved;
+	_Atomic uint8_t* generation;
+	_Atomic int32_t fresh;
+	uint64_t* avail_map;
+	int32_t avail;
+	int32_t avail_word;
+};
+
+/**
+ * struct _blob_table - Snapshot of every blob in the pool
+ *
+ * @count: Amount of blobs
+ * @by_index: The blobs in the order they were allocated (so by slot index)
+ * @by_addr: The same blobs, sorted by address
+ * @older: The table this one replaced
+ *
+ * 	A table is never changed once it is published. Adding a blob builds a 
+ * 	copy with the new blob in it and swaps the pool's pointer over, which 
+ * 	means the lookups done by mpool_alloc()/mpool_dealloc() never need a lock
+ * 	even while the pool grows. Replaced tables are kept on @older until 
+ * 	free_mpool(), as another thread may still be walking them.
+ */
+struct _blob_table {
+	int count;
+	struct _blob** by_index;
+	struct _blob** by_addr;
+	struct _blob_table* older;
+};
+
+#ifdef MULTITHREAD
+/* Retired blocks are kept in one list per epoch, for the last three epochs */
+#define EPOCH_LISTS 3
+
+/* A thread tries to advance the epoch after retiring this many blocks */
+#define EPOCH_BATCH 64
+
+/**
+ * struct _limbo - Blocks retired in one epoch, see mpool_retire()
+ *
+ * @items: The blocks. Readers may still be using them, so unlike free blocks
+ * they can't be linked through their own memory yet.
+ * @count: Amount of @items
+ * @size: Room in @items
+ * @epoch: Epoch the last of @items was retired in
+ */
+struct _limbo {
+	void** items;
+	int32_t count;
+	int32_t size;
+	uint64_t epoch;
+};
+
+/**
+ * struct _thread_cache - Free blocks cached by one thread for one pool.
+ *
+ * @pool: The pool the cache belongs to, NULL once free_mpool() has run
+ * @pool_id: Unique id of @pool, pool addresses may be reused after free
+ * @loaded: Magazine that alloc/dealloc work out of
+ * @previous: Spare magazine, to avoid going to the depot when a thread 
+ * bounces around a magazine boundary
+ * @epoch: Epoch of the pool the thread saw when it entered its critical 
+ * section, 0 while it is outside of one. See mpool_epoch_enter().
+ * @nesting: How many times the thread is inside mpool_epoch_enter()
+ * @retired: Blocks retired since the thread last tried to advance the epoch
+ * @limbo: Blocks the thread retired, one list per epoch they were retired in
+ * @next_local: Next cache owned by the same thread (one per pool used)
+ * @next: Next cache of the same pool
+ * @prev: Previous cache of the same pool
+ *
+ * 	The @loaded and @previous magazines are only ever touched by the owning
+ * 	thread, which is what lets the common alloc/dealloc path skip locking. 
+ * 	@pool, @next and @prev are protected by the global _tcache_mutex so that
+ * 	thread exit and free_mpool() may race each other safely. @epoch is read
+ * 	by whichever thread advances the pool's epoch, the rest of the epoch 
+ * 	fields are only used by the owning thread.
+ */
+struct _thread_cache {
+	struct mpool* pool;
+	uint64_t pool_id;
+	struct _magazine loaded;
+	struct _magazine previous;
+	_Atomic uint64_t epoch;
+	int32_t nesting;
+	int32_t retired;
+	struct _limbo limbo[EPOCH_LISTS];
+	struct _thread_cache* next_local;
+	struct _thread_cache* next;
+	struct _thread_cache* prev;
+};
+#endif
+
+
+/* Size of a cache line, what the shards are aligned to */
+#define CACHE_LINE 64
+
+/* Most shards a pool may have */
+#define MAX_SHARDS 1024
+
+/* Most blocks a pool with MPOOL_HANDLES may have, so every block has a handle */
+#define MAX_HANDLE_BLOCKS ((INT32_C(1) << MPOOL_HANDLE_INDEX_BITS) - 1)
+
+/* Most threads a blob may be partitioned by, see struct mpool_attr */
+#define MAX_INIT_THREADS 256
+
+/* Blobs smaller than this are always partitioned by the calling thread */
+#define PARALLEL_INIT_MIN ((size_t) 16 << 20)
+
+/* Stored in a shared pool's header once it is ready to be attached to */
+#define SHARED_MAGIC UINT64_C(0x6d706f6f6c736872)
+#define SHARED_VERSION 2
+
+/**
+ * struct _shared - Header at the start of a shared pool's mapping
+ *
+ * @magic: SHARED_MAGIC once the pool has been set up
+ * @version: SHARED_VERSION of the library that set it up
+ * @block_size: Block size the pool was made with
+ * @stride: Distance between two blocks
+ * @capacity: Amount of blocks, fixed once the pool is made
+ * @head: The free list, a tagged slot index like the lock-free shards use
+ * @carved: Blocks before this one have been handed out at least once
+ * @root: Handle set with mpool_set_root(), so a process that reopens the pool
+ * can find the blocks in use again
+ *
+ * 	Each process maps the region at its own address, so nothing in it is a
+ * 	pointer. The blocks follow the header, and a free block holds the slot 
+ * 	index (plus one) of the next free block where other pools keep a struct
+ * 	_block. The list and the carve mark only ever change by compare-and-swap,
+ * 	which works across processes, where a mutex would be left locked by a 
+ * 	process that died holding it.
+ *
+ * 	For the same reason a file holding the mapping can be mapped again after
+ * 	a restart and used as is, see mpool_open_file(). @version must change 
+ * 	whenever the layout does, so old files are refused instead of misread.
+ */
+struct _shared {
+	_Atomic uint64_t magic;
+	uint32_t version;
+	uint64_t block_size;
+	uint64_t stride;
+	int32_t capacity;
+	_Alignas(CACHE_LINE) _Atomic uint64_t head;
+	_Alignas(CACHE_LINE) _Atomic int32_t carved;
+	_Atomic uint32_t root;
+};
+
+/**
+ * struct _shard - One independently locked part of the free list
+ *
+ * @list: List of free _blocks that may be handed out
+ * @size: Size of @list, to check if the list is full
+ * @lf_head: Head of the list in lock-free mode, see LF_HEAD()
+ * @mutex: Holds the lock to @list
+ * @allocs: Blocks handed out by threads whose home shard this is, see 
+ * _stat_alloc(). Left out with MPOOL_NO_STATS, like @frees and @peak.
+ * @frees: Blocks given back by those threads
+ * @peak: Only used in the first shard, the highest amount of blocks the pool
+ * has had in use, see _stat_alloc()
+ *
+ * 	Every pool has at least one shard. With more than one, each thread works
+ * 	on the shard of the CPU it runs on (see _home_shard()) and only goes to 
+ * 	the other shards when its own is empty. Shards are cache line aligned so
+ * 	threads working on different shards don't share a line. The counters get
+ * 	a line of their own too, so counting doesn't slow down the threads that
+ * 	are only after the lock or @lf_head.
+ */
+struct _shard {
+	_Alignas(CACHE_LINE) struct _block* list;
+	_Atomic int32_t size;
+	_Atomic uint64_t lf_head;
+#ifdef MULTITHREAD
+	LOCK_TYPE mutex;
+#endif
+#ifndef MPOOL_NO_STATS
+	_Alignas(CACHE_LINE) _Atomic uint64_t allocs;
+	_Atomic uint64_t frees;
+	_Atomic int64_t peak;
+#endif
+};
+
+
+/**
+ * struct _stats - Counters behind mpool_get_stats()
+ *
+ * @empty: Allocations that failed with MPOOL_EMPTY_POOL
+ * @grows: Blobs added after init, by mpool_realloc() or the growth policy
+ * @contended: Lock acquisitions that found the lock taken, see _lock()
+ * @lock_wait: How long those waited for the lock, one log2 bucket per power of
+ * two nanoseconds, see mpool_get_lock_waits()
+ *
+ * 	All of these are relaxed atomics, they only need to be exact once the 
+ * 	threads using the pool are quiet. The alloc and free counts are kept in
+ * 	the shards instead, so threads on different CPUs don't fight over one
+ * 	line for them. Only the slow paths count here.
+ */
+struct _stats {
+	_Atomic uint64_t empty;
+	_Atomic uint64_t grows;
+	_Atomic uint64_t contended;
+	_Atomic uint64_t lock_wait[MPOOL_LOCK_WAIT_BUCKETS];
 };
 
 
 /**
  * struct mpool - Main data structure holding everything the pool needs.
  * 
- * @block_list: List of _blocks with free memory addresses
- * @unused_blocks: List of currently unused _blocks
- * @block_size_list: Size of the block list to check if list is full
- * @unused_block_size_list: Size of the unused block list
- * @block_size: Size of each individual block 
+ * @shards: The free list, split into @nshards parts, see struct _shard
+ * @nshards: Amount of @shards
+ * @lock_free: Whether the pool was init with MPOOL_LOCK_FREE
+ * @lazy: Whether the pool was init with MPOOL_LAZY
+ * @carve_blob: Position in the blob table of the first blob that may still 
+ * have uncarved blocks, only used by lazy pools
+ * @block_size: Size of each individual block (as given by the user)
+ * @stride: Distance between two blocks in a blob, @block_size rounded up so 
+ * an aligned struct _block fits inside of it, and then to a multiple of 
+ * @alignment
+ * @alignment: Alignment of every block, 0 if the user didn't ask for one
  * @capacity: How many blocks the user needs 
- * @blobs: This array holds the chunks of memory that are allocated
- * @blob_sizes: Array of the sizes corresponding to blobs array
- * @alloc_count: How many times memory has been alloc'd (size of blobs array)
- * @block_list_mutex: Holds the lock to @block_list
- * @unused_block_list_mutex: Holds the lock to @unused_block_list
- * @allocd_items: Array that holds the allocated addresses for verification
+ * @blob_table: All of the chunks of memory that are allocated, see struct 
+ * _blob_table
+ * @growth_factor: How much the pool grows by when it runs empty, 0 if it never
+ * grows on its own
+ * @max_capacity: Largest capacity the pool may grow to
+ * @min_grow: Least amount of blocks added when the pool grows
+ * @backing: The MPOOL_MMAP, MPOOL_HUGEPAGES, MPOOL_PREFAULT and 
+ * MPOOL_NUMA_BIND flags the pool was init with, used for every blob
+ * @numa_node: Node the blobs are bound to with MPOOL_NUMA_BIND
+ * @shared: Header of the mapping for pools from init_mpool_shm() or 
+ * mpool_open_file(), else NULL.
+ * Their free list lives in the mapping and the shards go unused.
+ * @shared_size: Size of the mapping @shared starts
+ * @grow_mutex: Serializes adding blobs to the pool
+ * @magazine_size: Blocks per thread cache magazine, 0 if caches are disabled
+ * @id: Unique id of the pool, used to match thread caches to it
+ * @depot: Full magazines given back by thread caches
+ * @depot_count: Amount of magazines in @depot
+ * @caches: List of the thread caches of this pool
+ * @owned: Whether the pool has an owner thread, see mpool_set_owner()
+ * @owner: The owner thread
+ * @owner_list: Free blocks only the owner thread uses, no lock needed
+ * @remote: Blocks freed by other threads for the owner to pick up, a stack
+ * pushed with compare-and-swap and emptied all at once by the owner
+ * @epoch: Current epoch for mpool_retire(), starts at 1
+ * @orphans: Blocks retired by threads that have exited, not yet safe to free.
+ * Protected by _tcache_mutex.
+ * @wait_used: Set once mpool_alloc_wait() has been called, until then frees 
+ * skip _wake_waiters() altogether
+ * @waiters: Threads inside mpool_alloc_wait()
+ * @wakeups: Bumped each time blocks come back while there are @waiters
+ * @wait_mutex: Protects @wait_cond
+ * @wait_cond: Where mpool_alloc_wait() sleeps until blocks come back
  * @safe_mode: Holds whether the pool is safe/unsafe (see SAFE/UNSAFE defn for 
  * the reason for this)
+ * @handles: Whether the pool was init with MPOOL_HANDLES
+ * @zeroed: Whether the pool was init with MPOOL_TRACK_FRESH, so its blobs are 
+ * anonymous mmaps, which start out as 0s. The blocks handed out are then 
+ * tracked by each blob's @fresh.
+ * @ordered: Whether the pool was init with MPOOL_ADDRESS_ORDERED. The free 
+ * blocks are then the bits of each blob's @avail_map, and the shards go unused.
+ * @init_threads: Threads to partition large blobs with, see _partition_blob()
+ * @first_touch: Whether the pool was init with MPOOL_FIRST_TOUCH
+ * @stats: Counters for mpool_get_stats(), left out with MPOOL_NO_STATS
+ * @hooks: Callbacks set by mpool_set_hooks(), left out with MPOOL_NO_HOOKS
  *
  * 	This structure holds all the needed information for the pool to function.
  * 	When the user uses init_mpool() or mpool_realloc() and memory is needed 
- * 	from the kernel, the "blobs" of memory are stored in the @blobs array. This
+ * 	from the kernel, the "blobs" of memory are stored in the @blob_table. This
  * 	is to keep track of all malloc'd memory so it may be free'd after. This 
- * 	blob is then internally partitioned into _blocks that hold @capacity amount
- * 	of @block_size chunks.
+ * 	blob is then internally partitioned into @capacity amount of @stride 
+ * 	sized blocks, which are threaded onto the free lists of the @shards.
  *
- * 	The lists are locked by a mutex, for both insert and remove operations, and
- * 	are only included if multithreading is enabled.
+ * 	Each shard's list is locked by its mutex, for both insert and remove 
+ * 	operations, and the mutex is only included if multithreading is enabled.
+ * 	The mutex of the first shard also protects the @depot. In lock-free mode
+ * 	the lists and mutexes go unused, and each shard's free list hangs off its 
+ * 	lf_head instead.
  *
  */
 struct mpool {
-	struct _block* block_list;
-	struct _block* unused_blocks;
-	int32_t block_list_size;
-	int32_t unused_block_list_size;
+	struct _shard* shards;
+	int nshards;
+	int lock_free;
+	int lazy;
+	_Atomic int carve_blob;
 	
 	size_t block_size;	
-	int32_t capacity;
+	size_t stride;
+	size_t alignment;
+	_Atomic int32_t capacity;
 	
-	void** blobs;
-	size_t* blob_sizes;
-	int alloc_count;
+	_Atomic(struct _blob_table*) blob_table;
+	double growth_factor;
+	int32_t max_capacity;
+	int32_t min_grow;
+	uint32_t backing;
+	int numa_node;
+	struct _shared* shared;
+	size_t shared_size;
 	
-	void** allocd_addr;
-	int index;
-
 	int safe_mode;
+	int handles;
+	int zeroed;
+	int ordered;
+	int init_threads;
+	int first_touch;
+
+	int32_t magazine_size;
+	uint64_t id;
+	struct _magazine* depot;
+	int32_t depot_count;
 #ifdef MULTITHREAD
-	LOCK_TYPE block_list_mutex;
-	LOCK_TYPE unused_block_list_mutex;
+	struct _thread_cache* caches;
+	int owned;
+	pthread_t owner;
+	struct _magazine owner_list;
+	_Atomic(struct _block*) remote;
+	_Atomic uint64_t epoch;
+	struct _limbo orphans;
+	_Atomic int wait_used;
+	_Atomic int32_t waiters;
+	_Atomic uint32_t wakeups;
+	LOCK_TYPE wait_mutex;
+	pthread_cond_t wait_cond;
+	LOCK_TYPE grow_mutex;
+#endif
+#ifndef MPOOL_NO_STATS
+	struct _stats stats;
+#endif
+#ifndef MPOOL_NO_HOOKS
+	struct mpool_hooks hooks;
 #endif
 };
 
 
+/* 
+ * Building with -DMPOOL_NO_STATS compiles every counter away, for when even a
+ * relaxed atomic add is too much on the hot path.
+ */
+#ifndef MPOOL_NO_STATS
+#	define STAT_ADD(pool, field, n) \
+	atomic_fetch_add_explicit(&(pool)->stats.field, (n), memory_order_relaxed)
+#else
+#	define STAT_ADD(pool, field, n) ((void) 0)
+#endif
+
+/*
+ * HOOK() calls the mpool_set_hooks() callback for an event if there is one, 
+ * and building with -DMPOOL_NO_HOOKS compiles them away. With -DMPOOL_USDT 
+ * every event, and every contended lock, is also a USDT probe of provider 
+ * "mpool" (ie mpool:alloc), which costs a nop until a tracer attaches.
+ */
+#ifdef MPOOL_USDT
+#	include <sys/sdt.h>
+#	define PROBE(name, ...) STAP_PROBEV(mpool, name, __VA_ARGS__)
+#else
+#	define PROBE(name, ...) ((void) 0)
+#endif
+
+#ifndef MPOOL_NO_HOOKS
+#	define HOOK(pool, event, ...) do { \
+	PROBE(event, (pool), __VA_ARGS__); \
+	if (__builtin_expect((pool)->hooks.on_##event != NULL, 0)) \
+		(pool)->hooks.on_##event((pool), __VA_ARGS__, (pool)->hooks.arg); \
+} while (0)
+#else
+#	define HOOK(pool, event, ...) PROBE(event, (pool), __VA_ARGS__)
+#endif
+
+/* 
+ * Taking a block off a list prefetches the next one, which holds the link to
+ * the one after it, so back to back allocs don't each wait on a cache miss.
+ * Building with -DMPOOL_NO_PREFETCH leaves it out.
+ */
+#ifndef MPOOL_NO_PREFETCH
+#	define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#	define PREFETCH(addr) ((void) 0)
+#endif
+
+/*
+ * Debug builds (-DMPOOL_DEBUG, see the debug target of the Makefile) put a red
+ * zone after every block and fill free blocks with a pattern, so writes past
+ * the end of a block, or into a block after it was freed, are caught the next 
+ * time it is freed or handed out. Built with AddressSanitizer, free blocks and
+ * the space after each block are poisoned too, so ASan reports bad accesses as
+ * they happen just like it does for malloc'd memory.
+ */
+#if defined(__SANITIZE_ADDRESS__)
+#	define MPOOL_ASAN 1
+#elif defined(__has_feature)
+#	if __has_feature(address_sanitizer)
+#		define MPOOL_ASAN 1
+#	endif
+#endif
+#ifdef MPOOL_ASAN
+#	include <sanitizer/asan_interface.h>
+#else
+#	define ASAN_POISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#	define ASAN_UNPOISON_MEMORY_REGION(addr, size) ((void)(addr), (void)(size))
+#endif
+#if defined(MPOOL_DEBUG) || defined(MPOOL_ASAN)
+#	define MPOOL_POISON 1
+#endif
+
+#ifdef MPOOL_DEBUG
+#	define REDZONE_SIZE 16
+#else
+#	define REDZONE_SIZE 0
+#endif
+#define FREE_PATTERN 0xdd
+#define REDZONE_PATTERN 0xfd
 
 
 /**
- * _remove_block_list - Remove the first item of list and return it
- * @block: Where to put the removed struct _block
- * @list: Pointer to the first node of list
+ * _home_shard() - Pick the shard the calling thread should use first
+ * @pool: Pool to pick a shard of
  *
- * This function removes the first element of any list, and points the value 
- * of *@block to the removed item. Since we are removing the head node, and 
- * there is no seperate structure for the head node, we need a pointer to it, 
- * as it will change.
+ * Returns: Position of the shard in @shards
  *
- * Note that since multiple lists use this function, and each has their own 
- * mutex's, these must be locked prior to calling this function. 
+ * Threads on the same CPU share a shard, so on an unloaded machine each shard
+ * is mostly used by one core. Where the CPU can't be found, each thread gets
+ * a number of its own to hash on instead.
  */
-static mpool_error _remove_block_list (struct _block** block, struct _block** list) 
+static inline int _home_shard (struct mpool* pool)
 {
-	if (block == NULL || list == NULL)
-		return MPOOL_ERR_NULL_ARG;
-	if (*list == NULL)
-		return MPOOL_EMPTY_POOL;
+	static atomic_uint next_thread = 1;
+	static _Thread_local unsigned thread;
 
-	*block = *list;
-	*list = (*block)->next;
-	return MPOOL_SUCCESS; 
+	if (pool->nshards == 1)
+		return 0;
+#ifdef __linux__
+	int cpu = sched_getcpu();
+	if (cpu >= 0)
+		return cpu % pool->nshards;
+#endif
+	if (thread == 0)
+		thread = atomic_fetch_add_explicit(&next_thread, 1, memory_order_relaxed);
+	return (int)(thread % (unsigned) pool->nshards);
 }
 
 
+#ifndef MPOOL_NO_STATS
 /**
- * _insert_block_list - Insert a _block into the head of the list
- * @block: Block to insert
- * @list: List to insert into
- *
- * This function inserts a _block into the front of the list. It functions much
- * like _remove_block_list() in that it needs a pointer to list head pointer, 
- * and also the relevant mutex's must be locked prior to calling the function.
- *
+ * _raise_peak() - Raise the peak of the pool to @in_use if it is higher
  */
-static mpool_error _insert_block_list ( struct _block* block, struct _block** list)
+static inline void _raise_peak (struct mpool* pool, int64_t in_use)
 {
-	if (block == NULL || list == NULL)
-		return MPOOL_ERR_NULL_ARG;
-
-	block->next = *list;
-	*list = block;
-	return MPOOL_SUCCESS;
+	_Atomic int64_t* peak = &pool->shards[0].peak;
+	int64_t old = atomic_load_explicit(peak, memory_order_relaxed);
+	while (in_use > old && !atomic_compare_exchange_weak_explicit(peak, &old, 
+			in_use, memory_order_relaxed, memory_order_relaxed))
+		;
 }
+#endif
 
 
 /**
- * _add_to_unused_list() - Adds a _block into the list of unused _blocks
- * @new_block: Block to add into list
- * @pool: struct mpool* that holds the relevant list
+ * _stat_alloc() - Count @n blocks being handed out
+ * @pool: Pool the blocks came from
+ * @home: Shard the operation already picked with _home_shard()
+ * @n: Amount of blocks
  *
- * This function is used to move a _block into the unused list. The unused list
- * holds all the _blocks that currently are not holding memory addresses from 
- * the pool. This happens when the user calls mpool_alloc(); the address the 
- * _block holds is returned, then the _block is placed into this list. We hold 
- * these as it doesn't make sense to free/malloc each time as the whole point
- * of the library is to cut down on the free/mallocs.
+ * The count goes to the calling thread's home shard, whose line that thread
+ * mostly has to itself already. With a single shard its counts are the 
+ * pool's, so the peak is kept up to date here and is exact. With more it 
+ * would take summing every shard, so the peak is only raised by _stat_peak().
  */
-static mpool_error _add_to_unused_list(struct _block* new_block, struct mpool* pool) 
+static inline void _stat_alloc (struct mpool* pool, int home, int32_t n)
 {
+#ifndef MPOOL_NO_STATS
+	struct _shard* shard = &pool->shards[home];
+	uint64_t allocs = atomic_fetch_add_explicit(&shard->allocs, (uint64_t) n, 
+		memory_order_relaxed) + (uint64_t) n;
+	if (pool->nshards == 1)
+		_raise_peak(pool, (int64_t)(allocs - 
+			atomic_load_explicit(&shard->frees, memory_order_relaxed)));
+#else
+	(void) pool;
+	(void) home;
+	(void) n;
+#endif
+}
 
-#ifdef MULTITHREAD
-	if (MUTEX_LOCK(&pool->unused_block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
+
+/**
+ * _stat_free() - Count @n blocks being given back, like _stat_alloc()
+ */
+static inline void _stat_free (struct mpool* pool, int home, int32_t n)
+{
+#ifndef MPOOL_NO_STATS
+	atomic_fetch_add_explicit(&pool->shards[home].frees, (uint64_t) n, 
+		memory_order_relaxed);
+#else
+	(void) pool;
+	(void) home;
+	(void) n;
 #endif
-	
-	mpool_error err = _insert_block_list(new_block, &pool->unused_blocks);
+}
 
-#ifdef MULTITHREAD
-	if (MUTEX_UNLOCK(&pool->unused_block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
+
+/**
+ * _stat_peak() - Sum the counts of the shards, and raise the peak to it
+ * @pool: Pool to count
+ * @allocs: Filled with the blocks handed out in total, may be NULL
+ * @frees: Filled with the blocks given back in total, may be NULL
+ *
+ * Returns: Amount of blocks in use
+ *
+ * This walks every shard, so it is only done by mpool_get_stats() and when the
+ * pool runs out or grows. A sharded pool's peak can miss a short spike in 
+ * between those.
+ */
+static int64_t _stat_peak (struct mpool* pool, uint64_t* allocs, uint64_t* frees)
+{
+#ifndef MPOOL_NO_STATS
+	uint64_t a = 0, f = 0;
+	for (int i = 0; i < pool->nshards; i++) {
+		f += atomic_load_explicit(&pool->shards[i].frees, memory_order_relaxed);
+		a += atomic_load_explicit(&pool->shards[i].allocs, memory_order_relaxed);
+	}
+	int64_t in_use = (int64_t)(a - f);
+	_raise_peak(pool, in_use);
+	if (allocs != NULL)
+		*allocs = a;
+	if (frees != NULL)
+		*frees = f;
+	return in_use;
+#else
+	(void) pool;
+	if (allocs != NULL)
+		*allocs = 0;
+	if (frees != NULL)
+		*frees = 0;
+	return 0;
 #endif
+}
 
-	if (err == MPOOL_SUCCESS)
-		pool->unused_block_list_size++;
 
-	return MPOOL_SUCCESS;
+/**
+ * _stat_empty() - Count an allocation that failed with MPOOL_EMPTY_POOL
+ */
+static inline void _stat_empty (struct mpool* pool)
+{
+	STAT_ADD(pool, empty, 1);
+	_stat_peak(pool, NULL, NULL);
+	HOOK(pool, empty, pool->capacity);
 }
 
 
+#ifdef MULTITHREAD
 /**
- * _remove_from_unused_list() - Remove a _block from the unused list of the pool
- * @block: Location of where to place the struct _block*
- * @pool: struct mpool* that holds the relevant list.
+ * _lock() - Lock one of the pool's mutexes, counting it if it was contended
+ * @pool: Pool the mutex belongs to
+ * @mutex: Mutex to lock
+ *
+ * Returns: 0 on success, like MUTEX_LOCK()
  *
- * This function removes a _block from the unused list so it may be used again.
- * This occurs when a user calls mpool_dealloc() and the address they pass in
- * is then placed into the block returned from this function and put into the 
- * block_list.
+ * Only contended acquisitions are timed, so the uncontended path is still a
+ * single trylock. The wait goes into the log2 bucket of its nanoseconds.
  */
-static mpool_error _remove_from_unused_list(struct _block** block, struct mpool* pool)
+static inline int _lock (struct mpool* pool, LOCK_TYPE* mutex)
 {
+#ifndef MPOOL_NO_STATS
+	struct timespec start, end;
 
-#ifdef MULTITHREAD
-	if (MUTEX_LOCK(&pool->unused_block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
-#endif
+	if (MUTEX_TRYLOCK(mutex) == 0)
+		return 0;
+	STAT_ADD(pool, contended, 1);
 
-	mpool_error err = _remove_block_list(block, &pool->unused_blocks);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int ret = MUTEX_LOCK(mutex);
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-#ifdef MULTITHREAD
-	if (MUTEX_UNLOCK(&pool->unused_block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
+	int64_t ns = (int64_t)(end.tv_sec - start.tv_sec) * 1000000000 + 
+		(end.tv_nsec - start.tv_nsec);
+	int bucket = ns > 1 ? 63 - __builtin_clzll((uint64_t) ns) : 0;
+	if (bucket >= MPOOL_LOCK_WAIT_BUCKETS)
+		bucket = MPOOL_LOCK_WAIT_BUCKETS - 1;
+	STAT_ADD(pool, lock_wait[bucket], 1);
+	PROBE(lock_wait, pool, mutex, ns);
+	return ret;
+#else
+	(void) pool;
+	return MUTEX_LOCK(mutex);
 #endif
-	
-	if (err == MPOOL_SUCCESS)
-		pool->unused_block_list_size--;
-	return MPOOL_SUCCESS;
 }
 
 
 /**
- * _create_block() - Initialize a struct _block 
- * @addr: Address to hold in the struct _block
- * @block: Where to put the allocated block
+ * _wake_waiters() - Wake threads in mpool_alloc_wait() after blocks came back
+ * @pool: Pool the blocks were given back to
+ * @all: Whether to wake every waiter, for when more than one block came back
+ *
+ * This runs on every dealloc, so in a pool that was never waited on it is a 
+ * single load. After that it is a fence and a load while nobody is waiting. 
+ * The fence pairs with the one in mpool_alloc_wait(): either this sees the 
+ * waiter, or the waiter sees the blocks when it tries again.
  */
-static mpool_error _create_block (void* addr, struct _block** block) 
+static inline void _wake_waiters (struct mpool* pool, int all)
 {
-	if (addr == NULL || block == NULL)
-		return MPOOL_ERR_NULL_ARG;
+	if (!atomic_load_explicit(&pool->wait_used, memory_order_relaxed))
+		return;
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&pool->waiters, memory_order_relaxed) == 0)
+		return;
 
-	if (*block == NULL) {
-		*block = malloc(sizeof(struct _block));
-		if (*block == NULL) return MPOOL_ERR_ALLOC;
-	}
-
-	(*block)->next = NULL;
-	(*block)->addr = addr;
-	return MPOOL_SUCCESS;
+	atomic_fetch_add_explicit(&pool->wakeups, 1, memory_order_release);
+	MUTEX_LOCK(&pool->wait_mutex);
+	if (all)
+		pthread_cond_broadcast(&pool->wait_cond);
+	else
+		pthread_cond_signal(&pool->wait_cond);
+	MUTEX_UNLOCK(&pool->wait_mutex);
 }
+#else
+#	define _wake_waiters(pool, all) ((void) 0)
+#endif
+
+
+
 
 /**
- * _add_block() - Add a block to the pool's block_list
- * @new_block: Block to add to the list
- * @pool: struct mpool* that holds the block_list
+ * _magazine_push() - Push a block onto the front of a magazine
+ * @mag: Magazine to push onto
+ * @block: Block to push
  */
-static mpool_error _add_block (struct _block* new_block, struct mpool* pool) 
+static inline void _magazine_push (struct _magazine* mag, struct _block* block)
 {
-	if (pool->block_list_size + 1 > pool->capacity)
-		return MPOOL_FULL_POOL;
-
-#ifdef MULTITHREAD
-	if (MUTEX_LOCK(&pool->block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
-#endif
-	
-	mpool_error err = _insert_block_list(new_block, &pool->block_list);
+	block->next = mag->head;
+	if (mag->count++ == 0)
+		mag->tail = block;
+	mag->head = block;
+}
 
-#ifdef MULTITHREAD
-	if (MUTEX_UNLOCK(&pool->block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
-#endif
 
-	if (err == MPOOL_SUCCESS)
-		pool->block_list_size++;
-	return err;
+/**
+ * _magazine_pop() - Pop the first block off a non-empty magazine
+ * @mag: Magazine to pop from
+ */
+static inline struct _block* _magazine_pop (struct _magazine* mag)
+{
+	struct _block* block = mag->head;
+	mag->head = block->next;
+	if (--mag->count == 0)
+		mag->tail = NULL;
+	else
+		PREFETCH(mag->head);
+	return block;
 }
 
 
 /**
- * _remove_block - Remove a block from the pool's block_list
- * @block: Location of where to put _block removed from list
- * @pool: struct mpool* that holds the block_list
+ * _take_magazine() - Cut @n blocks off the front of a magazine
+ * @mag: Magazine holding more than @n blocks
+ * @n: Amount of blocks to take
+ * @out: Where to put the chain taken
  */
-static mpool_error _remove_block (struct _block** block, struct mpool* pool) 
+static inline mpool_error _take_magazine (struct _magazine* mag, int32_t n, 
+		struct _magazine* out)
 {
-	if (block == NULL || pool == NULL)
-		return MPOOL_ERR_NULL_ARG;
+	if (n <= 0 || n >= mag->count)
+		return MPOOL_ERR_INVALID_ARG;
 
-	if (pool->block_list == NULL)
-		return MPOOL_EMPTY_POOL;
+	struct _block* tail = mag->head;
+	for (int32_t i = 1; i < n; i++)
+		tail = tail->next;
 
-#ifdef MULTITHREAD
-	if (MUTEX_LOCK(&pool->block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
-#endif
+	*out = (struct _magazine) { mag->head, tail, n };
+	mag->head = tail->next;
+	mag->count -= n;
+	tail->next = NULL;
+	return MPOOL_SUCCESS;
+}
 
-	mpool_error err = _remove_block_list(block, &pool->block_list);
 
-#ifdef MULTITHREAD
-	if (MUTEX_UNLOCK(&pool->block_list_mutex) != 0)
-		return MPOOL_ERR_MUTEX;
-#endif
-	
-	if (err == MPOOL_SUCCESS)
-		pool->block_list_size--;
-	return err;
+/**
+ * _chain_append() - Add the blocks of @src to the end of @dst
+ */
+static void _chain_append (struct _magazine* dst, struct _magazine* src)
+{
+	if (src->count == 0)
+		return;
+	if (dst->count == 0)
+		dst->head = src->head;
+	else
+		dst->tail->next = src->head;
+	dst->tail = src->tail;
+	dst->count += src->count;
+	*src = (struct _magazine) { NULL, NULL, 0 };
 }
 
 
 /**
- * _partition_blob - Split the blob of memory into list of blocks
- * @pool: struct mpool* that holds the raw blob
- * @index: Index of which blob should be partitioned from the @blobs[] array
+ * _find_blob() - Find the blob an address lives in
+ * @pool: Pool to search
+ * @addr: Address to look for 
  *
- * This function converts a raw chunk of allocated memory into a linked list 
- * of _blocks that each hold a pointer to a location within the blob.
+ * Returns: The blob holding @addr, or NULL if @addr isn't inside the pool.
+ *
+ * This is a binary search over the blobs sorted by address, so O(log blobs).
  */
-static mpool_error _partition_blob (struct mpool* pool, int index)
-{	
-	for (size_t i = 0; i < pool->blob_sizes[index]; i += pool->block_size) {
-		
-		/* Because void* pointer arithmatic is undefined, have to cast 
-		 * to a complete type, then back to void* 
-		 */
-		void* ptr = (void*)((char*) pool->blobs[index] + i);
+static struct _blob* _find_blob (struct mpool* pool, const void* addr)
+{
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+	uintptr_t a = (uintptr_t) addr;
+	int lo = 0;
+	int hi = table->count - 1;
 
-		/* Add the address to the array of held pointers */
-		pool->allocd_addr[pool->index++] = ptr; 
-		
-		struct _block* new_block = NULL;
-		mpool_error err = _create_block(ptr, &new_block);
-		if (err != MPOOL_SUCCESS) return err;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		struct _blob* blob = table->by_addr[mid];
+		uintptr_t base = (uintptr_t) blob->base;
 
-		err = _add_block(new_block, pool);
-		if (err != MPOOL_SUCCESS) return err;
+		if (a < base)
+			hi = mid - 1;
+		else if (a >= base + blob->size)
+			lo = mid + 1;
+		else
+			return blob;
 	}
-
-	return MPOOL_SUCCESS;
+	return NULL;
 }
 
 
-/************************************************
- *
- *	Public Functions --- See mpool.h for function
- *	headers.
+/**
+ * _find_block() - Find the blob and position of a block from its address
+ * @pool: Pool the block belongs to
+ * @addr: Address of the block
+ * @slot: Where to put the position of the block inside the blob
  *
- ***********************************************/
-
-mpool_error init_mpool (size_t block_size, int32_t capacity, struct mpool** pool) 
+ * Returns: The blob holding the block, or NULL if @addr isn't the start of a
+ * block in @pool.
+ */
+static struct _blob* _find_block (struct mpool* pool, const void* addr, int32_t* slot)
 {
-	if (pool == NULL)
-		return MPOOL_ERR_NULL_ARG;
-
-	*pool = calloc(1, sizeof(struct mpool));
-	if (*pool == NULL)
-		return MPOOL_ERR_ALLOC;
-	
-	(*pool)->block_size = block_size;
-	(*pool)->capacity = capacity;
-	
-	/* Safe-mode turned off by default */
-	(*pool)->safe_mode = UNSAFE;
-	(*pool)->allocd_addr = malloc(sizeof(void*) * capacity);
+	struct _blob* blob = _find_blob(pool, addr);
+	if (blob == NULL)
+		return NULL;
 
-#ifdef MULTITHREAD
-	if (MUTEX_INIT(&(*pool)->block_list_mutex, NULL) != 0)
-			return MPOOL_ERR_MUTEX;
-	if (MUTEX_INIT(&(*pool)->unused_block_list_mutex, NULL) != 0)
-		return MPOOL_ERR_MUTEX;
-#endif
-	
-	/*	Because the user may add more space later, we need to keep track of each 
-	 *	malloc call that is made to ensure they are all freed later, which is the 
-	 *	purpose of the owned_memory field
-	 */
-	(*pool)->blobs = malloc(sizeof(void*) * ++(*pool)->alloc_count);
-	(*pool)->blobs[0] = malloc(block_size * capacity);
-	(*pool)->blob_sizes = malloc(sizeof(size_t));
-	(*pool)->blob_sizes[0] = block_size * capacity;
-	mpool_error err = _partition_blob(*pool, (*pool)->alloc_count - 1);
-	return err;
+	size_t offset = (size_t)((const char*) addr - blob->base);
+	if (offset % pool->stride != 0)
+		return NULL;
+	*slot = (int32_t)(offset / pool->stride);
+	return blob;
 }
 
 
-void* mpool_alloc (struct mpool* pool, mpool_error* error) 
+/**
+ * _slot_index() - Convert the address of a block to its slot index
+ * @pool: Pool the block belongs to
+ * @addr: Address of the block
+ *
+ * Returns: The slot index, or -1 if @addr isn't the start of a block in @pool
+ */
+static int64_t _slot_index (struct mpool* pool, const void* addr)
 {
-	struct _block* b;
-	mpool_error err = MPOOL_SUCCESS;
-	void* item = NULL;
+	int32_t slot;
+	struct _blob* blob = _find_block(pool, addr, &slot);
+	if (blob == NULL)
+		return -1;
+	return blob->first + (int64_t) slot;
+}
 
-	if (pool == NULL) {
-		err = MPOOL_ERR_NULL_ARG;
-		goto cleanup;
+
+/* Word and bit of a slot inside a struct _blob free_map */
+#define MAP_WORD(slot) ((slot) / 64)
+#define MAP_BIT(slot) ((uint64_t) 1 << ((slot) % 64))
+
+
+/**
+ * _mark_free() - Mark a block as free in safe mode
+ * @pool: Pool the block is being given back to
+ * @addr: Address of the block
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_ERR_INVALID_ADDRESS if @addr isn't a block of
+ * the pool (or is one that was never handed out), or MPOOL_ERR_DOUBLE_FREE if 
+ * the block is already free.
+ *
+ * The check is a blob lookup plus a test-and-set on the free map, so it is 
+ * O(log blobs) no matter how large the pool is.
+ */
+static mpool_error _mark_free (struct mpool* pool, const void* addr)
+{
+	int32_t slot;
+	struct _blob* blob = _find_block(pool, addr, &slot);
+	if (blob == NULL || slot >= atomic_load_explicit(&blob->carved, memory_order_relaxed))
+		return MPOOL_ERR_INVALID_ADDRESS;
+
+	uint64_t old = atomic_fetch_or_explicit(&blob->free_map[MAP_WORD(slot)], 
+		MAP_BIT(slot), memory_order_relaxed);
+	if (old & MAP_BIT(slot))
+		return MPOOL_ERR_DOUBLE_FREE;
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _mark_allocd() - Mark a block as handed out in safe mode
+ * @pool: Pool the block came from
+ * @addr: Address of the block, must be a block of @pool
+ */
+static void _mark_allocd (struct mpool* pool, const void* addr)
+{
+	int32_t slot;
+	struct _blob* blob = _find_block(pool, addr, &slot);
+	if (blob != NULL)
+		atomic_fetch_and_explicit(&blob->free_map[MAP_WORD(slot)], 
+			~MAP_BIT(slot), memory_order_relaxed);
+}
+
+
+/**
+ * _debug_free() - Poison a block that is going back to the pool
+ * @pool: Pool the block belongs to
+ * @block: Block, of which only the free list link is touched from now on
+ */
+static inline void _debug_free (struct mpool* pool, void* block)
+{
+#ifdef MPOOL_POISON
+	char* p = block;
+	size_t link = sizeof(struct _block);
+
+	if (pool->shared != NULL)
+		return;
+	ASAN_UNPOISON_MEMORY_REGION(p, pool->stride);
+	if (pool->stride <= link)
+		return;
+#ifdef MPOOL_DEBUG
+	memset(p + link, FREE_PATTERN, pool->stride - link);
+#endif
+	ASAN_POISON_MEMORY_REGION(p + link, pool->stride - link);
+#else
+	(void) pool;
+	(void) block;
+#endif
+}
+
+
+/**
+ * _debug_alloc() - Unpoison a block that is being handed out
+ * @pool: Pool the block came from
+ * @block: Block being handed out
+ *
+ * Returns: MPOOL_SUCCESS, or MPOOL_ERR_CORRUPTED if the block was written to 
+ * while it was free
+ */
+static inline mpool_error _debug_alloc (struct mpool* pool, void* block)
+{
+#ifdef MPOOL_POISON
+	char* p = block;
+
+	if (pool->shared != NULL)
+		return MPOOL_SUCCESS;
+#ifdef MPOOL_DEBUG
+	ASAN_UNPOISON_MEMORY_REGION(p, pool->stride);
+	for (size_t i = sizeof(struct _block); i < pool->stride; i++)
+		if ((unsigned char) p[i] != FREE_PATTERN)
+			return MPOOL_ERR_CORRUPTED;
+	memset(p + pool->block_size, REDZONE_PATTERN, pool->stride - pool->block_size);
+#endif
+	ASAN_UNPOISON_MEMORY_REGION(p, pool->block_size);
+	ASAN_POISON_MEMORY_REGION(p + pool->block_size, pool->stride - pool->block_size);
+#else
+	(void) pool;
+	(void) block;
+#endif
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _debug_check() - Check the red zone of a block being given back
+ * @pool: Pool the block is given back to
+ * @block: Block being given back
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_ERR_INVALID_ADDRESS if @block isn't a block of
+ * @pool, MPOOL_ERR_DOUBLE_FREE if the red zone holds the pattern of a free 
+ * block, or MPOOL_ERR_CORRUPTED if something wrote past its end. Under ASan 
+ * the red zone is poisoned instead, so the write was reported already.
+ */
+static inline mpool_error _debug_check (struct mpool* pool, const void* block)
+{
+#ifdef MPOOL_DEBUG
+	int32_t slot;
+
+	if (pool->shared != NULL)
+		return MPOOL_SUCCESS;
+	if (_find_block(pool, block, &slot) == NULL)
+		return MPOOL_ERR_INVALID_ADDRESS;
+#ifndef MPOOL_ASAN
+	/* Small blocks share the first bytes of the red zone with the link */
+	const unsigned char* p = block;
+	size_t size = pool->block_size, redzone = 0, free = 0;
+	if (size < sizeof(struct _block))
+		size = sizeof(struct _block);
+	for (size_t i = size; i < pool->stride; i++) {
+		redzone += p[i] == REDZONE_PATTERN;
+		free += p[i] == FREE_PATTERN;
+	}
+	if (free == pool->stride - size)
+		return MPOOL_ERR_DOUBLE_FREE;
+	if (redzone != pool->stride - size)
+		return MPOOL_ERR_CORRUPTED;
+#endif
+#else
+	(void) pool;
+	(void) block;
+#endif
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _blob_at() - Find the position in a table of the blob holding a slot index
+ * @table: Table to look in
+ * @index: Slot index of a block in one of the table's blobs
+ */
+static int _blob_at (struct _blob_table* table, int64_t index)
+{
+	int lo = 0;
+	int hi = table->count - 1;
+
+	/* Find the last blob whose first slot is <= index */
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (table->by_index[mid]->first <= index)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+
+/**
+ * _slot_ptr() - Convert a slot index to the address of its block
+ * @pool: Pool the block belongs to
+ * @index: Slot index, must be the index of a block in the pool
+ */
+static struct _block* _slot_ptr (struct mpool* pool, int32_t index)
+{
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+	struct _blob* blob = table->by_index[_blob_at(table, index)];
+	return (struct _block*)(blob->base + (size_t)(index - blob->first) * pool->stride);
+}
+
+
+/* 
+ * Lock-free mode keeps the head of the free list as a single 64 bit word, so
+ * it can be swapped with one compare-and-swap: the low 32 bits hold the slot 
+ * index of the first free block plus one (0 being the empty list) and the high
+ * 32 bits hold a tag that is bumped on every change. The tag is what makes the
+ * stack ABA safe: if a block is popped and pushed back while another thread 
+ * is half way through a pop, the head no longer matches and the CAS fails.
+ */
+#define LF_HEAD(tag, index) (((uint64_t)(tag) << 32) | (uint32_t)(index))
+#define LF_TAG(head) ((uint32_t)((head) >> 32))
+#define LF_INDEX(head) ((uint32_t)(head))
+
+/* 
+ * A popping thread may read the next pointer of a block that another thread 
+ * has just taken, so the links of the lock-free list are accessed atomically.
+ * The value read there is never used unless the CAS on the head succeeds.
+ */
+static inline struct _block* _lf_get_next (struct _block* block)
+{
+	return atomic_load_explicit((_Atomic(struct _block*)*) &block->next, 
+		memory_order_relaxed);
+}
+
+static inline void _lf_set_next (struct _block* block, struct _block* next)
+{
+	atomic_store_explicit((_Atomic(struct _block*)*) &block->next, next, 
+		memory_order_relaxed);
+}
+
+
+/**
+ * _lf_push_chain() - Push a chain of blocks onto a lock-free shard
+ * @pool: Pool in lock-free mode
+ * @shard: Shard to push onto
+ * @chain: Chain of blocks to push, linked from head to tail
+ */
+static mpool_error _lf_push_chain (struct mpool* pool, struct _shard* shard, 
+		struct _magazine* chain)
+{
+	int64_t first = _slot_index(pool, chain->head);
+	if (first < 0)
+		return MPOOL_ERR_INVALID_ADDRESS;
+
+	uint64_t head = atomic_load_explicit(&shard->lf_head, memory_order_relaxed);
+	uint64_t new_head;
+	do {
+		uint32_t top = LF_INDEX(head);
+		_lf_set_next(chain->tail, top ? _slot_ptr(pool, top - 1) : NULL);
+		new_head = LF_HEAD(LF_TAG(head) + 1, first + 1);
+	} while (!atomic_compare_exchange_weak_explicit(&shard->lf_head, &head, 
+		new_head, memory_order_release, memory_order_relaxed));
+
+	atomic_fetch_add_explicit(&shard->size, chain->count, memory_order_relaxed);
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _lf_pop() - Pop one block off a lock-free shard
+ * @block: Where to put the block
+ * @pool: Pool in lock-free mode
+ * @shard: Shard to pop from
+ */
+static mpool_error _lf_pop (struct _block** block, struct mpool* pool, 
+		struct _shard* shard)
+{
+	uint64_t head = atomic_load_explicit(&shard->lf_head, memory_order_acquire);
+	uint64_t new_head;
+	struct _block* b;
+
+	do {
+		uint32_t top = LF_INDEX(head);
+		if (top == 0)
+			return MPOOL_EMPTY_POOL;
+
+		b = _slot_ptr(pool, top - 1);
+		struct _block* next = _lf_get_next(b);
+		int64_t next_index = next ? _slot_index(pool, next) : -1;
+		new_head = LF_HEAD(LF_TAG(head) + 1, next_index + 1);
+	} while (!atomic_compare_exchange_weak_explicit(&shard->lf_head, &head, 
+		new_head, memory_order_acquire, memory_order_acquire));
+
+	atomic_fetch_sub_explicit(&shard->size, 1, memory_order_relaxed);
+	*block = b;
+	return MPOOL_SUCCESS;
+}
+
+
+/* 
+ * Blocks of a shared pool, and the link a free one holds. The link is read by
+ * popping processes while another may be taking the block, as in the 
+ * lock-free shards.
+ */
+#define SHARED_BLOCK(shared, index) \
+	((struct _block*)((char*)((shared) + 1) + (size_t)(index) * (shared)->stride))
+#define SHARED_NEXT(block) ((_Atomic uint32_t*)(block))
+
+/**
+ * _shared_push_chain() - Push a chain of blocks onto a shared pool's free list
+ * @pool: Pool from init_mpool_shm()
+ * @chain: Chain of blocks to push, linked from head to tail
+ */
+static mpool_error _shared_push_chain (struct mpool* pool, struct _magazine* chain)
+{
+	struct _shared* shared = pool->shared;
+	char* base = (char*)(shared + 1);
+
+	/* The pointers are swapped for slot indices, the tail's is set below */
+	for (struct _block* b = chain->head; b != chain->tail; ) {
+		struct _block* next = b->next;
+		atomic_store_explicit(SHARED_NEXT(b), 
+			(uint32_t)(((char*) next - base) / shared->stride + 1), memory_order_relaxed);
+		b = next;
+	}
+
+	uint32_t first = (uint32_t)(((char*) chain->head - base) / shared->stride + 1);
+	uint64_t head = atomic_load_explicit(&shared->head, memory_order_relaxed);
+	do {
+		atomic_store_explicit(SHARED_NEXT(chain->tail), LF_INDEX(head), 
+			memory_order_relaxed);
+	} while (!atomic_compare_exchange_weak_explicit(&shared->head, &head, 
+		LF_HEAD(LF_TAG(head) + 1, first), memory_order_release, memory_order_relaxed));
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _shared_pop() - Take one block from a shared pool
+ * @block: Where to put the block
+ * @pool: Pool from init_mpool_shm()
+ *
+ * Freed blocks are reused first. Once there are none, the next block that 
+ * has never been used is carved off, so a new pool never has to link up its
+ * blocks.
+ */
+static mpool_error _shared_pop (struct _block** block, struct mpool* pool)
+{
+	struct _shared* shared = pool->shared;
+	uint64_t head = atomic_load_explicit(&shared->head, memory_order_acquire);
+	struct _block* b;
+
+	while (LF_INDEX(head) != 0) {
+		b = SHARED_BLOCK(shared, LF_INDEX(head) - 1);
+		uint32_t next = atomic_load_explicit(SHARED_NEXT(b), memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&shared->head, &head, 
+				LF_HEAD(LF_TAG(head) + 1, next), memory_order_acquire, 
+				memory_order_acquire)) {
+			*block = b;
+			return MPOOL_SUCCESS;
+		}
+	}
+
+	int32_t carved = atomic_load_explicit(&shared->carved, memory_order_relaxed);
+	while (carved < shared->capacity) {
+		if (atomic_compare_exchange_weak_explicit(&shared->carved, &carved, 
+				carved + 1, memory_order_relaxed, memory_order_relaxed)) {
+			*block = SHARED_BLOCK(shared, carved);
+			return MPOOL_SUCCESS;
+		}
+	}
+	return MPOOL_EMPTY_POOL;
+}
+
+
+/**
+ * _remove_block_list - Remove the first item of list and return it
+ * @block: Where to put the removed struct _block
+ * @list: Pointer to the first node of list
+ *
+ * This function removes the first element of any list, and points the value 
+ * of *@block to the removed item. Since we are removing the head node, and 
+ * there is no seperate structure for the head node, we need a pointer to it, 
+ * as it will change.
+ *
+ * Note that the relevant mutex must be locked prior to calling this function. 
+ */
+static mpool_error _remove_block_list (struct _block** block, struct _block** list) 
+{
+	if (block == NULL || list == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (*list == NULL)
+		return MPOOL_EMPTY_POOL;
+
+	*block = *list;
+	*list = (*block)->next;
+	PREFETCH(*list);
+	return MPOOL_SUCCESS; 
+}
+
+
+/**
+ * _insert_block_list - Insert a _block into the head of the list
+ * @block: Block to insert
+ * @list: List to insert into
+ *
+ * This function inserts a _block into the front of the list. It functions much
+ * like _remove_block_list() in that it needs a pointer to list head pointer, 
+ * and also the relevant mutex's must be locked prior to calling the function.
+ *
+ */
+static mpool_error _insert_block_list ( struct _block* block, struct _block** list)
+{
+	if (block == NULL || list == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+	block->next = *list;
+	*list = block;
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _carve() - Cut never used blocks off the untouched tail of the blobs
+ * @pool: Lazy pool to carve from
+ * @max: Most blocks to carve
+ * @chain: Where to put the chain of blocks carved
+ *
+ * Returns: MPOOL_SUCCESS, or MPOOL_EMPTY_POOL if every blob is used up
+ *
+ * Lazy pools don't partition their blobs up front. Instead each blob has a 
+ * high-water mark (@carved) that is bumped with a compare-and-swap, so only
+ * the blocks that are really used ever get written to (and paged in). Blobs
+ * before @carve_blob are used up, so carving is O(1) apart from moving past a
+ * blob when it runs out. No lock is needed.
+ */
+static mpool_error _carve (struct mpool* pool, int32_t max, struct _magazine* chain)
+{
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+	int i = atomic_load_explicit(&pool->carve_blob, memory_order_relaxed);
+
+	for (; i < table->count; i++) {
+		struct _blob* blob = table->by_index[i];
+		int32_t start = atomic_load_explicit(&blob->carved, memory_order_relaxed);
+		int32_t n = 0;
+
+		while (start < blob->count) {
+			n = blob->count - start < max ? blob->count - start : max;
+			if (atomic_compare_exchange_weak_explicit(&blob->carved, &start, 
+					start + n, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+
+		if (start < blob->count) {
+			char* first = blob->base + (size_t) start * pool->stride;
+#ifdef MPOOL_POISON
+			for (int32_t j = 0; j < n; j++)
+				_debug_free(pool, first + (size_t) j * pool->stride);
+#endif
+			for (int32_t j = 0; j < n - 1; j++)
+				((struct _block*)(first + (size_t) j * pool->stride))->next = 
+					(struct _block*)(first + (size_t)(j + 1) * pool->stride);
+
+			chain->head = (struct _block*) first;
+			chain->tail = (struct _block*)(first + (size_t)(n - 1) * pool->stride);
+			chain->tail->next = NULL;
+			chain->count = n;
+
+			/* Carved blocks are free until mpool_alloc() hands them out */
+			if (pool->safe_mode == SAFE)
+				for (int32_t j = start; j < start + n; j++)
+					atomic_fetch_or_explicit(&blob->free_map[MAP_WORD(j)], 
+						MAP_BIT(j), memory_order_relaxed);
+			return MPOOL_SUCCESS;
+		}
+
+		/* Used up, move the cursor on unless another thread already has */
+		int expected = i;
+		atomic_compare_exchange_strong_explicit(&pool->carve_blob, &expected, 
+			i + 1, memory_order_relaxed, memory_order_relaxed);
+	}
+	return MPOOL_EMPTY_POOL;
+}
+
+
+/**
+ * _ordered_add_chain() - Give blocks back to an address ordered pool
+ * @pool: Pool init with MPOOL_ADDRESS_ORDERED
+ * @chain: Blocks to give back, @count of them starting from @head
+ *
+ * Each block's bit is set in its blob's @avail_map, and the blob's search hint 
+ * moved back if the block is before it. Nothing is written into the blocks.
+ * If one of them can't be given back, the bits set for the blocks before it
+ * are cleared again, so the whole chain is still in use as the caller expects.
+ */
+static mpool_error _ordered_add_chain (struct mpool* pool, struct _magazine* chain)
+{
+	mpool_error err = MPOOL_SUCCESS;
+
+	if (chain->count == 0)
+		return MPOOL_SUCCESS;
+
+#ifdef MULTITHREAD
+	if (_lock(pool, &pool->shards->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
+	struct _block* b = chain->head;
+	int32_t done = 0;
+	for (; done < chain->count; done++) {
+		int32_t slot;
+		struct _blob* blob = _find_block(pool, b, &slot);
+		if (blob == NULL) {
+			err = MPOOL_ERR_INVALID_ADDRESS;
+			break;
+		}
+		if (blob->avail_map[MAP_WORD(slot)] & MAP_BIT(slot)) {
+			err = MPOOL_ERR_DOUBLE_FREE;
+			break;
+		}
+		blob->avail_map[MAP_WORD(slot)] |= MAP_BIT(slot);
+		blob->avail++;
+		if (MAP_WORD(slot) < blob->avail_word)
+			blob->avail_word = MAP_WORD(slot);
+		if (done + 1 < chain->count)
+			b = b->next;
+	}
+
+	/* The search hint may stay where it is, it only has to be low enough */
+	b = chain->head;
+	for (int32_t i = 0; i < done && err != MPOOL_SUCCESS; i++) {
+		int32_t slot;
+		struct _blob* blob = _find_block(pool, b, &slot);
+		blob->avail_map[MAP_WORD(slot)] &= ~MAP_BIT(slot);
+		blob->avail--;
+		b = b->next;
+	}
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->shards->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	if (err == MPOOL_SUCCESS)
+		_wake_waiters(pool, chain->count > 1);
+	return err;
+}
+
+
+/**
+ * _ordered_remove() - Take the lowest addressed free blocks of the pool
+ * @pool: Pool init with MPOOL_ADDRESS_ORDERED
+ * @max: Most blocks to take
+ * @chain: Where to put the blocks taken, linked in address order
+ * @wait: Whether to wait for the lock, else MPOOL_BUSY is returned if it's held
+ *
+ * The blobs are searched in address order, each one from its @avail_word, so
+ * finding a block is a find-first-set on the first word that isn't 0.
+ */
+static mpool_error _ordered_remove (struct mpool* pool, int32_t max, 
+		struct _magazine* chain, int wait)
+{
+	*chain = (struct _magazine) { NULL, NULL, 0 };
+
+#ifdef MULTITHREAD
+	if (!wait && MUTEX_TRYLOCK(&pool->shards->mutex) != 0)
+		return MPOOL_BUSY;
+	if (wait && _lock(pool, &pool->shards->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#else
+	(void) wait;
+#endif
+
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+	for (int i = 0; i < table->count && chain->count < max; i++) {
+		struct _blob* blob = table->by_addr[i];
+
+		while (blob->avail > 0 && chain->count < max) {
+			uint64_t word;
+			while ((word = blob->avail_map[blob->avail_word]) == 0)
+				blob->avail_word++;
+			blob->avail_map[blob->avail_word] = word & (word - 1);
+			blob->avail--;
+
+			int32_t slot = blob->avail_word * 64 + __builtin_ctzll(word);
+			struct _block* b = (struct _block*)(blob->base + (size_t) slot * pool->stride);
+			if (chain->count == 0)
+				chain->head = b;
+			else
+				chain->tail->next = b;
+			chain->tail = b;
+			chain->count++;
+		}
+	}
+	if (chain->count > 1)
+		chain->tail->next = NULL;
+	else if (chain->count == 1)
+		PREFETCH((char*) chain->head + pool->stride);
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->shards->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	return chain->count > 0 ? MPOOL_SUCCESS : MPOOL_EMPTY_POOL;
+}
+
+
+/**
+ * _ordered_fill() - Make every block of a blob free in an address ordered pool
+ * @pool: Pool init with MPOOL_ADDRESS_ORDERED
+ * @blob: Blob of the pool
+ */
+static mpool_error _ordered_fill (struct mpool* pool, struct _blob* blob)
+{
+#ifdef MULTITHREAD
+	if (_lock(pool, &pool->shards->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
+	for (int32_t w = 0; w < blob->count / 64; w++)
+		blob->avail_map[w] = ~(uint64_t) 0;
+	if (blob->count % 64)
+		blob->avail_map[MAP_WORD(blob->count)] = MAP_BIT(blob->count) - 1;
+	blob->avail = blob->count;
+	blob->avail_word = 0;
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->shards->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	_wake_waiters(pool, 1);
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _take_chain() - Cut up to @max blocks off the front of a shard's list
+ * @shard: Shard that holds the list
+ * @max: Most blocks to take
+ * @chain: Where to put the chain of blocks taken
+ *
+ * The shard's mutex must be held when calling this function.
+ */
+static mpool_error _take_chain (struct _shard* shard, int32_t max, struct _magazine* chain)
+{
+	if (shard->list == NULL)
+		return MPOOL_EMPTY_POOL;
+
+	struct _block* tail = shard->list;
+	int32_t count = 1;
+
+	while (count < max && tail->next != NULL) {
+		tail = tail->next;
+		count++;
+	}
+
+	chain->head = shard->list;
+	chain->tail = tail;
+	chain->count = count;
+	shard->list = tail->next;
+	tail->next = NULL;
+	atomic_fetch_sub_explicit(&shard->size, count, memory_order_relaxed);
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _shard_add_chain() - Splice a chain of blocks onto the front of a shard
+ * @pool: Pool the shard belongs to
+ * @shard: Shard to add to
+ * @chain: Chain to add, linked from head to tail
+ */
+static mpool_error _shard_add_chain (struct mpool* pool, struct _shard* shard, 
+		struct _magazine* chain)
+{
+	mpool_error err;
+
+	if (chain->count == 0)
+		return MPOOL_SUCCESS;
+	if (pool->lock_free) {
+		if ((err = _lf_push_chain(pool, shard, chain)) == MPOOL_SUCCESS)
+			_wake_waiters(pool, chain->count > 1);
+		return err;
+	}
+
+#ifdef MULTITHREAD
+	if (_lock(pool, &shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
+	chain->tail->next = shard->list;
+	shard->list = chain->head;
+	atomic_fetch_add_explicit(&shard->size, chain->count, memory_order_relaxed);
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	_wake_waiters(pool, chain->count > 1);
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _add_chain() - Splice a chain of blocks onto the calling thread's shard
+ * @pool: struct mpool* that holds the free list
+ * @chain: Chain to add, linked from head to tail
+ * @home: Calling thread's shard, from _home_shard()
+ */
+static mpool_error _add_chain (struct mpool* pool, struct _magazine* chain, int home)
+{
+	if (pool->ordered)
+		return _ordered_add_chain(pool, chain);
+	if (pool->shared != NULL)
+		return _shared_push_chain(pool, chain);
+	return _shard_add_chain(pool, &pool->shards[home], chain);
+}
+
+
+/**
+ * _shard_remove_chain() - Take up to @max blocks off the front of a shard
+ * @pool: Pool the shard belongs to
+ * @shard: Shard to take from
+ * @max: Most blocks to take
+ * @chain: Where to put the chain of blocks taken
+ */
+static mpool_error _shard_remove_chain (struct mpool* pool, struct _shard* shard, 
+		int32_t max, struct _magazine* chain)
+{
+	mpool_error err = MPOOL_SUCCESS;
+
+	if (pool->lock_free) {
+		struct _block* b;
+		while (chain->count < max && (err = _lf_pop(&b, pool, shard)) == MPOOL_SUCCESS)
+			_magazine_push(chain, b);
+		return chain->count > 0 ? MPOOL_SUCCESS : err;
+	}
+
+#ifdef MULTITHREAD
+	if (_lock(pool, &shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+
+	/* If the list is short, magazines parked by the thread caches are spliced
+	 * back onto it first so they aren't missed. The depot lives with the 
+	 * first shard.
+	 */
+	while (shard == pool->shards && pool->depot_count > 0 && 
+			atomic_load_explicit(&shard->size, memory_order_relaxed) < max) {
+		struct _magazine* mag = &pool->depot[--pool->depot_count];
+		mag->tail->next = shard->list;
+		shard->list = mag->head;
+		atomic_fetch_add_explicit(&shard->size, mag->count, memory_order_relaxed);
+	}
+#endif
+
+	err = _take_chain(shard, max, chain);
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	return err;
+}
+
+
+/**
+ * _remove_chain() - Take up to @max blocks off the front of the free list
+ * @pool: struct mpool* that holds the free list
+ * @max: Most blocks to take
+ * @chain: Where to put the chain of blocks taken
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * The calling thread's shard is tried first, then the others in turn, so a 
+ * thread only steals from its neighbours once its own shard is empty.
+ */
+static mpool_error _remove_chain (struct mpool* pool, int32_t max, 
+		struct _magazine* chain, int home)
+{
+	mpool_error err = MPOOL_EMPTY_POOL;
+
+	if (pool->ordered)
+		return _ordered_remove(pool, max, chain, 1);
+	*chain = (struct _magazine) { NULL, NULL, 0 };
+
+	if (pool->shared != NULL) {
+		struct _block* b;
+		while (chain->count < max && (err = _shared_pop(&b, pool)) == MPOOL_SUCCESS)
+			_magazine_push(chain, b);
+		return chain->count > 0 ? MPOOL_SUCCESS : err;
+	}
+
+	for (int i = 0; i < pool->nshards && err == MPOOL_EMPTY_POOL; i++)
+		err = _shard_remove_chain(pool, &pool->shards[(home + i) % pool->nshards], 
+			max, chain);
+
+	/* Freed blocks are reused before new ones are carved */
+	if (err == MPOOL_EMPTY_POOL && pool->lazy)
+		err = _carve(pool, max, chain);
+	return err;
+}
+
+
+/**
+ * _add_block() - Add a block to the calling thread's shard
+ * @new_block: Block to add to the list
+ * @pool: struct mpool* that holds the free list
+ * @home: Calling thread's shard, from _home_shard()
+ */
+static mpool_error _add_block (struct _block* new_block, struct mpool* pool, int home) 
+{
+	mpool_error err;
+	struct _shard* shard = &pool->shards[home];
+
+	if (pool->ordered) {
+		struct _magazine chain = { new_block, new_block, 1 };
+		return _ordered_add_chain(pool, &chain);
+	}
+	if (pool->shared != NULL) {
+		struct _magazine chain = { new_block, new_block, 1 };
+		return _shared_push_chain(pool, &chain);
+	}
+	if (pool->lock_free) {
+		struct _magazine chain = { new_block, new_block, 1 };
+		if ((err = _lf_push_chain(pool, shard, &chain)) == MPOOL_SUCCESS)
+			_wake_waiters(pool, 0);
+		return err;
+	}
+
+#ifdef MULTITHREAD
+	if (_lock(pool, &shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	
+	/* The size is checked and updated while holding the lock, so that two 
+	 * threads can't both squeeze past the capacity check.
+	 */
+	if (atomic_load_explicit(&shard->size, memory_order_relaxed) + 1 
+			> pool->capacity) {
+		err = MPOOL_FULL_POOL;
+	} else {
+		err = _insert_block_list(new_block, &shard->list);
+		if (err == MPOOL_SUCCESS)
+			atomic_fetch_add_explicit(&shard->size, 1, memory_order_relaxed);
+	}
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	if (err == MPOOL_SUCCESS)
+		_wake_waiters(pool, 0);
+	return err;
+}
+
+
+/**
+ * _shard_remove_block() - Remove a block from one shard
+ * @block: Location of where to put _block removed from list
+ * @pool: Pool the shard belongs to
+ * @shard: Shard to take from
+ */
+static mpool_error _shard_remove_block (struct _block** block, struct mpool* pool, 
+		struct _shard* shard) 
+{
+	if (pool->lock_free)
+		return _lf_pop(block, pool, shard);
+
+#ifdef MULTITHREAD
+	if (_lock(pool, &shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
+	mpool_error err = _remove_block_list(block, &shard->list);
+	if (err == MPOOL_SUCCESS)
+		atomic_fetch_sub_explicit(&shard->size, 1, memory_order_relaxed);
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	return err;
+}
+
+
+/**
+ * _remove_block - Remove a block from the pool's free list
+ * @block: Location of where to put _block removed from list
+ * @pool: struct mpool* that holds the free list
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * Same order as _remove_chain(): the calling thread's shard, the other 
+ * shards, and then carving if the pool is lazy.
+ */
+static mpool_error _remove_block (struct _block** block, struct mpool* pool, int home) 
+{
+	mpool_error err = MPOOL_EMPTY_POOL;
+
+	if (block == NULL || pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared != NULL)
+		return _shared_pop(block, pool);
+	if (pool->ordered) {
+		struct _magazine chain;
+		if ((err = _ordered_remove(pool, 1, &chain, 1)) == MPOOL_SUCCESS)
+			*block = chain.head;
+		return err;
+	}
+
+	for (int i = 0; i < pool->nshards && err == MPOOL_EMPTY_POOL; i++)
+		err = _shard_remove_block(block, pool, &pool->shards[(home + i) % pool->nshards]);
+
+	if (err == MPOOL_EMPTY_POOL && pool->lazy) {
+		struct _magazine chain;
+		if ((err = _carve(pool, 1, &chain)) == MPOOL_SUCCESS)
+			*block = chain.head;
+	}
+	return err;
+}
+
+
+/**
+ * _try_remove_block() - Like _remove_block(), but never wait on a lock
+ * @block: Location of where to put _block removed from list
+ * @pool: struct mpool* that holds the free list
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_EMPTY_POOL, or MPOOL_BUSY if there was no 
+ * block in the shards that could be locked but another one was held.
+ *
+ * Shards that are locked by another thread are skipped. Lock-free and shared 
+ * pools never wait anyway, so they go through _remove_block().
+ */
+static mpool_error _try_remove_block (struct _block** block, struct mpool* pool, 
+		int home)
+{
+	mpool_error err = MPOOL_EMPTY_POOL;
+
+	if (pool->lock_free || pool->shared != NULL)
+		return _remove_block(block, pool, home);
+	if (pool->ordered) {
+		struct _magazine chain;
+		if ((err = _ordered_remove(pool, 1, &chain, 0)) == MPOOL_SUCCESS)
+			*block = chain.head;
+		return err;
+	}
+
+	int busy = 0;
+
+	for (int i = 0; i < pool->nshards && err == MPOOL_EMPTY_POOL; i++) {
+		struct _shard* shard = &pool->shards[(home + i) % pool->nshards];
+#ifdef MULTITHREAD
+		if (MUTEX_TRYLOCK(&shard->mutex) != 0) {
+			busy = 1;
+			continue;
+		}
+
+		/* Parked magazines are free blocks too, as in _remove_chain() */
+		if (shard == pool->shards && shard->list == NULL && pool->depot_count > 0) {
+			struct _magazine* mag = &pool->depot[--pool->depot_count];
+			shard->list = mag->head;
+			atomic_fetch_add_explicit(&shard->size, mag->count, memory_order_relaxed);
+		}
+#endif
+		err = _remove_block_list(block, &shard->list);
+		if (err == MPOOL_SUCCESS)
+			atomic_fetch_sub_explicit(&shard->size, 1, memory_order_relaxed);
+#ifdef MULTITHREAD
+		MUTEX_UNLOCK(&shard->mutex);
+#endif
+	}
+
+	if (err == MPOOL_EMPTY_POOL && pool->lazy) {
+		struct _magazine chain;
+		if ((err = _carve(pool, 1, &chain)) == MPOOL_SUCCESS)
+			*block = chain.head;
+	}
+	if (err == MPOOL_EMPTY_POOL && busy)
+		err = MPOOL_BUSY;
+	return err;
+}
+
+
+/* Huge pages are taken to be 2MB, the default size on x86-64 and arm64 */
+#define HUGE_PAGE_SIZE ((size_t) 2 << 20)
+
+/* Flags that change where the memory of a blob comes from */
+#define BACKING_FLAGS (MPOOL_MMAP | MPOOL_HUGEPAGES | MPOOL_PREFAULT | MPOOL_NUMA_BIND)
+
+/* Largest NUMA node MPOOL_NUMA_BIND accepts, and the mbind() policy used */
+#define MAX_NUMA_NODE 1023
+#define NUMA_MPOL_BIND 2
+
+#define ROUND_UP(n, to) (((n) + (to) - 1) / (to) * (to))
+
+#ifdef HAVE_MMAP
+/**
+ * _map_aligned() - mmap anonymous memory aligned to @align
+ * @len: Length of the mapping, a multiple of the page size
+ * @align: Alignment wanted, a multiple of the page size
+ * @flags: Extra mmap() flags
+ *
+ * Returns: The mapping, or MAP_FAILED
+ *
+ * Transparent huge pages can only back the 2MB aligned parts of a mapping, so
+ * a little extra is mapped and the ends are trimmed off.
+ */
+static void* _map_aligned (size_t len, size_t align, int flags)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t extra = align > page ? align : 0;
+
+	char* addr = mmap(NULL, len + extra, PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if (addr == MAP_FAILED || extra == 0)
+		return addr;
+
+	char* aligned = (char*) ROUND_UP((uintptr_t) addr, align);
+	if (aligned > addr)
+		munmap(addr, (size_t)(aligned - addr));
+	if (aligned + len < addr + len + extra)
+		munmap(aligned + len, (size_t)((addr + len + extra) - (aligned + len)));
+	return aligned;
+}
+#endif
+
+
+/**
+ * _init_threads() - Amount of threads to partition a blob of @size bytes with
+ * @pool: Pool the blob belongs to
+ * @size: Size of the blob
+ *
+ * Returns: 1 or less if the calling thread should do it all by itself
+ */
+static int _init_threads (struct mpool* pool, size_t size)
+{
+#ifdef MULTITHREAD
+	if (size < PARALLEL_INIT_MIN)
+		return 1;
+	return pool->init_threads;
+#else
+	(void) pool;
+	(void) size;
+	return 1;
+#endif
+}
+
+
+/**
+ * _map_blob() - Get the memory for a blob
+ * @pool: Pool the blob belongs to, its @backing says where memory comes from
+ * @blob: Blob with @size set, @base and @map_size are filled in
+ *
+ * By default this is just malloc(), or posix_memalign() if the pool has an 
+ * @alignment. With MPOOL_MMAP (or any flag implying it)
+ * the blob is an anonymous mapping of its own:
+ *
+ * - MPOOL_HUGEPAGES first tries MAP_HUGETLB, which needs huge pages reserved 
+ *   by the admin, then falls back to a 2MB aligned mapping with 
+ *   madvise(MADV_HUGEPAGE) so transparent huge pages may back it.
+ * - MPOOL_NUMA_BIND binds the mapping to @numa_node with mbind(), before any
+ *   page of it is touched.
+ * - MPOOL_PREFAULT faults every page in up front, with MAP_POPULATE where 
+ *   possible. Blobs that are partitioned by more than one thread are 
+ *   faulted in by those threads instead, see _partition_blob().
+ */
+static mpool_error _map_blob (struct mpool* pool, struct _blob* blob)
+{
+	if (!(pool->backing & BACKING_FLAGS)) {
+		blob->map_size = 0;
+		if (pool->alignment <= sizeof(void*)) {
+			blob->base = malloc(blob->size);
+			return blob->base ? MPOOL_SUCCESS : MPOOL_ERR_ALLOC;
+		}
+		void* base = NULL;
+		if (posix_memalign(&base, pool->alignment, blob->size ? blob->size : 1) != 0)
+			return MPOOL_ERR_ALLOC;
+		blob->base = base;
+		return MPOOL_SUCCESS;
+	}
+
+#ifdef HAVE_MMAP
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t len = ROUND_UP(blob->size ? blob->size : 1, page);
+	int hugepages = (pool->backing & MPOOL_HUGEPAGES) != 0;
+	int prefault = (pool->backing & MPOOL_PREFAULT) != 0 && 
+		_init_threads(pool, blob->size) <= 1;
+	size_t align = pool->alignment > page ? pool->alignment : page;
+	int flags = 0;
+	void* addr = MAP_FAILED;
+
+#ifdef __linux__
+	/* Populating at mmap() time would place the pages before mbind() or 
+	 * madvise() got a say, so those cases touch the pages afterwards.
+	 */
+	if (prefault && !hugepages && !(pool->backing & MPOOL_NUMA_BIND)) {
+		flags |= MAP_POPULATE;
+		prefault = 0;
+	}
+
+	if (hugepages && align <= HUGE_PAGE_SIZE) {
+		size_t huge_len = ROUND_UP(blob->size ? blob->size : 1, HUGE_PAGE_SIZE);
+		addr = mmap(NULL, huge_len, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flags, -1, 0);
+		if (addr != MAP_FAILED)
+			len = huge_len;
+	}
+#endif
+
+	if (addr == MAP_FAILED) {
+		if (hugepages)
+			len = ROUND_UP(len, HUGE_PAGE_SIZE);
+		if (hugepages && align < HUGE_PAGE_SIZE)
+			align = HUGE_PAGE_SIZE;
+		addr = _map_aligned(len, align, flags);
+		if (addr == MAP_FAILED)
+			return MPOOL_ERR_ALLOC;
+#ifdef MADV_HUGEPAGE
+		if (hugepages)
+			madvise(addr, len, MADV_HUGEPAGE);
+#endif
+	}
+
+#ifdef __linux__
+	if (pool->backing & MPOOL_NUMA_BIND) {
+		unsigned long mask[(MAX_NUMA_NODE + 1) / (8 * sizeof(unsigned long))] = { 0 };
+		size_t bits = 8 * sizeof(unsigned long);
+
+		mask[pool->numa_node / bits] |= 1UL << (pool->numa_node % bits);
+		if (syscall(SYS_mbind, addr, len, NUMA_MPOL_BIND, mask, 
+				sizeof(mask) * 8 + 1, 0) != 0) {
+			munmap(addr, len);
+			return MPOOL_ERR_ALLOC;
+		}
+	}
+#endif
+
+	if (prefault) {
+		for (size_t offset = 0; offset < len; offset += page)
+			((volatile char*) addr)[offset] = 0;
+	}
+
+	blob->base = addr;
+	blob->map_size = len;
+	return MPOOL_SUCCESS;
+#else
+	return MPOOL_ERR_INVALID_ARG;
+#endif
+}
+
+
+/**
+ * _unmap_blob() - Give back the memory of a blob, see _map_blob()
+ * @blob: Blob to release
+ */
+static void _unmap_blob (struct _blob* blob)
+{
+	/* Whatever gets this memory next must not find it poisoned */
+	ASAN_UNPOISON_MEMORY_REGION(blob->base, blob->size);
+#ifdef HAVE_MMAP
+	if (blob->map_size > 0) {
+		munmap(blob->base, blob->map_size);
+		return;
+	}
+#endif
+	free(blob->base);
+}
+
+
+/**
+ * struct _init_job - One thread's part of partitioning a blob
+ * @pool: Pool the blob belongs to
+ * @blob: Blob being partitioned
+ * @lo: First block of the part
+ * @hi: One past the last block of the part
+ * @shard: With MPOOL_FIRST_TOUCH, the shard the part goes to, else -1
+ * @link: Whether to link the blocks up, or only fault the pages in
+ */
+struct _init_job {
+	struct mpool* pool;
+	struct _blob* blob;
+	int32_t lo;
+	int32_t hi;
+	int shard;
+	int link;
+#ifdef MULTITHREAD
+	pthread_t thread;
+	int started;
+#endif
+};
+
+
+/**
+ * _init_worker() - Prefault and link up one part of a blob, see _init_parallel()
+ * @arg: The struct _init_job of the part
+ *
+ * Every block of the part links to the one after it, including the last, so 
+ * the parts splice together on their own. The caller ends each shard's run.
+ */
+static void* _init_worker (void* arg)
+{
+	struct _init_job* job = arg;
+	struct mpool* pool = job->pool;
+	char* start = job->blob->base + (size_t) job->lo * pool->stride;
+	char* end = job->blob->base + (size_t) job->hi * pool->stride;
+
+#ifdef __linux__
+	/* The CPUs that _home_shard() sends to the shard */
+	if (job->shard >= 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		for (long c = job->shard; c < ncpus && c < CPU_SETSIZE; c += pool->nshards)
+			CPU_SET(c, &cpus);
+		if (CPU_COUNT(&cpus) > 0)
+			pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#endif
+
+	/* Each page is touched by the part holding its first byte, so no part 
+	 * writes into the blocks of another
+	 */
+	if ((pool->backing & MPOOL_PREFAULT) && job->blob->map_size > 0) {
+		size_t page = (size_t) sysconf(_SC_PAGESIZE);
+		char* p = (char*) ROUND_UP((uintptr_t) start, page);
+		if (job->hi == job->blob->count)
+			end = job->blob->base + job->blob->map_size;
+		for (; p < end; p += page)
+			*(volatile char*) p = 0;
+		end = job->blob->base + (size_t) job->hi * pool->stride;
+	}
+
+	if (job->link)
+		for (char* b = start; b < end; b += pool->stride)
+			((struct _block*) b)->next = (struct _block*)(b + pool->stride);
+	return NULL;
+}
+
+
+/**
+ * _init_parallel() - Split the work of partitioning a blob over threads
+ * @pool: Pool the blob belongs to
+ * @blob: Blob being partitioned
+ * @nthreads: Amount of threads, see _init_threads()
+ * @link: Whether to link the blocks up, or only fault the pages in
+ *
+ * The blob is cut into @nthreads equal parts, or with MPOOL_FIRST_TOUCH into 
+ * the runs of the shards, each handled by a thread of its own. A part whose
+ * thread couldn't be started is done by the calling thread, so this always 
+ * gets the whole blob done.
+ */
+static void _init_parallel (struct mpool* pool, struct _blob* blob, int nthreads, 
+		int link)
+{
+	struct _init_job whole = { .pool = pool, .blob = blob, .lo = 0, 
+		.hi = blob->count, .shard = -1, .link = link };
+	if (nthreads > blob->count)
+		nthreads = blob->count;
+	struct _init_job* jobs = calloc((size_t) nthreads, sizeof(struct _init_job));
+	if (jobs == NULL) {
+		_init_worker(&whole);
+		return;
+	}
+
+	for (int t = 0; t < nthreads; t++) {
+		jobs[t] = whole;
+		jobs[t].lo = (int32_t)((int64_t) blob->count * t / nthreads);
+		jobs[t].hi = (int32_t)((int64_t) blob->count * (t + 1) / nthreads);
+		jobs[t].shard = pool->first_touch ? t : -1;
+	}
+
+#ifdef MULTITHREAD
+	for (int t = 0; t < nthreads; t++)
+		jobs[t].started = pthread_create(&jobs[t].thread, NULL, _init_worker, 
+			&jobs[t]) == 0;
+	for (int t = 0; t < nthreads; t++) {
+		if (jobs[t].started)
+			pthread_join(jobs[t].thread, NULL);
+		else
+			_init_worker(&jobs[t]);
+	}
+#else
+	for (int t = 0; t < nthreads; t++)
+		_init_worker(&jobs[t]);
+#endif
+	free(jobs);
+}
+
+
+/**
+ * _partition_blob - Split the blob of memory into list of blocks
+ * @pool: struct mpool* that holds the raw blob
+ * @blob: Blob that should be partitioned
+ *
+ * This function converts a raw chunk of allocated memory into a linked list 
+ * of _blocks, one every @stride bytes. The list is built in address order 
+ * outside of the lock, then spliced onto the front of the pool's free list
+ * in one go, split evenly over the shards. Lazy pools skip this, their 
+ * blocks are carved as they are needed instead (see _carve()).
+ *
+ * With @init_threads, large blobs are linked up (and prefaulted) by that many
+ * threads at once, see _init_parallel().
+ */
+static mpool_error _partition_blob (struct mpool* pool, struct _blob* blob)
+{
+	if (blob->count == 0)
+		return MPOOL_SUCCESS;
+
+	int nthreads = _init_threads(pool, blob->size);
+	int link = !pool->lazy && !pool->ordered;
+	if (nthreads > 1 && (link || (pool->backing & MPOOL_PREFAULT)))
+		_init_parallel(pool, blob, nthreads, link);
+	else
+		nthreads = 1;
+
+	/* Address ordered pools never write into their free blocks, so they are
+	 * as lazy as it gets anyway.
+	 */
+	if (pool->lazy && !pool->ordered)
+		return MPOOL_SUCCESS;
+	atomic_store_explicit(&blob->carved, blob->count, memory_order_relaxed);
+#ifdef MPOOL_POISON
+	for (int32_t i = 0; i < blob->count; i++)
+		_debug_free(pool, blob->base + (size_t) i * pool->stride);
+#endif
+
+	/* Every block starts out free */
+	if (pool->safe_mode == SAFE) {
+		for (int32_t w = 0; w < blob->count / 64; w++)
+			atomic_store_explicit(&blob->free_map[w], ~(uint64_t) 0, memory_order_relaxed);
+		if (blob->count % 64)
+			atomic_store_explicit(&blob->free_map[MAP_WORD(blob->count)], 
+				MAP_BIT(blob->count) - 1, memory_order_relaxed);
+	}
+	if (pool->ordered)
+		return _ordered_fill(pool, blob);
+
+	/* Each shard gets an equal run of the blob */
+	for (int s = 0; s < pool->nshards; s++) {
+		int32_t lo = (int32_t)((int64_t) blob->count * s / pool->nshards);
+		int32_t hi = (int32_t)((int64_t) blob->count * (s + 1) / pool->nshards);
+		if (lo == hi)
+			continue;
+
+		/* Because void* pointer arithmatic is undefined, have to cast 
+		 * to a complete type, then back to void* 
+		 */
+		struct _magazine chain;
+		chain.head = (struct _block*)(blob->base + (size_t) lo * pool->stride);
+		chain.tail = (struct _block*)(blob->base + (size_t)(hi - 1) * pool->stride);
+		chain.count = hi - lo;
+		if (nthreads == 1)
+			for (struct _block* b = chain.head; b != chain.tail; b = b->next)
+				b->next = (struct _block*)((char*) b + pool->stride);
+		chain.tail->next = NULL;
+
+		mpool_error err = _shard_add_chain(pool, &pool->shards[s], &chain);
+		if (err != MPOOL_SUCCESS)
+			return err;
+	}
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _add_blob() - Allocate a new blob and add its blocks to the pool
+ * @pool: Pool to add the blob to
+ * @count: Amount of blocks the blob should hold
+ *
+ * The blob's slot indexes follow on from the last blob. A new struct 
+ * _blob_table holding it is published before any of its blocks go onto the 
+ * free list, so any thread that gets one of the new blocks can also find its 
+ * blob. The caller must hold the grow_mutex, or be the only thread using the
+ * pool.
+ */
+static mpool_error _add_blob (struct mpool* pool, int32_t count)
+{
+	struct _blob_table* old = atomic_load_explicit(&pool->blob_table, 
+		memory_order_relaxed);
+	int n = old ? old->count : 0;
+
+	struct _blob* blob = calloc(1, sizeof(struct _blob));
+	if (blob == NULL) return MPOOL_ERR_ALLOC;
+	blob->size = pool->stride * count;
+	blob->count = count;
+	blob->first = n > 0 ? old->by_index[n - 1]->first + old->by_index[n - 1]->count : 0;
+	atomic_init(&blob->carved, 0);
+	mpool_error err = _map_blob(pool, blob);
+	if (err != MPOOL_SUCCESS) {
+		free(blob);
+		return err;
+	}
+	atomic_init(&blob->fresh, blob->map_size > 0 ? 0 : count);
+	blob->free_map = calloc((size_t) MAP_WORD(count) + 1, sizeof(uint64_t));
+	if (pool->handles)
+		blob->generation = calloc((size_t) count, sizeof(uint8_t));
+	if (pool->ordered)
+		blob->avail_map = calloc((size_t) MAP_WORD(count) + 1, sizeof(uint64_t));
+
+	struct _blob_table* table = malloc(sizeof(struct _blob_table) + 
+		sizeof(struct _blob*) * 2 * (n + 1));
+	if (blob->free_map == NULL || table == NULL || 
+			(pool->handles && blob->generation == NULL) ||
+			(pool->ordered && blob->avail_map == NULL)) {
+		_unmap_blob(blob);
+		free(blob->free_map);
+		free(blob->generation);
+		free(blob->avail_map);
+		free(blob);
+		free(table);
+		return MPOOL_ERR_ALLOC;
+	}
+
+	table->count = n + 1;
+	table->by_index = (struct _blob**)(table + 1);
+	table->by_addr = table->by_index + n + 1;
+	table->older = old;
+	if (n > 0) {
+		memcpy(table->by_index, old->by_index, sizeof(struct _blob*) * n);
+		memcpy(table->by_addr, old->by_addr, sizeof(struct _blob*) * n);
+	}
+	table->by_index[n] = blob;
+
+	int i = n;
+	while (i > 0 && (uintptr_t) table->by_addr[i - 1]->base > (uintptr_t) blob->base) {
+		table->by_addr[i] = table->by_addr[i - 1];
+		i--;
+	}
+	table->by_addr[i] = blob;
+
+	atomic_store_explicit(&pool->blob_table, table, memory_order_release);
+
+	/* The capacity only changes once the blocks are on the free list, so a 
+	 * thread that sees the new capacity in _grow() also finds the blocks
+	 */
+	if ((err = _partition_blob(pool, blob)) != MPOOL_SUCCESS)
+		return err;
+	pool->capacity += count;
+	if (n > 0) {
+		STAT_ADD(pool, grows, 1);
+		_stat_peak(pool, NULL, NULL);
+		HOOK(pool, grow, pool->capacity - count, pool->capacity);
+	}
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _grow() - Grow the pool by its growth policy after it ran empty
+ * @pool: Pool with a growth policy
+ * @seen_capacity: Capacity of the pool when the caller found it empty
+ * @max_capacity: Largest capacity the caller wants, the pool's own 
+ * @max_capacity still applies
+ *
+ * Returns: MPOOL_SUCCESS if the caller should try again, MPOOL_EMPTY_POOL if
+ * the pool can't grow any more, else the corresponding error code.
+ *
+ * Each step multiplies the capacity by @growth_factor (adding at least 
+ * @min_grow blocks), so the cost of growing is amortized O(1) per block. When
+ * many threads run into an empty pool at once, only the first one grows it; 
+ * the rest see the capacity has changed and just try again.
+ */
+static mpool_error _grow (struct mpool* pool, int32_t seen_capacity, 
+		int32_t max_capacity)
+{
+	mpool_error err = MPOOL_SUCCESS;
+
+	if (pool->growth_factor == 0)
+		return MPOOL_EMPTY_POOL;
+	if (max_capacity > pool->max_capacity)
+		max_capacity = pool->max_capacity;
+
+#ifdef MULTITHREAD
+	if (_lock(pool, &pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
+	int32_t capacity = pool->capacity;
+	if (capacity == seen_capacity) {
+		double target = (double) capacity * pool->growth_factor;
+		if (target > (double) max_capacity)
+			target = (double) max_capacity;
+
+		int64_t extra = (int64_t) target - capacity;
+		if (extra < pool->min_grow)
+			extra = pool->min_grow;
+		if (extra > (int64_t) max_capacity - capacity)
+			extra = (int64_t) max_capacity - capacity;
+
+		err = extra > 0 ? _add_blob(pool, (int32_t) extra) : MPOOL_EMPTY_POOL;
+	}
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	return err;
+}
+
+
+#ifdef MULTITHREAD
+
+/* Amount of full magazines the depot holds before they go back to the list */
+#define DEPOT_SIZE 64
+
+/* Magazine size used when mpool_thread_cache_enable() is given 0 */
+#define DEFAULT_MAGAZINE_SIZE 32
+
+static pthread_once_t _tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _tcache_key;
+static int _tcache_key_ok = 0;
+static LOCK_TYPE _tcache_mutex = MUTEX_INITIALIZER;
+static _Atomic uint64_t _next_pool_id = 1;
+
+/* Ids are never reused, so a thread cache can't outlive its pool unnoticed */
+static uint64_t _new_pool_id (void)
+{
+	return atomic_fetch_add_explicit(&_next_pool_id, 1, memory_order_relaxed);
+}
+
+
+/* Clock mpool_alloc_wait() measures its timeout with, where it can be chosen */
+#ifdef __linux__
+#	define WAIT_CLOCK CLOCK_MONOTONIC
+#else
+#	define WAIT_CLOCK CLOCK_REALTIME
+#endif
+
+/* Longest first sleep of mpool_alloc_wait(), see there */
+#define WAIT_FIRST_NS 1000000
+
+/**
+ * _wait_deadline() - Get the time @ns nanoseconds from now on WAIT_CLOCK
+ */
+static struct timespec _wait_deadline (int64_t ns)
+{
+	struct timespec ts;
+	clock_gettime(WAIT_CLOCK, &ts);
+	ts.tv_sec += (time_t)(ns / 1000000000);
+	ts.tv_nsec += (long)(ns % 1000000000);
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return ts;
+}
+
+/**
+ * _init_wait() - Set up what mpool_alloc_wait() sleeps on
+ * @pool: Pool being init
+ *
+ * Returns: 0 on success, like MUTEX_INIT()
+ */
+static int _init_wait (struct mpool* pool)
+{
+	pthread_condattr_t attr;
+	int err = pthread_condattr_init(&attr);
+	if (err != 0)
+		return err;
+#ifdef __linux__
+	err |= pthread_condattr_setclock(&attr, WAIT_CLOCK);
+#endif
+	err |= pthread_cond_init(&pool->wait_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	atomic_init(&pool->wait_used, 0);
+	atomic_init(&pool->waiters, 0);
+	atomic_init(&pool->wakeups, 0);
+	return err | MUTEX_INIT(&pool->wait_mutex, NULL);
+}
+
+
+/**
+ * _limbo_push() - Add a retired block to a limbo list
+ * @limbo: List to add to
+ * @item: Block retired
+ */
+static mpool_error _limbo_push (struct _limbo* limbo, void* item)
+{
+	if (limbo->count == limbo->size) {
+		int32_t size = limbo->size ? limbo->size * 2 : EPOCH_BATCH;
+		void** items = realloc(limbo->items, sizeof(void*) * (size_t) size);
+		if (items == NULL)
+			return MPOOL_ERR_ALLOC;
+		limbo->items = items;
+		limbo->size = size;
+	}
+	limbo->items[limbo->count++] = item;
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _limbo_release() - Give every block of a limbo list back to the pool
+ * @pool: Pool the blocks belong to
+ * @limbo: List whose blocks no reader can see anymore
+ *
+ * Now they can be linked up like any free block, and go back in one chain.
+ */
+static mpool_error _limbo_release (struct mpool* pool, struct _limbo* limbo)
+{
+	if (limbo->count == 0)
+		return MPOOL_SUCCESS;
+
+	struct _magazine chain = { NULL, NULL, 0 };
+	for (int32_t i = 0; i < limbo->count; i++) {
+		HOOK(pool, free, limbo->items[i]);
+		_debug_free(pool, limbo->items[i]);
+		_magazine_push(&chain, limbo->items[i]);
+	}
+
+	int home = _home_shard(pool);
+	mpool_error err = _add_chain(pool, &chain, home);
+	if (err == MPOOL_SUCCESS) {
+		_stat_free(pool, home, limbo->count);
+		limbo->count = 0;
+	}
+	return err;
+}
+
+
+/**
+ * _return_magazine() - Hand a full magazine back to the pool
+ * @pool: Pool to give the blocks back to
+ * @mag: Magazine to give back, it is emptied
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * The magazine is parked in the depot if there is room, otherwise its chain is
+ * spliced back onto the first shard. Both are O(1) under a single lock. Lock-free 
+ * pools have no depot, the chain is pushed straight onto the free list.
+ */
+static mpool_error _return_magazine (struct mpool* pool, struct _magazine* mag, 
+		int home)
+{
+	mpool_error err = MPOOL_SUCCESS;
+
+	if (mag->count == 0)
+		return MPOOL_SUCCESS;
+
+	if (pool->lock_free) {
+		err = _add_chain(pool, mag, home);
+		if (err == MPOOL_SUCCESS)
+			*mag = (struct _magazine) { NULL, NULL, 0 };
+		return err;
+	}
+
+	struct _shard* shard = pool->shards;
+	if (_lock(pool, &shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+
+	if (pool->depot_count < DEPOT_SIZE) {
+		pool->depot[pool->depot_count++] = *mag;
+	} else {
+		mag->tail->next = shard->list;
+		shard->list = mag->head;
+		atomic_fetch_add_explicit(&shard->size, mag->count, memory_order_relaxed);
+	}
+
+	if (MUTEX_UNLOCK(&shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+
+	*mag = (struct _magazine) { NULL, NULL, 0 };
+	_wake_waiters(pool, 1);
+	return err;
+}
+
+
+/**
+ * _fill_magazine() - Fill an empty magazine from the pool
+ * @pool: Pool to take the blocks from
+ * @mag: Empty magazine to fill
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * A full magazine from the depot is taken if there is one, otherwise up to 
+ * @magazine_size blocks are taken from the free list by _remove_chain().
+ */
+static mpool_error _fill_magazine (struct mpool* pool, struct _magazine* mag, int home)
+{
+	if (pool->lock_free)
+		return _remove_chain(pool, pool->magazine_size, mag, home);
+
+	struct _shard* shard = pool->shards;
+	if (_lock(pool, &shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+
+	int got = pool->depot_count > 0;
+	if (got)
+		*mag = pool->depot[--pool->depot_count];
+
+	if (MUTEX_UNLOCK(&shard->mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+	return got ? MPOOL_SUCCESS : _remove_chain(pool, pool->magazine_size, mag, home);
+}
+
+
+/**
+ * _thread_cache_exit() - pthread key destructor, flushes a thread's caches
+ * @arg: First struct _thread_cache of the exiting thread
+ *
+ * Every cache whose pool is still alive has its blocks handed back to the 
+ * pool, and is then unlinked and freed.
+ */
+static void _thread_cache_exit (void* arg)
+{
+	struct _thread_cache* tc = arg;
+
+	MUTEX_LOCK(&_tcache_mutex);
+	while (tc) {
+		struct _thread_cache* next = tc->next_local;
+		struct mpool* pool = tc->pool;
+
+		if (pool != NULL) {
+			int home = _home_shard(pool);
+			_return_magazine(pool, &tc->loaded, home);
+			_return_magazine(pool, &tc->previous, home);
+
+			/* Readers may still see what it retired, the pool holds on. If
+			 * there is no memory for that, the blocks are lost instead.
+			 */
+			for (int i = 0; i < EPOCH_LISTS; i++)
+				for (int32_t j = 0; j < tc->limbo[i].count; j++)
+					_limbo_push(&pool->orphans, tc->limbo[i].items[j]);
+			pool->orphans.epoch = atomic_load(&pool->epoch);
+
+			if (tc->prev) tc->prev->next = tc->next;
+			else pool->caches = tc->next;
+			if (tc->next) tc->next->prev = tc->prev;
+		}
+
+		for (int i = 0; i < EPOCH_LISTS; i++)
+			free(tc->limbo[i].items);
+		free(tc);
+		tc = next;
+	}
+	MUTEX_UNLOCK(&_tcache_mutex);
+}
+
+
+static void _tcache_key_init (void)
+{
+	_tcache_key_ok = pthread_key_create(&_tcache_key, _thread_cache_exit) == 0;
+}
+
+
+/**
+ * _find_thread_cache() - Find the calling thread's cache for a pool
+ * @pool: Pool to find the cache of
+ *
+ * Returns: The cache, or NULL if this thread hasn't used @pool yet
+ */
+static inline struct _thread_cache* _find_thread_cache (struct mpool* pool)
+{
+	struct _thread_cache* tc = pthread_getspecific(_tcache_key);
+
+	while (tc && tc->pool_id != pool->id)
+		tc = tc->next_local;
+	return tc;
+}
+
+
+/**
+ * _get_thread_cache() - Find or create the calling thread's cache for a pool
+ * @pool: Pool to get the cache of
+ *
+ * Returns: The cache, or NULL if one couldn't be allocated
+ *
+ * When a new cache needs to be created, the thread's caches of pools that 
+ * have since been freed are also cleaned up, so threads that outlive many 
+ * pools don't collect dead caches.
+ */
+static struct _thread_cache* _get_thread_cache (struct mpool* pool)
+{
+	struct _thread_cache* tc = _find_thread_cache(pool);
+	if (tc != NULL)
+		return tc;
+
+	tc = calloc(1, sizeof(struct _thread_cache));
+	if (tc == NULL)
+		return NULL;
+	tc->pool = pool;
+	tc->pool_id = pool->id;
+
+	if (MUTEX_LOCK(&_tcache_mutex) != 0) {
+		free(tc);
+		return NULL;
+	}
+
+	struct _thread_cache** link = &tc->next_local;
+	*link = pthread_getspecific(_tcache_key);
+	while (*link) {
+		struct _thread_cache* dead = *link;
+		if (dead->pool != NULL) {
+			link = &dead->next_local;
+			continue;
+		}
+		*link = dead->next_local;
+		for (int i = 0; i < EPOCH_LISTS; i++)
+			free(dead->limbo[i].items);
+		free(dead);
+	}
+
+	tc->next = pool->caches;
+	if (pool->caches) pool->caches->prev = tc;
+	pool->caches = tc;
+	MUTEX_UNLOCK(&_tcache_mutex);
+
+	pthread_setspecific(_tcache_key, tc);
+	return tc;
+}
+
+
+/**
+ * _epoch_thread() - Get the calling thread's cache, to use for the epoch
+ * @pool: Pool to get the cache of
+ *
+ * Any thread using the epoch of a pool has a cache, even if the pool has 
+ * thread caches disabled. Its magazines just stay empty then.
+ */
+static struct _thread_cache* _epoch_thread (struct mpool* pool)
+{
+	pthread_once(&_tcache_once, _tcache_key_init);
+	if (!_tcache_key_ok)
+		return NULL;
+	return _get_thread_cache(pool);
+}
+
+
+/**
+ * _epoch_drain() - Give back the blocks a thread retired two or more epochs ago
+ * @pool: Pool the blocks belong to
+ * @tc: Calling thread's cache
+ * @epoch: Current epoch of the pool
+ *
+ * A reader that could still see a block retired in epoch e entered in e at 
+ * the latest, and holds the pool back from getting past e + 1. So once the 
+ * pool is at e + 2, nothing can see the block anymore.
+ */
+static mpool_error _epoch_drain (struct mpool* pool, struct _thread_cache* tc, 
+		uint64_t epoch)
+{
+	for (int i = 0; i < EPOCH_LISTS; i++) {
+		struct _limbo* limbo = &tc->limbo[i];
+		if (limbo->count == 0 || limbo->epoch + 2 > epoch)
+			continue;
+		mpool_error err = _limbo_release(pool, limbo);
+		if (err != MPOOL_SUCCESS)
+			return err;
+	}
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _epoch_advance() - Move the pool to the next epoch if everyone saw this one
+ * @pool: Pool to advance
+ *
+ * Threads outside of a critical section never hold the epoch back. The blocks
+ * orphaned by threads that exited are given back here once they are safe.
+ */
+static mpool_error _epoch_advance (struct mpool* pool)
+{
+	mpool_error err = MPOOL_SUCCESS;
+
+	if (MUTEX_LOCK(&_tcache_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+
+	uint64_t epoch = atomic_load(&pool->epoch);
+	struct _thread_cache* tc = pool->caches;
+	for (; tc; tc = tc->next) {
+		uint64_t seen = atomic_load(&tc->epoch);
+		if (seen != 0 && seen != epoch)
+			break;
+	}
+	if (tc == NULL)
+		atomic_store(&pool->epoch, ++epoch);
+
+	if (pool->orphans.epoch + 2 <= epoch)
+		err = _limbo_release(pool, &pool->orphans);
+
+	MUTEX_UNLOCK(&_tcache_mutex);
+	return err;
+}
+
+
+/**
+ * _cache_alloc() - Take a block out of the calling thread's cache
+ * @block: Where to put the block
+ * @pool: Pool with thread caches enabled
+ * @home: Calling thread's shard, from _home_shard()
+ */
+static mpool_error _cache_alloc (struct _block** block, struct mpool* pool, int home)
+{
+	struct _thread_cache* tc = _get_thread_cache(pool);
+	if (tc == NULL)
+		return MPOOL_ERR_ALLOC;
+
+	if (tc->loaded.count == 0) {
+		if (tc->previous.count > 0) {
+			struct _magazine tmp = tc->loaded;
+			tc->loaded = tc->previous;
+			tc->previous = tmp;
+		} else {
+			mpool_error err = _fill_magazine(pool, &tc->loaded, home);
+			if (err != MPOOL_SUCCESS) return err;
+		}
+	}
+
+	*block = _magazine_pop(&tc->loaded);
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _cache_dealloc() - Put a block into the calling thread's cache
+ * @block: Block being given back
+ * @pool: Pool with thread caches enabled
+ * @home: Calling thread's shard, from _home_shard()
+ */
+static mpool_error _cache_dealloc (struct _block* block, struct mpool* pool, int home)
+{
+	struct _thread_cache* tc = _get_thread_cache(pool);
+	if (tc == NULL)
+		return MPOOL_ERR_ALLOC;
+
+	if (tc->loaded.count >= pool->magazine_size) {
+		if (tc->previous.count == 0) {
+			tc->previous = tc->loaded;
+			tc->loaded = (struct _magazine) { NULL, NULL, 0 };
+		} else {
+			mpool_error err = _return_magazine(pool, &tc->previous, home);
+			if (err != MPOOL_SUCCESS) return err;
+			tc->previous = tc->loaded;
+			tc->loaded = (struct _magazine) { NULL, NULL, 0 };
+		}
+	}
+
+	_magazine_push(&tc->loaded, block);
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _try_cache_alloc() - _cache_alloc() for mpool_try_alloc()
+ * @block: Where to put the block
+ * @pool: Pool with thread caches enabled
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * Only blocks already in the calling thread's magazines are taken from the 
+ * cache, filling one means locking the pool, so then _try_remove_block() is 
+ * used instead.
+ */
+static mpool_error _try_cache_alloc (struct _block** block, struct mpool* pool, 
+		int home)
+{
+	pthread_once(&_tcache_once, _tcache_key_init);
+	struct _thread_cache* tc = _tcache_key_ok ? _find_thread_cache(pool) : NULL;
+
+	if (tc == NULL || (tc->loaded.count == 0 && tc->previous.count == 0))
+		return _try_remove_block(block, pool, home);
+	return _cache_alloc(block, pool, home);
+}
+
+
+/* Blocks the owner takes from the free list when it has none of its own */
+#define OWNER_BATCH 32
+
+/* Most blocks the owner keeps, past this half of them go back to the pool */
+#define OWNER_MAX 256
+
+static inline int _is_owner (struct mpool* pool)
+{
+	return pool->owned && pthread_equal(pthread_self(), pool->owner);
+}
+
+
+/**
+ * _owner_alloc() - Take a block for the owner thread of the pool
+ * @block: Where to put the block
+ * @pool: Pool with an owner, must be called from the owner thread
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * Blocks come from the owner's own list first, then from the blocks other
+ * threads freed, which are all taken with one atomic exchange, and last from
+ * the pool's free list a batch at a time.
+ */
+static mpool_error _owner_alloc (struct _block** block, struct mpool* pool, int home)
+{
+	struct _magazine* own = &pool->owner_list;
+
+	if (own->count == 0 && atomic_load_explicit(&pool->remote, memory_order_relaxed)) {
+		struct _block* b = atomic_exchange_explicit(&pool->remote, NULL, 
+			memory_order_acquire);
+		while (b != NULL) {
+			struct _block* next = b->next;
+			_magazine_push(own, b);
+			b = next;
+		}
+	}
+
+	if (own->count == 0) {
+		mpool_error err = _remove_chain(pool, OWNER_BATCH, own, home);
+		if (err != MPOOL_SUCCESS)
+			return err;
+	}
+
+	*block = _magazine_pop(own);
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _owner_dealloc() - Give a block back to a pool with an owner
+ * @block: Block being given back
+ * @pool: Pool with an owner
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * The owner keeps its blocks without locking. Other threads push theirs onto
+ * @remote, so freeing never touches the free list lock or the owner's list.
+ */
+static mpool_error _owner_dealloc (struct _block* block, struct mpool* pool, int home)
+{
+	if (!_is_owner(pool)) {
+		struct _block* head = atomic_load_explicit(&pool->remote, memory_order_relaxed);
+		do {
+			block->next = head;
+		} while (!atomic_compare_exchange_weak_explicit(&pool->remote, &head, 
+			block, memory_order_release, memory_order_relaxed));
+		/* The owner may be in mpool_alloc_wait(), it takes from @remote too */
+		_wake_waiters(pool, 0);
+		return MPOOL_SUCCESS;
+	}
+
+	struct _magazine* own = &pool->owner_list;
+	if (own->count >= OWNER_MAX) {
+		struct _magazine spill;
+		mpool_error err = _take_magazine(own, OWNER_MAX / 2, &spill);
+		if (err == MPOOL_SUCCESS)
+			err = _add_chain(pool, &spill, home);
+		if (err != MPOOL_SUCCESS)
+			return err;
+	}
+	_magazine_push(own, block);
+	return MPOOL_SUCCESS;
+}
+
+#endif
+
+
+/**
+ * _bump_generation() - Move the handle generation of a block on or back
+ * @pool: Pool with MPOOL_HANDLES
+ * @item: Block whose generation changes
+ * @by: 1 when the block is freed, -1 to take that back
+ *
+ * Returns: 0 if @item isn't a block of the pool, else 1
+ */
+static int _bump_generation (struct mpool* pool, const void* item, int by)
+{
+	int32_t slot;
+	struct _blob* blob = _find_block(pool, item, &slot);
+	if (blob == NULL)
+		return 0;
+	atomic_store_explicit(&blob->generation[slot], (uint8_t)(atomic_load_explicit(
+		&blob->generation[slot], memory_order_relaxed) + by), memory_order_relaxed);
+	return 1;
+}
+
+
+/**
+ * _check_dealloc() - Check an address handed back to the pool 
+ * @pool: Pool the address is being given back to
+ * @item: Address given back
+ *
+ * Returns: MPOOL_SUCCESS if @item may go onto the free list, else 
+ * MPOOL_ERR_INVALID_ADDRESS or MPOOL_ERR_DOUBLE_FREE
+ *
+ * If safe mode is ON, check to make sure the address being passed back was
+ * one that was created by the pool and isn't already free, and mark it free.
+ * Lock-free pools can't hold an address without a slot index, so they always
+ * check that much. If the free then fails, _undo_dealloc() takes all of this 
+ * back.
+ */
+static mpool_error _check_dealloc (struct mpool* pool, void* item)
+{
+	mpool_error err = MPOOL_SUCCESS;
+
+	if (pool->safe_mode == SAFE)
+		err = _mark_free(pool, item);
+	else if (pool->lock_free && _slot_index(pool, item) < 0)
+		err = MPOOL_ERR_INVALID_ADDRESS;
+	if (err == MPOOL_SUCCESS && (err = _debug_check(pool, item)) != MPOOL_SUCCESS && 
+			pool->safe_mode == SAFE)
+		_mark_allocd(pool, item);
+
+	/* Bumped before the block is free, so whoever takes it next can't get a
+	 * handle with the old generation.
+	 */
+	if (err == MPOOL_SUCCESS && pool->handles && !_bump_generation(pool, item, 1))
+		return MPOOL_ERR_INVALID_ADDRESS;
+	return err;
+}
+
+
+/**
+ * _undo_dealloc() - Put a block that _check_dealloc() let through back in use
+ * @pool: Pool the address was given back to
+ * @item: Address that stays allocated, since it never made it to the pool
+ *
+ * The handles of @item work again after this, as its generation is moved back.
+ */
+static void _undo_dealloc (struct mpool* pool, void* item)
+{
+	if (pool->safe_mode == SAFE)
+		_mark_allocd(pool, item);
+	if (pool->handles)
+		_bump_generation(pool, item, -1);
+}
+
+
+/**
+ * _stride() - Distance between blocks of a pool
+ * @block_size: Size of each block, as given by the user
+ * @alignment: Alignment asked for, 0 for none
+ *
+ * Blocks are rounded up so an aligned struct _block fits inside of them, and
+ * then to a multiple of @alignment.
+ */
+static size_t _stride (size_t block_size, size_t alignment)
+{
+	size_t stride = block_size < sizeof(struct _block) ? 
+		sizeof(struct _block) : ROUND_UP(block_size, _Alignof(struct _block));
+	if (alignment > 0)
+		stride = ROUND_UP(stride, alignment);
+	return stride;
+}
+
+
+#ifdef HAVE_MMAP
+/* How long to wait for another process to finish making a shared pool */
+#define SHARED_WAIT_TRIES 1000
+#define SHARED_WAIT_NS 1000000
+
+/**
+ * _wrap_shared() - Make the struct mpool a process uses for a shared mapping
+ * @shared: Mapping, already set up
+ * @size: Size of the mapping
+ * @pool: Where to put the pool
+ *
+ * The struct mpool and its blob table are local to the process. The table has
+ * a single blob over the blocks of the mapping, so the lookups by address and
+ * by slot index (ie for handles) work as they do for other pools.
+ */
+static mpool_error _wrap_shared (struct _shared* shared, size_t size, struct mpool** pool)
+{
+	struct mpool* p = calloc(1, sizeof(struct mpool));
+	struct _blob* blob = calloc(1, sizeof(struct _blob));
+	struct _blob_table* table = malloc(sizeof(struct _blob_table) + 
+		sizeof(struct _blob*) * 2);
+	void* shards = NULL;
+
+	if (p == NULL || blob == NULL || table == NULL || 
+			posix_memalign(&shards, CACHE_LINE, sizeof(struct _shard)) != 0) {
+		free(p);
+		free(blob);
+		free(table);
+		return MPOOL_ERR_ALLOC;
+	}
+	memset(shards, 0, sizeof(struct _shard));
+
+	blob->base = (char*)(shared + 1);
+	blob->size = (size_t) shared->stride * (size_t) shared->capacity;
+	blob->count = shared->capacity;
+	atomic_init(&blob->carved, shared->capacity);
+	atomic_init(&blob->fresh, shared->capacity);
+
+	table->count = 1;
+	table->by_index = (struct _blob**)(table + 1);
+	table->by_addr = table->by_index + 1;
+	table->by_index[0] = table->by_addr[0] = blob;
+	table->older = NULL;
+
+	p->shards = shards;
+	p->nshards = 1;
+	atomic_init(&p->shards[0].size, 0);
+	atomic_init(&p->shards[0].lf_head, LF_HEAD(0, 0));
+	p->lock_free = 1;
+	p->block_size = (size_t) shared->block_size;
+	p->stride = (size_t) shared->stride;
+	atomic_init(&p->carve_blob, 0);
+	atomic_init(&p->capacity, shared->capacity);
+	atomic_init(&p->blob_table, table);
+	p->max_capacity = shared->capacity;
+	p->shared = shared;
+	p->shared_size = size;
+	p->safe_mode = UNSAFE;
+
+#ifdef MULTITHREAD
+	atomic_init(&p->epoch, 1);
+	p->id = _new_pool_id();
+	if (MUTEX_INIT(&p->shards[0].mutex, NULL) != 0 || 
+			MUTEX_INIT(&p->grow_mutex, NULL) != 0) {
+		free(table);
+		free(blob);
+		free(shards);
+		free(p);
+		return MPOOL_ERR_MUTEX;
+	}
+#endif
+	*pool = p;
+	return MPOOL_SUCCESS;
+}
+
+
+/**
+ * _map_shared() - Map a shared pool from a file descriptor
+ * @fd: Descriptor of the shared memory object (or file)
+ * @block_size: Block size of the pool
+ * @capacity: Capacity of the pool, 0 to take whatever it was made with
+ * @create: Whether the caller just made @fd and should set the pool up
+ * @pool: Where to put the pool
+ *
+ * A process attaching to a pool that another one is still setting up waits 
+ * for it for up to a second, going by the size of @fd and the header's magic.
+ * If the magic still isn't there after that, whoever made @fd died before it
+ * was done and MPOOL_ERR_CORRUPTED is returned.
+ */
+static mpool_error _map_shared (int fd, size_t block_size, int32_t capacity, 
+		int create, struct mpool** pool)
+{
+	size_t stride = _stride(block_size, 0);
+	struct _shared* shared = NULL;
+	size_t size = 0;
+
+	if (create) {
+		size = sizeof(struct _shared) + stride * (size_t) capacity;
+		if (ftruncate(fd, (off_t) size) != 0)
+			return MPOOL_ERR_ALLOC;
+		shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (shared == MAP_FAILED)
+			return MPOOL_ERR_ALLOC;
+
+		shared->version = SHARED_VERSION;
+		shared->block_size = block_size;
+		shared->stride = stride;
+		shared->capacity = capacity;
+		atomic_init(&shared->head, LF_HEAD(0, 0));
+		atomic_init(&shared->carved, 0);
+		atomic_init(&shared->root, MPOOL_NULL_HANDLE);
+		atomic_store_explicit(&shared->magic, SHARED_MAGIC, memory_order_release);
+	} else {
+		struct stat st;
+		for (int tries = 0; ; tries++) {
+			if (shared == NULL && fstat(fd, &st) == 0 && 
+					(size_t) st.st_size >= sizeof(struct _shared)) {
+				size = (size_t) st.st_size;
+				shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (shared == MAP_FAILED)
+					return MPOOL_ERR_ALLOC;
+			}
+			if (shared != NULL && atomic_load_explicit(&shared->magic, 
+					memory_order_acquire) == SHARED_MAGIC)
+				break;
+			if (tries == SHARED_WAIT_TRIES) {
+				if (shared != NULL)
+					munmap(shared, size);
+				return MPOOL_ERR_CORRUPTED;
+			}
+			nanosleep(&(struct timespec) { 0, SHARED_WAIT_NS }, NULL);
+		}
+
+		if (shared->version != SHARED_VERSION || shared->block_size != block_size ||
+				shared->stride != stride || (capacity > 0 && shared->capacity != capacity) ||
+				size < sizeof(struct _shared) + stride * (size_t) shared->capacity) {
+			munmap(shared, size);
+			return MPOOL_ERR_INVALID_ARG;
+		}
+	}
+
+	mpool_error err = _wrap_shared(shared, size, pool);
+	if (err != MPOOL_SUCCESS)
+		munmap(shared, size);
+	return err;
+}
+#endif
+
+
+/************************************************
+ *
+ *	Public Functions --- See mpool.h for function
+ *	headers.
+ *
+ ***********************************************/
+
+mpool_error init_mpool (size_t block_size, int32_t capacity, struct mpool** pool) 
+{
+	return init_mpool_attr(block_size, capacity, NULL, pool);
+}
+
+
+mpool_error init_mpool_aligned (size_t block_size, int32_t capacity, 
+		size_t alignment, struct mpool** pool)
+{
+	struct mpool_attr attr = { 0 };
+	attr.alignment = alignment;
+	return init_mpool_attr(block_size, capacity, &attr, pool);
+}
+
+
+mpool_error init_mpool_sharded (size_t block_size, int32_t capacity, 
+		int nshards, struct mpool** pool)
+{
+	struct mpool_attr attr = { 0 };
+	attr.nshards = nshards;
+	return init_mpool_attr(block_size, capacity, &attr, pool);
+}
+
+
+#ifdef HAVE_MMAP
+/**
+ * _open_shared() - Make or attach to a shared pool by name
+ * @name: Name of the shared memory object, or path of the file
+ * @is_file: Whether @name is a file
+ * @block_size: Block size of the pool
+ * @capacity: Capacity, 0 to only attach
+ * @pool: Where to put the pool
+ *
+ * Whoever makes the object sets the pool up, everyone else attaches to it. 
+ */
+static mpool_error _open_shared (const char* name, int is_file, size_t block_size, 
+		int32_t capacity, struct mpool** pool)
+{
+	int create = capacity > 0;
+	int flags = O_RDWR | O_CREAT | O_EXCL;
+	int fd = -1;
+
+	if (create)
+		fd = is_file ? open(name, flags, 0600) : shm_open(name, flags, 0600);
+	if (fd < 0 && (!create || errno == EEXIST)) {
+		create = 0;
+		fd = is_file ? open(name, O_RDWR) : shm_open(name, O_RDWR, 0);
+	}
+	if (fd < 0)
+		return MPOOL_FAILURE;
+
+	mpool_error err = _map_shared(fd, block_size, capacity, create, pool);
+	close(fd);
+	if (err != MPOOL_SUCCESS && create) {
+		if (is_file)
+			unlink(name);
+		else
+			shm_unlink(name);
+	}
+	return err;
+}
+#endif
+
+
+mpool_error init_mpool_shm (const char* name, size_t block_size, int32_t capacity, 
+		struct mpool** pool)
+{
+	if (name == NULL || pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (block_size == 0 || capacity < 0)
+		return MPOOL_ERR_INVALID_ARG;
+	*pool = NULL;
+
+#ifdef HAVE_MMAP
+	return _open_shared(name, 0, block_size, capacity, pool);
+#else
+	return MPOOL_FAILURE;
+#endif
+}
+
+
+mpool_error mpool_open_file (const char* path, size_t block_size, int32_t capacity, 
+		struct mpool** pool)
+{
+	if (path == NULL || pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (block_size == 0 || capacity < 0)
+		return MPOOL_ERR_INVALID_ARG;
+	*pool = NULL;
+
+#ifdef HAVE_MMAP
+	return _open_shared(path, 1, block_size, capacity, pool);
+#else
+	return MPOOL_FAILURE;
+#endif
+}
+
+
+mpool_error mpool_sync (struct mpool* pool)
+{
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared == NULL)
+		return MPOOL_FAILURE;
+#ifdef HAVE_MMAP
+	if (msync(pool->shared, pool->shared_size, MS_SYNC) == 0)
+		return MPOOL_SUCCESS;
+#endif
+	return MPOOL_FAILURE;
+}
+
+
+mpool_error mpool_set_root (struct mpool* pool, uint32_t handle)
+{
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared == NULL)
+		return MPOOL_FAILURE;
+	atomic_store_explicit(&pool->shared->root, handle, memory_order_release);
+	return MPOOL_SUCCESS;
+}
+
+
+uint32_t mpool_get_root (struct mpool* pool)
+{
+	if (pool == NULL || pool->shared == NULL)
+		return MPOOL_NULL_HANDLE;
+	return atomic_load_explicit(&pool->shared->root, memory_order_acquire);
+}
+
+
+mpool_error mpool_shm_unlink (const char* name)
+{
+	if (name == NULL)
+		return MPOOL_ERR_NULL_ARG;
+#ifdef HAVE_MMAP
+	if (shm_unlink(name) == 0)
+		return MPOOL_SUCCESS;
+#endif
+	return MPOOL_FAILURE;
+}
+
+
+mpool_error init_mpool_attr (size_t block_size, int32_t capacity, 
+		const struct mpool_attr* attr, struct mpool** pool)
+{
+	static const struct mpool_attr defaults = { 0 };
+
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (attr == NULL)
+		attr = &defaults;
+	if (capacity < 0 || (attr->flags & ~MPOOL_ALL_FLAGS) != 0)
+		return MPOOL_ERR_INVALID_ARG;
+	if ((attr->flags & MPOOL_ADDRESS_ORDERED) && (attr->flags & MPOOL_LOCK_FREE))
+		return MPOOL_ERR_INVALID_ARG;
+#ifndef HAVE_MMAP
+	if (attr->flags & (BACKING_FLAGS | MPOOL_TRACK_FRESH))
+		return MPOOL_ERR_INVALID_ARG;
+#endif
+#ifndef __linux__
+	if (attr->flags & (MPOOL_NUMA_BIND | MPOOL_FIRST_TOUCH))
+		return MPOOL_ERR_INVALID_ARG;
+#endif
+	if ((attr->flags & MPOOL_NUMA_BIND) && 
+			(attr->numa_node < 0 || attr->numa_node > MAX_NUMA_NODE))
+		return MPOOL_ERR_INVALID_ARG;
+	/* With one shard there is nothing to spread, and a bound pool has its node */
+	if ((attr->flags & MPOOL_FIRST_TOUCH) && 
+			(attr->nshards < 2 || (attr->flags & MPOOL_NUMA_BIND)))
+		return MPOOL_ERR_INVALID_ARG;
+	if ((attr->alignment & (attr->alignment - 1)) != 0)
+		return MPOOL_ERR_INVALID_ARG;
+	if (attr->nshards < 0 || attr->nshards > MAX_SHARDS)
+		return MPOOL_ERR_INVALID_ARG;
+	if (attr->init_threads < 0 || attr->init_threads > MAX_INIT_THREADS)
+		return MPOOL_ERR_INVALID_ARG;
+	if (!(attr->growth_factor == 0 || attr->growth_factor >= 1) || 
+			attr->max_capacity < 0 || attr->min_grow < 0 ||
+			(attr->max_capacity > 0 && attr->max_capacity < capacity))
+		return MPOOL_ERR_INVALID_ARG;
+	if ((attr->flags & MPOOL_HANDLES) && (capacity > MAX_HANDLE_BLOCKS || 
+			attr->max_capacity > MAX_HANDLE_BLOCKS))
+		return MPOOL_ERR_INVALID_ARG;
+
+	*pool = calloc(1, sizeof(struct mpool));
+	if (*pool == NULL)
+		return MPOOL_ERR_ALLOC;
+	
+	(*pool)->block_size = block_size;
+	(*pool)->stride = _stride(block_size + REDZONE_SIZE, attr->alignment);
+	(*pool)->alignment = attr->alignment;
+	(*pool)->lock_free = (attr->flags & MPOOL_LOCK_FREE) != 0;
+	(*pool)->lazy = (attr->flags & MPOOL_LAZY) != 0;
+	atomic_init(&(*pool)->carve_blob, 0);
+	atomic_init(&(*pool)->capacity, 0);
+	atomic_init(&(*pool)->blob_table, NULL);
+
+	(*pool)->backing = attr->flags & BACKING_FLAGS;
+	if (attr->flags & MPOOL_TRACK_FRESH)
+		(*pool)->backing |= MPOOL_MMAP;
+	if (attr->flags & MPOOL_FIRST_TOUCH)
+		(*pool)->backing |= MPOOL_PREFAULT;
+#ifndef MPOOL_DEBUG
+	(*pool)->zeroed = (attr->flags & MPOOL_TRACK_FRESH) != 0;
+#endif
+	(*pool)->numa_node = attr->numa_node;
+	(*pool)->growth_factor = attr->growth_factor;
+	(*pool)->max_capacity = attr->max_capacity ? attr->max_capacity : 
+		(attr->flags & MPOOL_HANDLES) ? MAX_HANDLE_BLOCKS : INT32_MAX;
+	(*pool)->min_grow = attr->min_grow;
+	if ((*pool)->growth_factor == 0 && (*pool)->min_grow > 0)
+		(*pool)->growth_factor = 1;
+	if ((*pool)->growth_factor > 0 && (*pool)->min_grow == 0)
+		(*pool)->min_grow = 1;
+	
+	/* Safe-mode turned off by default */
+	(*pool)->safe_mode = (attr->flags & MPOOL_SAFE_MODE) ? SAFE : UNSAFE;
+	(*pool)->handles = (attr->flags & MPOOL_HANDLES) != 0;
+	(*pool)->ordered = (attr->flags & MPOOL_ADDRESS_ORDERED) != 0;
+
+	int nshards = attr->nshards ? attr->nshards : 1;
+	void* shards = NULL;
+	if (posix_memalign(&shards, CACHE_LINE, sizeof(struct _shard) * (size_t) nshards) != 0) {
+		free(*pool);
+		*pool = NULL;
+		return MPOOL_ERR_ALLOC;
+	}
+	memset(shards, 0, sizeof(struct _shard) * (size_t) nshards);
+	(*pool)->shards = shards;
+	(*pool)->nshards = nshards;
+	(*pool)->first_touch = (attr->flags & MPOOL_FIRST_TOUCH) != 0;
+	(*pool)->init_threads = (*pool)->first_touch ? nshards : attr->init_threads;
+
+	int mutex_err = 0;
+	for (int i = 0; i < nshards; i++) {
+		atomic_init(&(*pool)->shards[i].size, 0);
+		atomic_init(&(*pool)->shards[i].lf_head, LF_HEAD(0, 0));
+#ifdef MULTITHREAD
+		mutex_err |= MUTEX_INIT(&(*pool)->shards[i].mutex, NULL);
+#endif
+	}
+#ifdef MULTITHREAD
+	mutex_err |= MUTEX_INIT(&(*pool)->grow_mutex, NULL);
+	mutex_err |= _init_wait(*pool);
+	atomic_init(&(*pool)->epoch, 1);
+	(*pool)->id = _new_pool_id();
+#endif
+	if (mutex_err != 0) {
+		free((*pool)->shards);
+		free(*pool);
+		*pool = NULL;
+		return MPOOL_ERR_MUTEX;
+	}
+	
+	/*	Because the user may add more space later, we need to keep track of each 
+	 *	malloc call that is made to ensure they are all freed later, which is the 
+	 *	purpose of the blob_table field
+	 */
+	mpool_error err = _add_blob(*pool, capacity);
+	if (err != MPOOL_SUCCESS) {
+		free_mpool(*pool);
+		*pool = NULL;
+	}
+	return err;
+}
+
+
+/**
+ * _take_block() - Take a block for mpool_alloc() and mpool_alloc_wait()
+ * @block: Where to put the block
+ * @pool: Pool to take it from
+ * @home: Calling thread's shard, from _home_shard()
+ * @max_capacity: Largest capacity to grow the pool to, see _grow()
+ *
+ * If the pool has a growth policy, it is grown and tried again when empty.
+ */
+static mpool_error _take_block (struct _block** block, struct mpool* pool, int home, 
+		int32_t max_capacity)
+{
+	mpool_error err;
+
+	for (;;) {
+		int32_t capacity = pool->capacity;
+#ifdef MULTITHREAD
+		if (_is_owner(pool))
+			err = _owner_alloc(block, pool, home);
+		else if (pool->magazine_size > 0)
+			err = _cache_alloc(block, pool, home);
+		else
+#endif
+			err = _remove_block(block, pool, home);
+
+		if (err != MPOOL_EMPTY_POOL)
+			return err;
+		if ((err = _grow(pool, capacity, max_capacity)) != MPOOL_SUCCESS)
+			return err;
+	}
+}
+
+
+/**
+ * _mark_used() - Move a blob's @fresh past a block that is being handed out
+ * @pool: Pool the block came from
+ * @block: Block being handed out
+ *
+ * Returns: Whether the block had never been handed out before
+ */
+static inline int _mark_used (struct mpool* pool, const void* block)
+{
+	int32_t slot;
+
+	if (!pool->zeroed)
+		return 0;
+	struct _blob* blob = _find_block(pool, block, &slot);
+	if (blob == NULL)
+		return 0;
+
+	int32_t fresh = atomic_load_explicit(&blob->fresh, memory_order_relaxed);
+	while (slot >= fresh)
+		if (atomic_compare_exchange_weak_explicit(&blob->fresh, &fresh, slot + 1, 
+				memory_order_relaxed, memory_order_relaxed))
+			return 1;
+	return 0;
+}
+
+
+/**
+ * _hand_out() - Mark a block taken from the pool as the user's
+ * @pool: Pool the block came from
+ * @block: Block taken
+ * @fresh: Where to put whether the block was never handed out before, or NULL
+ * @home: Calling thread's shard, from _home_shard()
+ *
+ * Returns: @block, or NULL in debug builds if it was written to while free. It
+ * is left out of the pool then.
+ */
+static void* _hand_out (struct mpool* pool, struct _block* block, int* fresh, 
+		int home)
+{
+	if (_debug_alloc(pool, block) != MPOOL_SUCCESS)
+		return NULL;
+	if (pool->safe_mode == SAFE)
+		_mark_allocd(pool, block);
+	int was_fresh = _mark_used(pool, block);
+	if (fresh != NULL)
+		*fresh = was_fresh;
+	_stat_alloc(pool, home, 1);
+	HOOK(pool, alloc, (void*) block);
+	return (void*) block;
+}
+
+
+/**
+ * _alloc() - mpool_alloc(), also telling whether the block is fresh
+ * @pool: Pool to take the block from
+ * @error: The resulting error code, or NULL
+ * @fresh: Where to put whether the block was never handed out before, or NULL
+ * @max_capacity: Largest capacity to grow the pool to, see _grow()
+ */
+static void* _alloc (struct mpool* pool, mpool_error* error, int* fresh, 
+		int32_t max_capacity)
+{
+	struct _block* b;
+	mpool_error err = MPOOL_SUCCESS;
+	void* item = NULL;
+
+	if (pool == NULL) {
+		err = MPOOL_ERR_NULL_ARG;
+		goto cleanup;
+	}
+
+	int home = _home_shard(pool);
+	err = _take_block(&b, pool, home, max_capacity);
+	if (err != MPOOL_SUCCESS) {
+		if (err == MPOOL_EMPTY_POOL)
+			_stat_empty(pool);
+		goto cleanup;
+	}
+	if ((item = _hand_out(pool, b, fresh, home)) == NULL)
+		err = MPOOL_ERR_CORRUPTED;
+	
+cleanup:
+	if (error != NULL)
+		*error = err;
+	
+	return item;
+}
+
+void* mpool_alloc (struct mpool* pool, mpool_error* error) 
+{
+	return _alloc(pool, error, NULL, INT32_MAX);
+}
+
+void* mpool_try_alloc (struct mpool* pool, mpool_error* error)
+{
+	struct _block* b;
+	mpool_error err = MPOOL_SUCCESS;
+	void* item = NULL;
+
+	if (pool == NULL) {
+		err = MPOOL_ERR_NULL_ARG;
+		goto cleanup;
+	}
+
+	int home = _home_shard(pool);
+#ifdef MULTITHREAD
+	/* The owner's own blocks and the remote stack need no lock */
+	if (_is_owner(pool) && (pool->owner_list.count > 0 || 
+			atomic_load_explicit(&pool->remote, memory_order_relaxed) != NULL))
+		err = _owner_alloc(&b, pool, home);
+	else if (pool->magazine_size > 0)
+		err = _try_cache_alloc(&b, pool, home);
+	else
+#endif
+		err = _try_remove_block(&b, pool, home);
+
+	if (err != MPOOL_SUCCESS) {
+		if (err == MPOOL_EMPTY_POOL)
+			_stat_empty(pool);
+		goto cleanup;
+	}
+	if ((item = _hand_out(pool, b, NULL, home)) == NULL)
+		err = MPOOL_ERR_CORRUPTED;
+
+cleanup:
+	if (error != NULL)
+		*error = err;
+	return item;
+}
+
+void* mpool_alloc_wait (struct mpool* pool, int64_t timeout_ns, mpool_error* error)
+{
+#ifdef MULTITHREAD
+	struct _block* b;
+	struct timespec deadline = { 0, 0 };
+	mpool_error err = MPOOL_SUCCESS;
+	void* item = NULL;
+
+	if (pool == NULL) {
+		err = MPOOL_ERR_NULL_ARG;
+		goto cleanup;
+	}
+	if (pool->shared != NULL) {
+		err = MPOOL_FAILURE;
+		goto cleanup;
+	}
+
+	if (timeout_ns > 0)
+		deadline = _wait_deadline(timeout_ns);
+	int home = _home_shard(pool);
+
+	/* The sleep is only slept if no blocks came back since the last try, 
+	 * going by @wakeups. No lock is held while trying, since growing the pool
+	 * may wake waiters with the grow lock held.
+	 *
+	 * A free that hadn't seen @wait_used yet skipped its fence, and may have
+	 * missed this waiter while the waiter missed its block. So the first sleep
+	 * is short, and the block is found by the try after it.
+	 */
+	atomic_store_explicit(&pool->wait_used, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pool->waiters, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	for (int sleeps = 0; ; sleeps++) {
+		uint32_t seen = atomic_load_explicit(&pool->wakeups, memory_order_acquire);
+		if ((err = _take_block(&b, pool, home, INT32_MAX)) != MPOOL_EMPTY_POOL || 
+				timeout_ns == 0)
+			break;
+
+		int rc = 0, first = sleeps == 0 && (timeout_ns < 0 || timeout_ns > WAIT_FIRST_NS);
+		struct timespec until = first ? _wait_deadline(WAIT_FIRST_NS) : deadline;
+		MUTEX_LOCK(&pool->wait_mutex);
+		while (rc == 0 && atomic_load_explicit(&pool->wakeups, 
+				memory_order_acquire) == seen) {
+			if (timeout_ns < 0 && !first)
+				rc = pthread_cond_wait(&pool->wait_cond, &pool->wait_mutex);
+			else
+				rc = pthread_cond_timedwait(&pool->wait_cond, &pool->wait_mutex, 
+					&until);
+		}
+		MUTEX_UNLOCK(&pool->wait_mutex);
+		if (rc == ETIMEDOUT && first)
+			continue;
+
+		/* One last try, a block may have come back right at the deadline */
+		if (rc == ETIMEDOUT) {
+			err = _take_block(&b, pool, home, INT32_MAX);
+			break;
+		}
+		if (rc != 0) {
+			err = MPOOL_ERR_MUTEX;
+			break;
+		}
+	}
+	atomic_fetch_sub_explicit(&pool->waiters, 1, memory_order_relaxed);
+
+	if (err != MPOOL_SUCCESS) {
+		if (err == MPOOL_EMPTY_POOL)
+			_stat_empty(pool);
+		goto cleanup;
+	}
+	if ((item = _hand_out(pool, b, NULL, home)) == NULL)
+		err = MPOOL_ERR_CORRUPTED;
+
+cleanup:
+	if (error != NULL)
+		*error = err;
+	return item;
+#else
+	/* No other thread can give a block back while this one waits */
+	(void) timeout_ns;
+	return mpool_alloc(pool, error);
+#endif
+}
+
+void* mpool_calloc (struct mpool* pool, mpool_error* error) 
+{
+	int fresh;
+	void* item = _alloc(pool, error, &fresh, INT32_MAX);
+
+	if (item == NULL)
+		return NULL;
+
+	/* All that was ever written into a fresh block is the free list link */
+	size_t dirty = fresh ? sizeof(struct _block) : pool->block_size;
+	memset(item, 0, dirty < pool->block_size ? dirty : pool->block_size);
+	return item;
+}
+
+mpool_error mpool_dealloc (void* item, struct mpool* pool) 
+{
+	if (item == NULL || pool == NULL) 
+		return MPOOL_ERR_NULL_ARG;
+
+	mpool_error err = _check_dealloc(pool, item);
+	if (err != MPOOL_SUCCESS)
+		return err;
+	_debug_free(pool, item);
+
+	int home = _home_shard(pool);
+#ifdef MULTITHREAD
+	if (pool->owned)
+		err = _owner_dealloc((struct _block*) item, pool, home);
+	else if (pool->magazine_size > 0)
+		err = _cache_dealloc((struct _block*) item, pool, home);
+	else
+#endif
+		err = _add_block((struct _block*) item, pool, home);
+
+	/* An address ordered pool only spots a double free here, and then the
+	 * block is rightly poisoned already
+	 */
+	if (err != MPOOL_SUCCESS && err != MPOOL_ERR_DOUBLE_FREE)
+		_debug_alloc(pool, item);
+	if (err != MPOOL_SUCCESS)
+		_undo_dealloc(pool, item);
+	if (err == MPOOL_SUCCESS) {
+		_stat_free(pool, home, 1);
+		HOOK(pool, free, item);
+	}
+	return err;
+}
+
+
+int32_t mpool_alloc_bulk (struct mpool* pool, void** out, int32_t n, mpool_error* error)
+{
+	struct _magazine chain;
+	mpool_error err = MPOOL_SUCCESS;
+	int32_t got = 0;
+
+	if (pool == NULL || out == NULL) {
+		err = MPOOL_ERR_NULL_ARG;
+		goto cleanup;
+	}
+	if (n < 0) {
+		err = MPOOL_ERR_INVALID_ARG;
+		goto cleanup;
+	}
+	if (n == 0)
+		goto cleanup;
+
+	int home = _home_shard(pool);
+	while (got < n) {
+		int32_t capacity = pool->capacity;
+
+		err = _remove_chain(pool, n - got, &chain, home);
+		if (err == MPOOL_SUCCESS) {
+			struct _block* next = chain.head;
+			for (int32_t i = 0; i < chain.count; i++) {
+				struct _block* b = next;
+				next = b->next;
+				if (_debug_alloc(pool, b) != MPOOL_SUCCESS)
+					continue;
+				out[got++] = b;
+				if (pool->safe_mode == SAFE)
+					_mark_allocd(pool, b);
+				_mark_used(pool, b);
+				HOOK(pool, alloc, (void*) b);
+			}
+		} else if (err != MPOOL_EMPTY_POOL || 
+				_grow(pool, capacity, INT32_MAX) != MPOOL_SUCCESS) {
+			break;
+		}
+	}
+	if (got > 0)
+		_stat_alloc(pool, home, got);
+	if (err == MPOOL_EMPTY_POOL)
+		_stat_empty(pool);
+
+cleanup:
+	if (error != NULL)
+		*error = err;
+	return got;
+}
+
+mpool_error mpool_dealloc_bulk (struct mpool* pool, void** items, int32_t n)
+{
+	if (pool == NULL || items == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (n < 0)
+		return MPOOL_ERR_INVALID_ARG;
+	if (n == 0)
+		return MPOOL_SUCCESS;
+
+	/* Check everything before linking, as linking writes into the blocks. If 
+	 * one fails, the ones already marked free are put back the way they were.
+	 */
+	for (int32_t i = 0; i < n; i++) {
+		mpool_error err = items[i] ? _check_dealloc(pool, items[i]) : MPOOL_ERR_NULL_ARG;
+		if (err != MPOOL_SUCCESS) {
+			while (i-- > 0)
+				_undo_dealloc(pool, items[i]);
+			return err;
+		}
+	}
+
+	struct _magazine chain = { items[0], items[n - 1], n };
+	for (int32_t i = 0; i < n; i++)
+		_debug_free(pool, items[i]);
+	for (int32_t i = 0; i < n - 1; i++)
+		((struct _block*) items[i])->next = items[i + 1];
+	((struct _block*) items[n - 1])->next = NULL;
+
+	int home = _home_shard(pool);
+	mpool_error err = _add_chain(pool, &chain, home);
+	if (err != MPOOL_SUCCESS)
+		for (int32_t i = 0; i < n; i++)
+			_undo_dealloc(pool, items[i]);
+	if (err == MPOOL_SUCCESS) {
+		_stat_free(pool, home, n);
+		for (int32_t i = 0; i < n; i++)
+			HOOK(pool, free, items[i]);
+	}
+	return err;
+}
+
+
+/* Index part of a handle mask, and a handle from a generation and slot index */
+#define HANDLE_INDEX_MASK ((UINT32_C(1) << MPOOL_HANDLE_INDEX_BITS) - 1)
+#define HANDLE(gen, index) \
+	(((uint32_t)(gen) << MPOOL_HANDLE_INDEX_BITS) | (uint32_t)((index) + 1))
+
+uint32_t mpool_alloc_handle (struct mpool* pool, mpool_error* error)
+{
+	struct _magazine skipped = { NULL, NULL, 0 };
+	uint32_t handle = MPOOL_NULL_HANDLE;
+	mpool_error err;
+	void* item;
+
+	/* Only pools without MPOOL_HANDLES can have blocks past the handle limit.
+	 * Those are held on to until a block that has a handle turns up, else the
+	 * next call would just get the same one back. The pool isn't grown past 
+	 * the limit for this, as none of the new blocks could have a handle.
+	 */
+	while ((item = _alloc(pool, &err, NULL, MAX_HANDLE_BLOCKS)) != NULL && 
+			(handle = mpool_ptr_to_handle(pool, item)) == MPOOL_NULL_HANDLE)
+		_magazine_push(&skipped, item);
+	while (skipped.head != NULL) {
+		struct _block* next = skipped.head->next;
+		mpool_dealloc(skipped.head, pool);
+		skipped.head = next;
+	}
+	if (error != NULL)
+		*error = err;
+	return handle;
+}
+
+
+void* mpool_handle_to_ptr (struct mpool* pool, uint32_t handle)
+{
+	uint32_t index = handle & HANDLE_INDEX_MASK;
+	if (pool == NULL || index-- == 0)
+		return NULL;
+
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+	if (table->count == 0)
+		return NULL;
+
+	struct _blob* blob = table->by_index[_blob_at(table, index)];
+	int64_t slot = (int64_t) index - blob->first;
+	if (slot < 0 || slot >= blob->count)
+		return NULL;
+	if (blob->generation != NULL && atomic_load_explicit(&blob->generation[slot], 
+			memory_order_relaxed) != handle >> MPOOL_HANDLE_INDEX_BITS)
+		return NULL;
+	return blob->base + (size_t) slot * pool->stride;
+}
+
+
+uint32_t mpool_ptr_to_handle (struct mpool* pool, const void* item)
+{
+	int32_t slot;
+	if (pool == NULL || item == NULL)
+		return MPOOL_NULL_HANDLE;
+
+	struct _blob* blob = _find_block(pool, item, &slot);
+	if (blob == NULL || blob->first + (int64_t) slot >= HANDLE_INDEX_MASK)
+		return MPOOL_NULL_HANDLE;
+
+	uint8_t gen = blob->generation ? atomic_load_explicit(&blob->generation[slot], 
+		memory_order_relaxed) : 0;
+	return HANDLE(gen, blob->first + slot);
+}
+
+
+mpool_error mpool_dealloc_handle (struct mpool* pool, uint32_t handle)
+{
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+	void* item = mpool_handle_to_ptr(pool, handle);
+	if (item == NULL)
+		return MPOOL_ERR_INVALID_ADDRESS;
+	return mpool_dealloc(item, pool);
+}
+
+
+mpool_error mpool_foreach_allocated (struct mpool* pool, 
+		int (*callback)(void* item, void* ctx), void* ctx)
+{
+	if (pool == NULL || callback == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (pool->safe_mode != SAFE)
+		return MPOOL_ERR_INVALID_ARG;
+
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+
+	for (int i = 0; i < table->count; i++) {
+		struct _blob* blob = table->by_addr[i];
+		int32_t carved = atomic_load_explicit(&blob->carved, memory_order_relaxed);
+
+		/* Blocks in use are the clear bits below the carve mark, whole words
+		 * of free blocks are skipped with one compare.
+		 */
+		for (int32_t w = 0; w * 64 < carved; w++) {
+			uint64_t live = ~atomic_load_explicit(&blob->free_map[w], 
+				memory_order_relaxed);
+			if (carved - w * 64 < 64)
+				live &= MAP_BIT(carved - w * 64) - 1;
+
+			char* base = blob->base + (size_t) w * 64 * pool->stride;
+			while (live != 0) {
+				char* item = base + (size_t) __builtin_ctzll(live) * pool->stride;
+				live &= live - 1;
+				if (live != 0)
+					PREFETCH(base + (size_t) __builtin_ctzll(live) * pool->stride);
+				if (callback(item, ctx) != 0)
+					return MPOOL_SUCCESS;
+			}
+		}
 	}
+	return MPOOL_SUCCESS;
+}
+
+
+mpool_error mpool_realloc (int32_t new_capacity, struct mpool* pool) 
+{
+	mpool_error err = MPOOL_SUCCESS;
+
+	if (pool == NULL) 
+		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared != NULL)
+		return MPOOL_FAILURE;
+
+#ifdef MULTITHREAD
+	if (_lock(pool, &pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
+	if (pool->capacity >= new_capacity || (pool->handles && new_capacity > MAX_HANDLE_BLOCKS))
+		err = MPOOL_ERR_INVALID_REALLOC_SIZE;
+	else
+		err = _add_blob(pool, new_capacity - pool->capacity);
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	/* Lazy pools carve the new blocks later, so nothing has woken waiters yet */
+	if (err == MPOOL_SUCCESS)
+		_wake_waiters(pool, 1);
+	return err;
+}
+
+int32_t mpool_capacity (struct mpool* pool) 
+{
+	if (pool == NULL) return -1;
+	return pool->capacity;
+}
+
+
+size_t mpool_stride (struct mpool* pool)
+{
+	if (pool == NULL)
+		return 0;
+	return pool->stride;
+}
+
+
+mpool_error mpool_get_stats (struct mpool* pool, struct mpool_stats* stats)
+{
+	if (pool == NULL || stats == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+	memset(stats, 0, sizeof(struct mpool_stats));
+	stats->capacity = pool->capacity;
+
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+	for (int i = 0; table && i < table->count; i++)
+		stats->bytes_reserved += table->by_index[i]->size;
+
+#ifndef MPOOL_NO_STATS
+	stats->in_use = _stat_peak(pool, &stats->allocs, &stats->frees);
+	stats->peak_in_use = atomic_load_explicit(&pool->shards[0].peak, memory_order_relaxed);
+	stats->empty_failures = atomic_load_explicit(&pool->stats.empty, memory_order_relaxed);
+	stats->grows = atomic_load_explicit(&pool->stats.grows, memory_order_relaxed);
+	stats->lock_contended = atomic_load_explicit(&pool->stats.contended, memory_order_relaxed);
+	stats->bytes_used = (size_t) stats->in_use * pool->block_size;
+	return MPOOL_SUCCESS;
+#else
+	return MPOOL_FAILURE;
+#endif
+}
+
+mpool_error mpool_get_lock_waits (struct mpool* pool, uint64_t* buckets, int n)
+{
+	if (pool == NULL || buckets == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (n < 0)
+		return MPOOL_ERR_INVALID_ARG;
+	if (n > MPOOL_LOCK_WAIT_BUCKETS)
+		n = MPOOL_LOCK_WAIT_BUCKETS;
+
+#ifndef MPOOL_NO_STATS
+	for (int i = 0; i < n; i++)
+		buckets[i] = atomic_load_explicit(&pool->stats.lock_wait[i], 
+			memory_order_relaxed);
+	return MPOOL_SUCCESS;
+#else
+	memset(buckets, 0, sizeof(uint64_t) * (size_t) n);
+	return MPOOL_FAILURE;
+#endif
+}
+
+mpool_error mpool_set_hooks (struct mpool* pool, const struct mpool_hooks* hooks)
+{
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+#ifndef MPOOL_NO_HOOKS
+	if (hooks != NULL)
+		pool->hooks = *hooks;
+	else
+		memset(&pool->hooks, 0, sizeof(struct mpool_hooks));
+	return MPOOL_SUCCESS;
+#else
+	(void) hooks;
+	return MPOOL_FAILURE;
+#endif
+}
+
+mpool_error free_mpool (struct mpool* pool)
+{
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+#ifdef MULTITHREAD
+	/* Detach the thread caches, the blocks they hold go away with the blobs
+	 * and the caches themselves are freed by their threads.
+	 */
+	MUTEX_LOCK(&_tcache_mutex);
+	for (struct _thread_cache* tc = pool->caches; tc; tc = tc->next)
+		tc->pool = NULL;
+	MUTEX_UNLOCK(&_tcache_mutex);
+	free(pool->depot);
+	free(pool->orphans.items);
+#endif
 
-	if ((err = _remove_block(&b, pool)) != MPOOL_SUCCESS) 
-		goto cleanup;
-	
-	item = b->addr;
-	err = _add_to_unused_list(b, pool);
-	
-cleanup:
-	if (error != NULL)
-		*error = err;
-	
-	return item;
+	/* The free list lives inside the blobs, so freeing them is enough. A 
+	 * shared pool's one blob is inside its mapping, which stays around for 
+	 * the other processes.
+	 */
+	struct _blob_table* table = atomic_load(&pool->blob_table);
+	for (int i = 0; table && i < table->count; i++) {
+		if (pool->shared == NULL)
+			_unmap_blob(table->by_index[i]);
+		free(table->by_index[i]->free_map);
+		free(table->by_index[i]->generation);
+		free(table->by_index[i]->avail_map);
+		free(table->by_index[i]);
+	}
+	while (table) {
+		struct _blob_table* older = table->older;
+		free(table);
+		table = older;
+	}
+#ifdef HAVE_MMAP
+	if (pool->shared != NULL)
+		munmap(pool->shared, pool->shared_size);
+#endif
+	free(pool->shards);
+	free(pool);
+	return MPOOL_SUCCESS;
 }
 
-void* mpool_calloc (struct mpool* pool, mpool_error* error) 
+
+mpool_error mpool_thread_cache_enable (struct mpool* pool, int32_t magazine_size)
 {
-	void* item = mpool_alloc(pool, error);
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared != NULL || pool->ordered)
+		return MPOOL_FAILURE;
+	if (magazine_size < 0)
+		return MPOOL_ERR_INVALID_ARG;
 
-	if (*error != MPOOL_SUCCESS || item == NULL) {
-		return NULL;
+#ifdef MULTITHREAD
+	if (pool->magazine_size > 0 || pool->owned)
+		return MPOOL_FAILURE;
+
+	pthread_once(&_tcache_once, _tcache_key_init);
+	if (!_tcache_key_ok)
+		return MPOOL_FAILURE;
+
+	/* Lock-free pools skip the depot, it would need the lock */
+	if (!pool->lock_free) {
+		pool->depot = malloc(sizeof(struct _magazine) * DEPOT_SIZE);
+		if (pool->depot == NULL)
+			return MPOOL_ERR_ALLOC;
 	}
 
-	memset(item, 0, pool->block_size);
-	return item;
+	pool->magazine_size = magazine_size ? magazine_size : DEFAULT_MAGAZINE_SIZE;
+	return MPOOL_SUCCESS;
+#else
+	return MPOOL_FAILURE;
+#endif
 }
 
-mpool_error mpool_dealloc (void* item, struct mpool* pool) 
+
+mpool_error mpool_thread_cache_flush (struct mpool* pool)
 {
-	struct _block* b = NULL;
- 	mpool_error err = MPOOL_SUCCESS;
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
 
-	if (item == NULL || pool == NULL) 
+#ifdef MULTITHREAD
+	if (pool->magazine_size == 0)
+		return MPOOL_SUCCESS;
+
+	struct _thread_cache* tc = _find_thread_cache(pool);
+	if (tc == NULL)
+		return MPOOL_SUCCESS;
+
+	int home = _home_shard(pool);
+	mpool_error err = _return_magazine(pool, &tc->loaded, home);
+	if (err != MPOOL_SUCCESS)
+		return err;
+	return _return_magazine(pool, &tc->previous, home);
+#else
+	return MPOOL_SUCCESS;
+#endif
+}
+
+
+mpool_error mpool_reset (struct mpool* pool, int release)
+{
+	if (pool == NULL)
 		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared != NULL)
+		return MPOOL_FAILURE;
 
-	/* 
-	 * If safe mode is ON, check to make sure the address being passed back was
-	 * one that was created by the pool. 
-	 *
-	 * TODO: Can this be done safely by checking if item's address is within 
-	 * the start of the blob + pool size? That would cut down on the loop
+#ifdef MULTITHREAD
+	if (_lock(pool, &pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+
+	/* Blocks in the thread caches, with the owner, or retired and waiting 
+	 * on the epoch are forgotten too. No other thread may be using the pool 
+	 * so the caches can be emptied here.
 	 */
-	int match = 0;
-	if (pool->safe_mode == SAFE) {
-		
-		for (int i = 0; i < pool->index; i++) {
-			if (item == pool->allocd_addr[i]) {
-				match = 1;
-				break;
+	MUTEX_LOCK(&_tcache_mutex);
+	for (struct _thread_cache* tc = pool->caches; tc; tc = tc->next) {
+		tc->loaded = (struct _magazine) { NULL, NULL, 0 };
+		tc->previous = (struct _magazine) { NULL, NULL, 0 };
+		for (int i = 0; i < EPOCH_LISTS; i++)
+			tc->limbo[i].count = 0;
+	}
+	pool->orphans.count = 0;
+	MUTEX_UNLOCK(&_tcache_mutex);
+	pool->owner_list = (struct _magazine) { NULL, NULL, 0 };
+	atomic_store_explicit(&pool->remote, NULL, memory_order_relaxed);
+#endif
+	pool->depot_count = 0;
+
+	for (int i = 0; i < pool->nshards; i++) {
+		struct _shard* shard = &pool->shards[i];
+		uint64_t head = atomic_load_explicit(&shard->lf_head, memory_order_relaxed);
+		shard->list = NULL;
+		atomic_store_explicit(&shard->size, 0, memory_order_relaxed);
+		atomic_store_explicit(&shard->lf_head, LF_HEAD(LF_TAG(head) + 1, 0), 
+			memory_order_relaxed);
+	}
+
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_relaxed);
+
+	/* Keep only the first blob, the one init_mpool() made */
+	if (release && table->count > 1) {
+		struct _blob_table* first = malloc(sizeof(struct _blob_table) + 
+			sizeof(struct _blob*) * 2);
+		if (first != NULL) {
+			first->count = 1;
+			first->by_index = (struct _blob**)(first + 1);
+			first->by_addr = first->by_index + 1;
+			first->by_index[0] = first->by_addr[0] = table->by_index[0];
+			first->older = table;
+
+			for (int i = 1; i < table->count; i++) {
+				_unmap_blob(table->by_index[i]);
+				free(table->by_index[i]->free_map);
+				free(table->by_index[i]->generation);
+				free(table->by_index[i]->avail_map);
+				free(table->by_index[i]);
 			}
+			atomic_store_explicit(&pool->blob_table, first, memory_order_release);
+			pool->capacity = first->by_index[0]->count;
+			table = first;
 		}
+	}
 
-		if (match != 1) { return MPOOL_ERR_INVALID_ADDRESS; }
+	/* Every block is uncarved again, from now on the pool carves its blocks 
+	 * like a lazy pool does. Free map bits are rewritten as blocks are carved.
+	 * Address ordered pools just set every bit of their maps again. Every
+	 * block is freed by this, so each generation is bumped like a free does.
+	 */
+	for (int i = 0; i < table->count; i++) {
+		struct _blob* blob = table->by_index[i];
+		if (pool->ordered)
+			_partition_blob(pool, blob);
+		else
+			atomic_store_explicit(&blob->carved, 0, memory_order_relaxed);
+		for (int32_t j = 0; blob->generation != NULL && j < blob->count; j++)
+			atomic_store_explicit(&blob->generation[j], (uint8_t)(atomic_load_explicit(
+				&blob->generation[j], memory_order_relaxed) + 1), memory_order_relaxed);
 	}
+	atomic_store_explicit(&pool->carve_blob, 0, memory_order_relaxed);
+	pool->lazy = !pool->ordered;
 
-	if ((err = _remove_from_unused_list(&b, pool)) != MPOOL_SUCCESS) 
-		return err;
-	
-	b->addr = item;
-	err = _add_block(b, pool);
-	return err;
+#ifndef MPOOL_NO_STATS
+	for (int i = 0; i < pool->nshards; i++)
+		atomic_store_explicit(&pool->shards[i].frees, 
+			atomic_load_explicit(&pool->shards[i].allocs, memory_order_relaxed), 
+			memory_order_relaxed);
+#endif
+
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+	_wake_waiters(pool, 1);
+	return MPOOL_SUCCESS;
 }
 
 
-mpool_error mpool_realloc (int32_t new_capacity, struct mpool* pool) 
+/**
+ * _gather_free() - Take every free block out of the pool into one chain
+ * @pool: Pool no other thread is using
+ * @all: Where to put the chain
+ *
+ * This empties the shards, the depot, the thread caches and the owner's 
+ * lists, every place a free block may be sitting.
+ */
+static void _gather_free (struct mpool* pool, struct _magazine* all)
+{
+	*all = (struct _magazine) { NULL, NULL, 0 };
+
+	for (int i = 0; i < pool->nshards; i++) {
+		struct _shard* shard = &pool->shards[i];
+		struct _magazine chain = { shard->list, NULL, 0 };
+
+		if (pool->lock_free) {
+			uint64_t head = atomic_load_explicit(&shard->lf_head, memory_order_relaxed);
+			chain.head = LF_INDEX(head) ? _slot_ptr(pool, LF_INDEX(head) - 1) : NULL;
+			atomic_store_explicit(&shard->lf_head, LF_HEAD(LF_TAG(head) + 1, 0), 
+				memory_order_relaxed);
+		}
+		if (chain.head != NULL) {
+			chain.count = 1;
+			for (chain.tail = chain.head; chain.tail->next; chain.tail = chain.tail->next)
+				chain.count++;
+		}
+		shard->list = NULL;
+		atomic_store_explicit(&shard->size, 0, memory_order_relaxed);
+		_chain_append(all, &chain);
+	}
+
+	for (int32_t i = 0; i < pool->depot_count; i++)
+		_chain_append(all, &pool->depot[i]);
+	pool->depot_count = 0;
+
+#ifdef MULTITHREAD
+	if (pool->magazine_size > 0) {
+		MUTEX_LOCK(&_tcache_mutex);
+		for (struct _thread_cache* tc = pool->caches; tc; tc = tc->next) {
+			_chain_append(all, &tc->loaded);
+			_chain_append(all, &tc->previous);
+		}
+		MUTEX_UNLOCK(&_tcache_mutex);
+	}
+
+	_chain_append(all, &pool->owner_list);
+	struct _block* b = atomic_exchange_explicit(&pool->remote, NULL, memory_order_relaxed);
+	while (b != NULL) {
+		struct _block* next = b->next;
+		struct _magazine one = { b, b, 1 };
+		b->next = NULL;
+		_chain_append(all, &one);
+		b = next;
+	}
+#endif
+}
+
+
+mpool_error mpool_trim (struct mpool* pool, int32_t keep_capacity, int release_pages)
 {
 	mpool_error err = MPOOL_SUCCESS;
 
-	if (pool == NULL) 
+	if (pool == NULL)
 		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared != NULL || pool->ordered)
+		return MPOOL_FAILURE;
+	if (keep_capacity < 0)
+		return MPOOL_ERR_INVALID_ARG;
 
-	if (pool->capacity >= new_capacity)
-		return MPOOL_ERR_INVALID_REALLOC_SIZE;
-	
-	int32_t extra = new_capacity - pool->capacity;
-	size_t new_size = extra * pool->block_size;
-	int index = pool->alloc_count++;
-	pool->capacity = new_capacity;
+#ifdef MULTITHREAD
+	if (_lock(pool, &pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
+
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_relaxed);
+	int n = table->count;
+	uint64_t** maps = calloc((size_t) n, sizeof(uint64_t*));
+	int32_t* nfree = calloc((size_t) n, sizeof(int32_t));
+	struct _blob_table* kept = malloc(sizeof(struct _blob_table) + 
+		sizeof(struct _blob*) * 2 * (size_t) n);
+	for (int i = 0; maps && i < n; i++)
+		if ((maps[i] = calloc((size_t) MAP_WORD(table->by_index[i]->count) + 1, 
+				sizeof(uint64_t))) == NULL) {
+			err = MPOOL_ERR_ALLOC;
+			break;
+		}
+	if (maps == NULL || nfree == NULL || kept == NULL || err != MPOOL_SUCCESS) {
+		err = MPOOL_ERR_ALLOC;
+		goto cleanup;
+	}
 
-	pool->blobs = realloc(pool->blobs, sizeof(void*) * pool->alloc_count);
-	if (pool->blobs == NULL) return MPOOL_ERR_ALLOC;
+	/* Count the free blocks of each blob with a bitmap, so the free lists can
+	 * be rebuilt from it after. Blocks never carved are free too.
+	 */
+	struct _magazine all;
+	_gather_free(pool, &all);
+	for (struct _block* b = all.head; b; b = b->next) {
+		int64_t index = _slot_index(pool, b);
+		int at = _blob_at(table, index);
+		int32_t slot = (int32_t)(index - table->by_index[at]->first);
+		maps[at][MAP_WORD(slot)] |= MAP_BIT(slot);
+		nfree[at]++;
+	}
+
+	/* Release whole free blobs, newest (and so largest) first */
+	int32_t capacity = pool->capacity;
+	size_t page = 4096;
+#ifdef HAVE_MMAP
+	page = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+	kept->count = 0;
+	kept->by_index = (struct _blob**)(kept + 1);
+	for (int i = n - 1; i >= 0; i--) {
+		struct _blob* blob = table->by_index[i];
+		int32_t carved = atomic_load_explicit(&blob->carved, memory_order_relaxed);
+		if (nfree[i] == carved && capacity - blob->count >= keep_capacity) {
+			capacity -= blob->count;
+			free(maps[i]);
+			maps[i] = NULL;
+			continue;
+		}
+		if (!release_pages)
+			continue;
 
-	pool->blobs[index] = malloc(new_size);
-	if (pool->blobs[index] == NULL) return MPOOL_ERR_ALLOC;
+		/* Everything after the last block in use goes back to being uncarved,
+		 * and the whole pages there are handed back to the kernel.
+		 */
+		int32_t last = carved;
+		while (last > 0 && (maps[i][MAP_WORD(last - 1)] & MAP_BIT(last - 1)))
+			last--;
+		if (last == carved)
+			continue;
+		atomic_store_explicit(&blob->carved, last, memory_order_relaxed);
+		atomic_store_explicit(&pool->carve_blob, 0, memory_order_relaxed);
+		pool->lazy = 1;
 
-	pool->blob_sizes = realloc(pool->blob_sizes, sizeof(size_t) * pool->alloc_count);
-	if (pool->blob_sizes == NULL) return MPOOL_ERR_ALLOC;
-	
-	pool->allocd_addr = realloc(pool->allocd_addr, sizeof(void*) * (pool->index + new_capacity));
-	pool->blob_sizes[index] = new_size;
-	err = _partition_blob(pool, index);
+#ifdef HAVE_MMAP
+		uintptr_t from = ROUND_UP((uintptr_t)(blob->base + (size_t) last * pool->stride), page);
+		uintptr_t to = ((uintptr_t) blob->base + blob->size) / page * page;
+		if (to > from)
+			madvise((void*) from, to - from, MADV_DONTNEED);
+#endif
+	}
+
+	/* Publish a table without the released blobs, then free them */
+	for (int i = 0; i < n; i++)
+		if (maps[i] != NULL)
+			kept->by_index[kept->count++] = table->by_index[i];
+	if (kept->count < n) {
+		kept->by_addr = kept->by_index + kept->count;
+		int k = 0;
+		for (int i = 0; i < n; i++) {
+			struct _blob* blob = table->by_addr[i];
+			int at = _blob_at(table, blob->first);
+			if (maps[at] != NULL)
+				kept->by_addr[k++] = blob;
+		}
+		kept->older = table;
+		atomic_store_explicit(&pool->blob_table, kept, memory_order_release);
+		pool->capacity = capacity;
+
+		for (int i = 0; i < n; i++) {
+			if (maps[i] != NULL)
+				continue;
+			_unmap_blob(table->by_index[i]);
+			free(table->by_index[i]->free_map);
+			free(table->by_index[i]->generation);
+			free(table->by_index[i]->avail_map);
+			free(table->by_index[i]);
+		}
+		kept = NULL;
+	}
+
+	/* Rebuild the free lists in address order from the bitmaps */
+	struct _blob_table* now = atomic_load_explicit(&pool->blob_table, memory_order_relaxed);
+	struct _magazine chain = { NULL, NULL, 0 };
+	for (int i = 0, at = 0; i < n; i++) {
+		if (maps[i] == NULL)
+			continue;
+		struct _blob* blob = now->by_index[at++];
+		int32_t carved = atomic_load_explicit(&blob->carved, memory_order_relaxed);
+		for (int32_t slot = 0; slot < carved; slot++) {
+			if (!(maps[i][MAP_WORD(slot)] & MAP_BIT(slot)))
+				continue;
+			struct _block* b = (struct _block*)(blob->base + (size_t) slot * pool->stride);
+			struct _magazine one = { b, b, 1 };
+			b->next = NULL;
+			_chain_append(&chain, &one);
+		}
+	}
+	for (int s = 0; s < pool->nshards && chain.count > 0; s++) {
+		struct _magazine part = chain;
+		int32_t share = chain.count / (pool->nshards - s);
+		if (share < chain.count)
+			_take_magazine(&chain, share, &part);
+		else
+			chain = (struct _magazine) { NULL, NULL, 0 };
+		if (part.count > 0 && (err = _shard_add_chain(pool, &pool->shards[s], &part)) != MPOOL_SUCCESS)
+			break;
+	}
+
+cleanup:
+	for (int i = 0; maps && i < n; i++)
+		free(maps[i]);
+	free(maps);
+	free(nfree);
+	free(kept);
+#ifdef MULTITHREAD
+	if (MUTEX_UNLOCK(&pool->grow_mutex) != 0)
+		return MPOOL_ERR_MUTEX;
+#endif
 	return err;
 }
 
-int32_t mpool_capacity (struct mpool* pool) 
+
+mpool_error mpool_set_owner (struct mpool* pool)
 {
-	if (pool == NULL) return -1;
-	return pool->capacity;
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared != NULL || pool->ordered)
+		return MPOOL_FAILURE;
+
+#ifdef MULTITHREAD
+	if (pool->owned || pool->magazine_size > 0)
+		return MPOOL_FAILURE;
+
+	pool->owner = pthread_self();
+	atomic_init(&pool->remote, NULL);
+	pool->owned = 1;
+	return MPOOL_SUCCESS;
+#else
+	return MPOOL_FAILURE;
+#endif
 }
 
-mpool_error free_mpool (struct mpool* pool)
+
+mpool_error mpool_epoch_enter (struct mpool* pool)
 {
 	if (pool == NULL)
 		return MPOOL_ERR_NULL_ARG;
 
-	struct _block* buff;
-	struct _block* b = pool->block_list;
-	
-	while (b) {
-		buff = b->next;
-		free(b);
-		b = buff;
+#ifdef MULTITHREAD
+	struct _thread_cache* tc = _epoch_thread(pool);
+	if (tc == NULL)
+		return MPOOL_ERR_ALLOC;
+
+	/* The store must be seen before any node is read, hence the fence */
+	if (tc->nesting++ == 0) {
+		atomic_store_explicit(&tc->epoch, atomic_load_explicit(&pool->epoch, 
+			memory_order_relaxed), memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
 	}
-	
-	b = pool->unused_blocks;
-	while (b) {
-		buff = b->next;
-		free(b);
-		b = buff;
-	}
-
-	for (int i = 0; i < pool->alloc_count; i++) 
-		free(pool->blobs[i]);
-	free(pool->blobs);
-	free(pool->blob_sizes);
-	free(pool->allocd_addr);
-	free(pool);
+#endif
+	return MPOOL_SUCCESS;
+}
+
+
+mpool_error mpool_epoch_exit (struct mpool* pool)
+{
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+#ifdef MULTITHREAD
+	struct _thread_cache* tc = _tcache_key_ok ? _find_thread_cache(pool) : NULL;
+	if (tc == NULL || tc->nesting == 0)
+		return MPOOL_FAILURE;
+	if (--tc->nesting == 0)
+		atomic_store_explicit(&tc->epoch, 0, memory_order_release);
+#endif
+	return MPOOL_SUCCESS;
+}
+
+
+mpool_error mpool_retire (struct mpool* pool, void* item)
+{
+	if (item == NULL || pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+#ifdef MULTITHREAD
+	mpool_error err = _check_dealloc(pool, item);
+	if (err != MPOOL_SUCCESS)
+		return err;
+
+	struct _thread_cache* tc = _epoch_thread(pool);
+	if (tc == NULL) {
+		_undo_dealloc(pool, item);
+		return MPOOL_ERR_ALLOC;
+	}
+
+	/* The epoch is read after the caller unlinked @item, so every reader 
+	 * that may still see it entered in this epoch or before.
+	 */
+	uint64_t epoch = atomic_load(&pool->epoch);
+	if ((err = _epoch_drain(pool, tc, epoch)) != MPOOL_SUCCESS) {
+		_undo_dealloc(pool, item);
+		return err;
+	}
+
+	struct _limbo* limbo = &tc->limbo[epoch % EPOCH_LISTS];
+	if ((err = _limbo_push(limbo, item)) != MPOOL_SUCCESS) {
+		_undo_dealloc(pool, item);
+		return err;
+	}
+	limbo->epoch = epoch;
+
+	if (++tc->retired >= EPOCH_BATCH) {
+		tc->retired = 0;
+		if ((err = _epoch_advance(pool)) == MPOOL_SUCCESS)
+			err = _epoch_drain(pool, tc, atomic_load(&pool->epoch));
+	}
+	return err;
+#else
+	return mpool_dealloc(item, pool);
+#endif
+}
+
+
+mpool_error mpool_epoch_reclaim (struct mpool* pool)
+{
+	if (pool == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+#ifdef MULTITHREAD
+	/* Blocks retired in this epoch are safe two epochs on */
+	mpool_error err = MPOOL_SUCCESS;
+	pthread_once(&_tcache_once, _tcache_key_init);
+	for (int i = 0; i < 2 && err == MPOOL_SUCCESS; i++)
+		err = _epoch_advance(pool);
+
+	struct _thread_cache* tc = _tcache_key_ok ? _find_thread_cache(pool) : NULL;
+	if (err == MPOOL_SUCCESS && tc != NULL)
+		err = _epoch_drain(pool, tc, atomic_load(&pool->epoch));
+	return err;
+#else
 	return MPOOL_SUCCESS;
+#endif
 }
 
 
@@ -533,8 +4593,51 @@ mpool_error set_safe_mode(struct mpool* pool)
 {
 	if (pool == NULL)
 		return MPOOL_ERR_NULL_ARG;
+	if (pool->shared != NULL)
+		return MPOOL_FAILURE;
+	if (pool->safe_mode == SAFE)
+		return MPOOL_SUCCESS;
+
+#ifdef MULTITHREAD
+	for (int i = 0; !pool->lock_free && i < pool->nshards; i++)
+		if (_lock(pool, &pool->shards[i].mutex) != 0)
+			return MPOOL_ERR_MUTEX;
+#endif
+
+	/* Blocks on the free lists (and parked in the depot) are marked free now. 
+	 * Blocks held by the user or a thread cache get marked as they come back.
+	 */
+	for (int i = 0; i < pool->nshards; i++) {
+		struct _shard* shard = &pool->shards[i];
+		if (pool->lock_free) {
+			uint32_t top = LF_INDEX(atomic_load(&shard->lf_head));
+			for (struct _block* b = top ? _slot_ptr(pool, top - 1) : NULL; b; b = b->next)
+				_mark_free(pool, b);
+		} else {
+			for (struct _block* b = shard->list; b; b = b->next)
+				_mark_free(pool, b);
+		}
+	}
+	for (int32_t i = 0; i < pool->depot_count; i++)
+		for (struct _block* b = pool->depot[i].head; b; b = b->next)
+			_mark_free(pool, b);
+
+	struct _blob_table* table = atomic_load_explicit(&pool->blob_table, 
+		memory_order_acquire);
+	for (int i = 0; pool->ordered && i < table->count; i++) {
+		struct _blob* blob = table->by_index[i];
+		for (int32_t w = 0; w <= MAP_WORD(blob->count); w++)
+			atomic_store_explicit(&blob->free_map[w], blob->avail_map[w], 
+				memory_order_relaxed);
+	}
 
 	pool->safe_mode = SAFE;
+
+#ifdef MULTITHREAD
+	for (int i = 0; !pool->lock_free && i < pool->nshards; i++)
+		if (MUTEX_UNLOCK(&pool->shards[i].mutex) != 0)
+			return MPOOL_ERR_MUTEX;
+#endif
 	return MPOOL_SUCCESS;
 }
 
@@ -547,6 +4650,138 @@ int32_t get_safe_mode(struct mpool* pool)
 }
 
 
+/**
+ * struct mpool_set - One pool per size class
+ *
+ * @count: Amount of classes
+ * @sizes: Block size of each class, increasing
+ * @pools: Pool of each class
+ */
+struct mpool_set {
+	int count;
+	size_t* sizes;
+	struct mpool** pools;
+};
+
+/* Classes used when init_mpool_set() isn't given any */
+static const size_t _default_classes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+
+
+/**
+ * _set_class() - Find the smallest class of a set holding @size bytes
+ *
+ * Returns: Position of the class, or -1 if @size is too large.
+ */
+static int _set_class (struct mpool_set* set, size_t size)
+{
+	int lo = 0;
+	int hi = set->count;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (set->sizes[mid] < size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < set->count ? lo : -1;
+}
+
+
+mpool_error init_mpool_set (const size_t* sizes, int count, int32_t capacity, 
+		const struct mpool_attr* attr, struct mpool_set** set)
+{
+	if (set == NULL)
+		return MPOOL_ERR_NULL_ARG;
+	if (sizes == NULL) {
+		sizes = _default_classes;
+		count = sizeof(_default_classes) / sizeof(_default_classes[0]);
+	}
+	if (count <= 0 || sizes[0] == 0)
+		return MPOOL_ERR_INVALID_ARG;
+	for (int i = 1; i < count; i++)
+		if (sizes[i] <= sizes[i - 1])
+			return MPOOL_ERR_INVALID_ARG;
+
+	*set = calloc(1, sizeof(struct mpool_set));
+	if (*set == NULL)
+		return MPOOL_ERR_ALLOC;
+	(*set)->sizes = malloc(sizeof(size_t) * (size_t) count);
+	(*set)->pools = calloc((size_t) count, sizeof(struct mpool*));
+	if ((*set)->sizes == NULL || (*set)->pools == NULL) {
+		free_mpool_set(*set);
+		*set = NULL;
+		return MPOOL_ERR_ALLOC;
+	}
+
+	memcpy((*set)->sizes, sizes, sizeof(size_t) * (size_t) count);
+	for (int i = 0; i < count; i++) {
+		mpool_error err = init_mpool_attr(sizes[i], capacity, attr, &(*set)->pools[i]);
+		if (err != MPOOL_SUCCESS) {
+			free_mpool_set(*set);
+			*set = NULL;
+			return err;
+		}
+		(*set)->count = i + 1;
+	}
+	return MPOOL_SUCCESS;
+}
+
+
+void* mpool_set_alloc (struct mpool_set* set, size_t size, mpool_error* error)
+{
+	if (set == NULL) {
+		if (error != NULL)
+			*error = MPOOL_ERR_NULL_ARG;
+		return NULL;
+	}
+
+	int c = _set_class(set, size);
+	if (c < 0) {
+		if (error != NULL)
+			*error = MPOOL_ERR_INVALID_ARG;
+		return NULL;
+	}
+	return mpool_alloc(set->pools[c], error);
+}
+
+
+mpool_error mpool_set_dealloc (struct mpool_set* set, void* item)
+{
+	if (set == NULL || item == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+	for (int i = 0; i < set->count; i++)
+		if (_find_blob(set->pools[i], item) != NULL)
+			return mpool_dealloc(item, set->pools[i]);
+	return MPOOL_ERR_INVALID_ADDRESS;
+}
+
+
+struct mpool* mpool_set_class (struct mpool_set* set, size_t size)
+{
+	if (set == NULL)
+		return NULL;
+
+	int c = _set_class(set, size);
+	return c < 0 ? NULL : set->pools[c];
+}
+
+
+mpool_error free_mpool_set (struct mpool_set* set)
+{
+	if (set == NULL)
+		return MPOOL_ERR_NULL_ARG;
+
+	for (int i = 0; i < set->count; i++)
+		free_mpool(set->pools[i]);
+	free(set->pools);
+	free(set->sizes);
+	free(set);
+	return MPOOL_SUCCESS;
+}
+
+
 static struct _errorstr {
 	mpool_error err;
 	char* message;
@@ -562,6 +4797,11 @@ static struct _errorstr {
 	than mpool_alloc() was called."},
 	{ MPOOL_EMPTY_POOL, "Memory pool is empty, all available memory has been \
 		given out" },
+	{ MPOOL_ERR_INVALID_ARG, "Invalid argument sent to function" },
+	{ MPOOL_ERR_DOUBLE_FREE, "Tried to return address to pool that is already free" },
+	{ MPOOL_BUSY, "Pool is locked by another thread, try again" },
+	{ MPOOL_ERR_CORRUPTED, "A block was written past its end or after it was free'd, "
+		"or a shared pool was never finished being set up" },
 };
 
 void print_mpool_error(FILE* fh, char* message, mpool_error err)
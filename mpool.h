@@ -28,6 +28,9 @@
  *
  */
 
+#ifndef MPOOL_H
+#define MPOOL_H
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -42,6 +45,8 @@
 #	define MUTEX_LOCK pthread_mutex_lock
 #	define MUTEX_UNLOCK pthread_mutex_unlock
 #	define MUTEX_INIT pthread_mutex_init
+#	define MUTEX_TRYLOCK pthread_mutex_trylock
+#	define MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
 #else
 #	warn Unknown compiler being used.
 #endif
@@ -51,6 +56,10 @@
 #define MPOOL_REV_VERSION 3
 #define MPOOL_VERSION "0.1.3" 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 /* mpool_error: Various error codes returned by the functions.
  *	
@@ -67,6 +76,10 @@ typedef enum mpool_error {
 	MPOOL_ERR_INVALID_REALLOC_SIZE,
 	MPOOL_FULL_POOL,
 	MPOOL_EMPTY_POOL,
+	MPOOL_ERR_INVALID_ARG,
+	MPOOL_ERR_DOUBLE_FREE,
+	MPOOL_BUSY,
+	MPOOL_ERR_CORRUPTED,
 } mpool_error;
 
 
@@ -76,6 +89,111 @@ typedef enum mpool_error {
  */
 struct mpool;
 
+/**
+ * struct mpool_set - A set of pools, one per size class, see init_mpool_set()
+ */
+struct mpool_set;
+
+
+/* Flags for struct mpool_attr, may be or'd together */
+#define MPOOL_LOCK_FREE (1u << 0)
+#define MPOOL_SAFE_MODE (1u << 1)
+#define MPOOL_MMAP (1u << 2)
+#define MPOOL_HUGEPAGES (1u << 3)
+#define MPOOL_PREFAULT (1u << 4)
+#define MPOOL_NUMA_BIND (1u << 5)
+#define MPOOL_LAZY (1u << 6)
+#define MPOOL_HANDLES (1u << 7)
+#define MPOOL_ADDRESS_ORDERED (1u << 8)
+#define MPOOL_FIRST_TOUCH (1u << 9)
+#define MPOOL_TRACK_FRESH (1u << 10)
+#define MPOOL_ALL_FLAGS (MPOOL_LOCK_FREE | MPOOL_SAFE_MODE | MPOOL_MMAP | \
+	MPOOL_HUGEPAGES | MPOOL_PREFAULT | MPOOL_NUMA_BIND | MPOOL_LAZY | \
+	MPOOL_HANDLES | MPOOL_ADDRESS_ORDERED | MPOOL_FIRST_TOUCH | MPOOL_TRACK_FRESH)
+
+/* 
+ * Handles are 32 bits: the low MPOOL_HANDLE_INDEX_BITS are the slot index of
+ * the block plus one, the rest its generation, see mpool_alloc_handle(). 
+ */
+#define MPOOL_HANDLE_INDEX_BITS 24
+#define MPOOL_NULL_HANDLE 0u
+
+/**
+ * struct mpool_attr - Optional settings for init_mpool_attr()
+ *
+ * @flags: Or'd together MPOOL_* flags:
+ * 	MPOOL_LOCK_FREE -> mpool_alloc() and mpool_dealloc() never block. The free
+ * 	list becomes a lock-free stack instead of a list behind a mutex.
+ * 	MPOOL_SAFE_MODE -> Start the pool in safe mode, see set_safe_mode().
+ * 	MPOOL_MMAP -> Each blob is its own anonymous mmap() instead of malloc'd,
+ * 	and is munmap'd by free_mpool().
+ * 	MPOOL_HUGEPAGES -> Back the blobs with 2MB huge pages, using MAP_HUGETLB if
+ * 	the system has some reserved, else madvise(MADV_HUGEPAGE). Implies 
+ * 	MPOOL_MMAP.
+ * 	MPOOL_PREFAULT -> Fault every page of a blob in when it is allocated, so
+ * 	the hot path never page faults. Implies MPOOL_MMAP.
+ * 	MPOOL_NUMA_BIND -> Bind the blobs to NUMA node @numa_node with mbind() 
+ * 	(Linux only). Implies MPOOL_MMAP.
+ * 	MPOOL_LAZY -> Don't split the blobs into blocks up front. Blocks that have
+ * 	never been used are cut off the end of the blobs as they are needed, and
+ * 	only freed blocks go on the free list, so init is O(1) and only memory 
+ * 	that gets used is ever touched. Best for very large pools.
+ * 	MPOOL_HANDLES -> Keep a generation count per block, so handles to blocks 
+ * 	that have since been freed are refused, see mpool_alloc_handle(). Costs
+ * 	a byte per block and a lookup in each mpool_dealloc().
+ * 	MPOOL_ADDRESS_ORDERED -> Always hand out the free block with the lowest 
+ * 	address, instead of the one freed last. The free blocks are a bitmap per 
+ * 	blob searched with find-first-set, so after churn the blocks in use stay
+ * 	packed together for scans that go through them in order, at the cost of 
+ * 	the cache warmth of LIFO reuse. Can't be used with MPOOL_LOCK_FREE, and 
+ * 	the pool can't have thread caches, an owner or be trimmed.
+ * 	MPOOL_FIRST_TOUCH -> Fault in each shard's part of a large blob from a
+ * 	thread running on the CPUs that take blocks from that shard (see 
+ * 	init_mpool_sharded()), so with the kernel's default first-touch NUMA 
+ * 	policy every shard's memory is on the node of the CPUs using it. Sets 
+ * 	@init_threads to @nshards, and implies MPOOL_PREFAULT. Only blobs of 16MB
+ * 	or more are spread like this, smaller ones are faulted in by the calling
+ * 	thread. Needs @nshards of 2 or more, and can't be used with 
+ * 	MPOOL_NUMA_BIND. Linux only.
+ * 	MPOOL_TRACK_FRESH -> Keep track of which blocks were never handed out, so
+ * 	mpool_calloc() knows they still hold the 0s of a new mapping. Costs a 
+ * 	lookup and a compare-and-swap on every allocation, so only worth it for 
+ * 	pools mostly used with mpool_calloc(). Implies MPOOL_MMAP.
+ * @growth_factor: When not 0, the pool grows on its own instead of returning
+ * MPOOL_EMPTY_POOL from mpool_alloc(). Each time it runs empty its capacity
+ * is multiplied by this (ie 2.0 doubles it). Must be 0 or >= 1.
+ * @max_capacity: The pool never grows past this many blocks, 0 for no limit
+ * @min_grow: Each growth adds at least this many blocks. Setting this with a
+ * @growth_factor of 0 grows the pool by exactly @min_grow blocks at a time.
+ * @numa_node: NUMA node for MPOOL_NUMA_BIND, ignored without it
+ * @alignment: Every block is aligned to this, which must be a power of two
+ * (ie 16 for SIMD loads, 64 for a cache line or sysconf(_SC_PAGESIZE) for a 
+ * page). The distance between blocks is rounded up to a multiple of it, see 
+ * mpool_stride(). 0 leaves blocks with whatever alignment @block_size gives.
+ * @nshards: Split the free list into this many independently locked parts,
+ * see init_mpool_sharded(). 0 means 1, at most 1024.
+ * @init_threads: Threads to split the linking up (and with MPOOL_PREFAULT 
+ * the faulting in) of each new blob of 16MB or more over, at most 256. 0 or 
+ * 1 leaves it all to the calling thread. Worth it for pools of gigabytes, 
+ * where init is otherwise one thread writing to every page.
+ *
+ * A zero'd struct mpool_attr gives the same pool as init_mpool(), so the 
+ * recommended use is to zero it and only set the fields you care about:
+ *
+ * struct mpool_attr attr = { 0 };
+ * attr.flags = MPOOL_LOCK_FREE;
+ */
+struct mpool_attr {
+	uint32_t flags;
+	double growth_factor;
+	int32_t max_capacity;
+	int32_t min_grow;
+	int numa_node;
+	size_t alignment;
+	int nshards;
+	int init_threads;
+};
+
 
 /**
  * init_mpool() - This function initializes a struct mpool variable. 
@@ -92,6 +210,9 @@ struct mpool;
  * up everything and allocates the first blob of memory that is the size
  * @block_size x @capacity in bytes.
  *
+ * Free blocks are kept track of by storing a pointer inside of them, so 
+ * @block_size is rounded up to a multiple of sizeof(void*) inside the blob.
+ *
  * Note that if you pass a pointer to a struct mpool that has already been 
  * allocated, that pointer will be lost. The recommended use is something like:
  *
@@ -103,6 +224,183 @@ struct mpool;
  */
 mpool_error init_mpool (size_t block_size, int32_t capacity, struct mpool** pool);
 
+/**
+ * init_mpool_aligned() - Initialize a struct mpool with aligned blocks
+ *
+ * @block_size: Size of each block needed (ie sizeof(struct))
+ * @capacity: Amount of @block_size chunks needed
+ * @alignment: Alignment of each block, a power of two
+ * @pool: Pointer to where the struct mpool* should be initialized
+ *
+ * Returns: Same as init_mpool(), or MPOOL_ERR_INVALID_ARG if @alignment isn't
+ * a power of two.
+ *
+ * Shorthand for init_mpool_attr() with only @alignment set in the 
+ * struct mpool_attr. Aligning blocks to the cache line size (64 on most 
+ * machines) stops threads that use neighbouring blocks from false sharing.
+ */
+mpool_error init_mpool_aligned (size_t block_size, int32_t capacity, 
+		size_t alignment, struct mpool** pool);
+
+/**
+ * init_mpool_sharded() - Initialize a struct mpool with a sharded free list
+ *
+ * @block_size: Size of each block needed (ie sizeof(struct))
+ * @capacity: Amount of @block_size chunks needed
+ * @nshards: Amount of parts to split the free list into, ie the amount of CPUs
+ * @pool: Pointer to where the struct mpool* should be initialized
+ *
+ * Returns: Same as init_mpool(), or MPOOL_ERR_INVALID_ARG if @nshards isn't 
+ * between 0 and 1024.
+ *
+ * Shorthand for init_mpool_attr() with only @nshards set in the struct 
+ * mpool_attr. The free blocks are split over @nshards lists, each with a lock
+ * of its own. A thread uses the list of the CPU it is running on (or one 
+ * picked by thread when the CPU isn't known), and only takes blocks from the
+ * other lists when its own is empty, so threads on different CPUs rarely 
+ * touch the same lock. This sits between the single list of init_mpool() and 
+ * the thread caches of mpool_thread_cache_enable(), without blocks getting 
+ * stuck in idle threads.
+ */
+mpool_error init_mpool_sharded (size_t block_size, int32_t capacity, 
+		int nshards, struct mpool** pool);
+
+/**
+ * init_mpool_attr() - Initialize a struct mpool with extra settings
+ *
+ * @block_size: Size of each block needed (ie sizeof(struct))
+ * @capacity: Amount of @block_size chunks needed
+ * @attr: Settings for the pool, may be NULL for the defaults
+ * @pool: Pointer to where the struct mpool* should be initialized
+ *
+ * Returns: MPOOL_SUCCESS if the pool is ready to use, MPOOL_ERR_INVALID_ARG if
+ * @attr holds an unknown flag, else the corresponding error code.
+ *
+ * This works the same as init_mpool(), see struct mpool_attr for what may be 
+ * changed.
+ *
+ * In lock-free mode (MPOOL_LOCK_FREE) the free list is a stack of slot indexes
+ * with a generation tag, updated with a single 64 bit compare-and-swap, so a
+ * thread that is descheduled in the middle of mpool_alloc()/mpool_dealloc() 
+ * never holds up the others. Because the pool needs to look up the slot index
+ * of a block it is given back, mpool_dealloc() returns 
+ * MPOOL_ERR_INVALID_ADDRESS for an address that isn't a block of the pool, 
+ * even with safe mode off (unless the block is kept in a thread cache, see 
+ * mpool_thread_cache_enable()).
+ *
+ * With a growth policy (@growth_factor or @min_grow), a pool that runs empty
+ * gets a new blob added by whichever thread found it empty, while the other
+ * threads keep using the pool. Growth is serialized with mpool_realloc() by 
+ * its own lock, so the pool's free list lock is only held to splice the new 
+ * blocks on.
+ */
+mpool_error init_mpool_attr (size_t block_size, int32_t capacity, 
+		const struct mpool_attr* attr, struct mpool** pool);
+
+/**
+ * init_mpool_shm() - Make or attach to a pool shared between processes
+ * @name: Name of the POSIX shared memory object, ie "/my-pool"
+ * @block_size: Size of each block
+ * @capacity: Amount of blocks. 0 only attaches to a pool that already exists.
+ * @pool: Pointer to where the struct mpool* should be initialized
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_ERR_INVALID_ARG if the pool under @name was
+ * made with another @block_size or @capacity, MPOOL_FAILURE if there is no 
+ * such pool to attach to (or shared memory isn't supported), 
+ * MPOOL_ERR_CORRUPTED if the process that made it died before setting it up,
+ * else the corresponding error code
+ *
+ * The first process to call this for @name makes the shared memory object 
+ * (readable by the same user only) and sets the pool up in it. Processes 
+ * calling it after attach to the same blocks, and may then alloc and free 
+ * them with mpool_alloc() and mpool_dealloc() like any pool. A block is at a
+ * different address in each process, so give other processes its handle
+ * instead, see mpool_ptr_to_handle() and mpool_handle_to_ptr().
+ *
+ * The free list is kept in the shared memory as slot indices and only changed
+ * with compare-and-swap, so no lock is held across processes and one that 
+ * dies can't leave the pool locked (the blocks it had are lost, though).
+ * The capacity is fixed: mpool_realloc(), mpool_reset(), mpool_trim(), 
+ * thread caches, owners and safe mode aren't available and return 
+ * MPOOL_FAILURE. Stats are counted per process.
+ *
+ * free_mpool() detaches the calling process. The object stays until it is
+ * removed with mpool_shm_unlink(). That is also the way out of 
+ * MPOOL_ERR_CORRUPTED: the half made object can't be attached to, and stops 
+ * it from being made again, until it is removed.
+ */
+mpool_error init_mpool_shm (const char* name, size_t block_size, int32_t capacity, 
+		struct mpool** pool);
+
+/**
+ * mpool_shm_unlink() - Remove the shared memory object of a shared pool
+ * @name: Name given to init_mpool_shm()
+ *
+ * Processes attached to the pool keep using it until they free_mpool() it, 
+ * but no new process can attach.
+ */
+mpool_error mpool_shm_unlink (const char* name);
+
+/**
+ * mpool_open_file() - Make or reopen a pool stored in a file
+ * @path: Path of the file
+ * @block_size: Size of each block
+ * @capacity: Amount of blocks. 0 only opens a pool that already exists.
+ * @pool: Pointer to where the struct mpool* should be initialized
+ *
+ * Returns: The same as init_mpool_shm()
+ *
+ * This is init_mpool_shm() with the pool mapped from a file instead of a 
+ * shared memory object (the file is made, readable by the same user only, if
+ * it doesn't exist). The file holds the header, free list and blocks, so after
+ * a restart the pool opens again in the state it was left in: O(1), with 
+ * pages read in as they're used. Blocks that were in use are still in use, 
+ * and since the pool may be mapped at another address, data in the blocks 
+ * should refer to other blocks by handle (see mpool_ptr_to_handle()) instead
+ * of by pointer.
+ *
+ * Files are refused with MPOOL_ERR_INVALID_ARG if they were made with another 
+ * block size or by a version of the library with another layout. The file 
+ * may also be opened by several processes at once. Changes reach the file as
+ * the kernel writes them back, or right away with mpool_sync(). Keep the 
+ * handle of a block that leads to the rest with mpool_set_root() to find the
+ * blocks in use again after reopening. A file left behind by a process that 
+ * died while making it gives MPOOL_ERR_CORRUPTED, unlink() it to start over.
+ */
+mpool_error mpool_open_file (const char* path, size_t block_size, int32_t capacity, 
+		struct mpool** pool);
+
+/**
+ * mpool_sync() - Write a file backed pool to its file
+ * @pool: Pool from mpool_open_file()
+ *
+ * Returns: MPOOL_SUCCESS once the file is up to date, MPOOL_FAILURE if @pool
+ * isn't backed by a file or writing it failed
+ */
+mpool_error mpool_sync (struct mpool* pool);
+
+/**
+ * mpool_set_root() - Keep a handle in the header of a shared or file pool
+ * @pool: Pool from init_mpool_shm() or mpool_open_file()
+ * @handle: Handle to keep, ie of the block that leads to all the others
+ *
+ * Returns: MPOOL_SUCCESS, or MPOOL_FAILURE if @pool isn't shared
+ *
+ * The pool doesn't look at @handle, it is only kept for mpool_get_root(). It
+ * is stored with release order, so what was written into the block before is 
+ * seen by a process that gets the handle from mpool_get_root().
+ */
+mpool_error mpool_set_root (struct mpool* pool, uint32_t handle);
+
+/**
+ * mpool_get_root() - Get the handle kept with mpool_set_root()
+ * @pool: Pool from init_mpool_shm() or mpool_open_file()
+ *
+ * Returns: The handle, or MPOOL_NULL_HANDLE if none was set or @pool isn't 
+ * shared
+ */
+uint32_t mpool_get_root (struct mpool* pool);
+
 /**
  * mpool_alloc() - Get a chunk of memory from the blob.
  *
@@ -148,9 +446,48 @@ void* mpool_alloc (struct mpool* pool, mpool_error* error);
  * This function is a small wrapper around the mpool_alloc() function that
  * garuntees the memory will be 0'd out.
  *
+ * Blobs that are mmap'd (see MPOOL_MMAP) start out as 0s. With 
+ * MPOOL_TRACK_FRESH the pool keeps track of which of their blocks were never
+ * handed out, so only the free list link has to be cleared in those rather 
+ * than the whole block.
  */
 void* mpool_calloc (struct mpool* pool, mpool_error* error);
 
+/**
+ * mpool_try_alloc() - Get a chunk of memory without waiting on any lock
+ * @pool: Pool structure that has been init with init_mpool()
+ * @error: The resulting error code from function will be placed here
+ *
+ * Returns: The address of the memory, or NULL with *@error set to 
+ * MPOOL_EMPTY_POOL, or to MPOOL_BUSY if the free blocks there may be are 
+ * behind a lock another thread holds.
+ *
+ * Like mpool_alloc(), but shards that are locked are skipped rather than 
+ * waited on, and the pool isn't grown. The calling thread's cache is only used
+ * if it has blocks in it already. Lock-free pools never wait anyway.
+ */
+void* mpool_try_alloc (struct mpool* pool, mpool_error* error);
+
+/**
+ * mpool_alloc_wait() - Get a chunk of memory, waiting for one if need be
+ * @pool: Pool structure that has been init with init_mpool()
+ * @timeout_ns: How long to wait at most in nanoseconds, < 0 to wait for as 
+ * long as it takes
+ * @error: The resulting error code from function will be placed here
+ *
+ * Returns: The address of the memory, or NULL with *@error set, to 
+ * MPOOL_EMPTY_POOL if the pool was still empty after @timeout_ns
+ *
+ * Where mpool_alloc() fails with MPOOL_EMPTY_POOL, this sleeps on a condition
+ * variable until another thread gives blocks back (or the pool is realloc'd or
+ * reset), so a bounded pool can throttle its producers without them spinning.
+ * Blocks sitting in other threads' caches don't wake anyone until those are 
+ * flushed.
+ *
+ * Shared pools give MPOOL_FAILURE, as other processes can't wake the caller.
+ */
+void* mpool_alloc_wait (struct mpool* pool, int64_t timeout_ns, mpool_error* error);
+
 /**
  * mpool_dealloc() - Return a piece of memory to the pool.
  * @item: Address of the item to return 
@@ -164,13 +501,128 @@ void* mpool_calloc (struct mpool* pool, mpool_error* error);
  * address to the pool, don't. This function currently doesn't check if the mem
  * address being returned to the pool is and address that came from the pool.
  * So any address you put in you may end up taking out later, which may cause
- * weird behaviour.
+ * weird behaviour. The pool also writes its free list pointer into the 
+ * returned memory, so handing back an address that isn't from the pool will
+ * corrupt whatever lives there (see set_safe_mode()).
  *
  * Note that you don't need to call mpool_dealloc() on every address allocated 
  * from mpool_alloc() as it is automatically cleaned up with free_mpool().
  */
 mpool_error mpool_dealloc (void* item, struct mpool* pool);
 
+/**
+ * mpool_alloc_bulk() - Get many chunks of memory from the pool at once
+ * @pool: Pool structure that has been init with init_mpool()
+ * @out: Array the addresses are written to, must have room for @n of them
+ * @n: How many chunks to allocate
+ * @error: The resulting error code from function will be placed here
+ *
+ * Returns: How many addresses were written to @out. 
+ *
+ * This function takes the pool's lock once and splices up to @n blocks off 
+ * the free list in one go, which is much cheaper than calling mpool_alloc() 
+ * @n times. If the pool holds fewer than @n free blocks, all of them are 
+ * handed out and *@error is set to MPOOL_EMPTY_POOL.
+ *
+ * The blocks come straight from the pool, the calling thread's cache (see 
+ * mpool_thread_cache_enable()) is left alone.
+ */
+int32_t mpool_alloc_bulk (struct mpool* pool, void** out, int32_t n, mpool_error* error);
+
+/**
+ * mpool_dealloc_bulk() - Return many pieces of memory to the pool at once
+ * @pool: Pool structure that has been init with init_pool()
+ * @items: Array of the addresses to return 
+ * @n: How many addresses are in @items
+ *
+ * Returns: MPOOL_SUCCESS if everything worked, else the corresponding error
+ * code.
+ *
+ * The addresses are linked together and spliced onto the free list with a 
+ * single lock. If any address fails the safe mode check none of them are 
+ * returned. Like mpool_alloc_bulk(), the thread caches are bypassed.
+ */
+mpool_error mpool_dealloc_bulk (struct mpool* pool, void** items, int32_t n);
+
+/**
+ * mpool_alloc_handle() - Get a block from the pool as a 32 bit handle
+ * @pool: Pool structure that has been init with init_mpool()
+ * @error: The resulting error code from function will be placed here
+ *
+ * Returns: A handle to the block, or MPOOL_NULL_HANDLE with *@error set
+ *
+ * A handle is half the size of a pointer, for data structures that store a 
+ * lot of references to blocks. It holds the slot index of the block, so only 
+ * the first 2^24 - 1 blocks of a pool (see MPOOL_HANDLE_INDEX_BITS) can have 
+ * one. Pools with MPOOL_HANDLES never get more blocks than that, init and 
+ * mpool_realloc() refuse larger capacities and growth stops there. In other
+ * pools the blocks past it are skipped, and MPOOL_EMPTY_POOL is returned once
+ * only those are left. The pool isn't grown past the limit for a handle.
+ *
+ * With MPOOL_HANDLES each handle also carries the block's generation, which 
+ * is bumped every time the block is freed. A handle kept after its block was 
+ * freed is then refused by mpool_handle_to_ptr() and mpool_dealloc_handle(),
+ * until the generation wraps around after 256 frees of the same block. 
+ * Without it the generation is always 0, and stale handles go unnoticed.
+ */
+uint32_t mpool_alloc_handle (struct mpool* pool, mpool_error* error);
+
+/**
+ * mpool_handle_to_ptr() - Get the address of the block a handle refers to
+ * @pool: Pool the handle came from
+ * @handle: Handle from mpool_alloc_handle() or mpool_ptr_to_handle()
+ *
+ * Returns: Address of the block, or NULL if @handle isn't a block of @pool or
+ * (with MPOOL_HANDLES) the block has been freed since
+ *
+ * This is a lookup in the pool's table of blobs by slot index, O(log blobs) 
+ * and a multiply-add for a pool that never grew.
+ */
+void* mpool_handle_to_ptr (struct mpool* pool, uint32_t handle);
+
+/**
+ * mpool_ptr_to_handle() - Get the handle of a block from its address
+ * @pool: Pool the block came from
+ * @item: Address of the block, from mpool_alloc() or mpool_handle_to_ptr()
+ *
+ * Returns: The handle, or MPOOL_NULL_HANDLE if @item isn't the start of a 
+ * block of @pool or its slot index is too large for a handle
+ */
+uint32_t mpool_ptr_to_handle (struct mpool* pool, const void* item);
+
+/**
+ * mpool_dealloc_handle() - Give the block a handle refers to back to the pool
+ * @pool: Pool the handle came from
+ * @handle: Handle of the block
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_ERR_INVALID_ADDRESS if mpool_handle_to_ptr() 
+ * refuses @handle, else whatever mpool_dealloc() returns
+ */
+mpool_error mpool_dealloc_handle (struct mpool* pool, uint32_t handle);
+
+/**
+ * mpool_foreach_allocated() - Call a function on every block in use
+ * @pool: Pool in safe mode, see set_safe_mode()
+ * @callback: Called with each block in use and @ctx. Returning non 0 stops 
+ * the walk early.
+ * @ctx: Passed to @callback as is
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_ERR_INVALID_ARG if @pool isn't in safe mode,
+ * else the corresponding error code
+ *
+ * The blocks are visited in address order, one blob after another, using the
+ * bitmap safe mode keeps of which blocks are free. Each 64 blocks are one word
+ * of it, so runs of free blocks cost next to nothing to skip. This is meant 
+ * for sweeps such as expiring timeouts, and @callback may give the block it 
+ * was called with back to the pool.
+ *
+ * The walk takes no lock. Blocks allocated or freed by other threads while it
+ * runs may or may not be visited, so it is only exact while no other thread 
+ * uses the pool. Blocks in thread caches count as free.
+ */
+mpool_error mpool_foreach_allocated (struct mpool* pool, 
+		int (*callback)(void* item, void* ctx), void* ctx);
+
 /**
  * mpool_realloc() - Make the pool larger than it currently is
  * @new_capacity: How large the new pool should be
@@ -187,9 +639,61 @@ mpool_error mpool_dealloc (void* item, struct mpool* pool);
  *
  * That means the user must keep track of the size of current pool. This info 
  * may be found with the mpool_capacity() function. 
+ *
+ * This may be called while other threads are using the pool, without pausing
+ * them. The blob is mapped and split into blocks with only the pool's growth
+ * lock held, and the blob table that safe mode, handles and lock-free pools 
+ * look blocks up in is copied, never changed in place, so threads in the 
+ * middle of a lookup keep a valid table. The new blocks then go onto each 
+ * shard's free list in a single splice. For a pool that should grow on its 
+ * own when it runs empty, see the growth policy in struct mpool_attr instead.
  */
 mpool_error mpool_realloc (int32_t new_capacity, struct mpool* pool);
 
+/**
+ * mpool_reset() - Give every block back to the pool at once
+ * @pool: Pool structure that has been init with init_mpool()
+ * @release: If not 0, the memory added after init (by mpool_realloc() or the
+ * growth policy) is freed and the capacity goes back to what it was at init
+ *
+ * Returns: MPOOL_SUCCESS, else the corresponding error code
+ *
+ * Every block handed out by the pool, and every block held in its thread 
+ * caches, is free again after this, without any of them having to be given 
+ * back with mpool_dealloc(). This is for arena style use, where a lot of 
+ * blocks are allocated for one job and all thrown away at the end of it.
+ *
+ * No memory is written to, the pool just forgets its free lists and goes back
+ * to carving blocks off the start of its blobs as MPOOL_LAZY pools do, so it
+ * is O(1) in the amount of blocks. Only with MPOOL_HANDLES is every block's 
+ * generation bumped, so handles from before the reset are refused. No other 
+ * thread may use the pool while it is being reset, and none of the old blocks
+ * may be used after.
+ */
+mpool_error mpool_reset (struct mpool* pool, int release);
+
+/**
+ * mpool_trim() - Give memory the pool isn't using back to the system
+ * @pool: Pool structure that has been init with init_mpool()
+ * @keep_capacity: The capacity isn't trimmed below this many blocks
+ * @release_pages: If not 0, the unused pages at the end of the blobs that are
+ * kept are handed back to the kernel as well (with madvise(MADV_DONTNEED))
+ *
+ * Returns: MPOOL_SUCCESS, else the corresponding error code
+ *
+ * Blobs that have no block in use are freed, newest first, for as long as the
+ * capacity stays at or above @keep_capacity. This undoes growth once a burst 
+ * of allocations is over. Blocks in thread caches count as free and are taken
+ * back. With @release_pages, the blocks after the last one still in use in a 
+ * blob go back to being uncarved (see MPOOL_LAZY), so their pages are only 
+ * faulted in again once they are reused.
+ *
+ * The free lists are rebuilt in address order, so this is O(capacity). Like 
+ * mpool_reset(), no other thread may use the pool while it is being trimmed.
+ */
+mpool_error mpool_trim (struct mpool* pool, int32_t keep_capacity, 
+		int release_pages);
+
 /**
  * mpool_capacity() - Get the capacity of the current pool
  * @pool: struct mpool to check capacity of
@@ -205,6 +709,127 @@ mpool_error mpool_realloc (int32_t new_capacity, struct mpool* pool);
  */
 int32_t mpool_capacity (struct mpool* pool);
 
+/**
+ * mpool_stride() - Get the distance between two blocks of the pool
+ * @pool: struct mpool to check
+ *
+ * Returns: The amount of bytes each block really takes up, or 0 if @pool is
+ * NULL.
+ *
+ * This is the @block_size given to init_mpool(), rounded up to a multiple of
+ * sizeof(void*) and then to the alignment of the pool (see struct 
+ * mpool_attr). Blocks next to each other in the pool are this many bytes 
+ * apart.
+ */
+size_t mpool_stride (struct mpool* pool);
+
+/**
+ * struct mpool_stats - Snapshot of a pool's counters, see mpool_get_stats()
+ *
+ * @capacity: Same as mpool_capacity()
+ * @in_use: Blocks handed out and not given back yet
+ * @peak_in_use: Highest @in_use has been. It is exact for pools with one 
+ * shard, sharded pools only check it in this call and whenever the pool ran 
+ * empty or grew, so a short spike in between is missed.
+ * @allocs: Blocks handed out in total
+ * @frees: Blocks given back in total
+ * @empty_failures: Allocations that failed with MPOOL_EMPTY_POOL
+ * @grows: Times memory was added after init, by mpool_realloc() or growth
+ * @lock_contended: Times a thread found one of the pool's locks taken and had
+ * to wait for it
+ * @bytes_reserved: Memory held by the pool's blobs
+ * @bytes_used: Memory of the blocks in use (@in_use x block_size)
+ *
+ * 	How long the waits counted by @lock_contended took is given by 
+ * 	mpool_get_lock_waits() instead, so this struct keeps its size.
+ */
+struct mpool_stats {
+	int32_t capacity;
+	int64_t in_use;
+	int64_t peak_in_use;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t empty_failures;
+	uint64_t grows;
+	uint64_t lock_contended;
+	size_t bytes_reserved;
+	size_t bytes_used;
+};
+
+/**
+ * mpool_get_stats() - Get the counters of a pool
+ * @pool: struct mpool to check
+ * @stats: Where to put the counters
+ *
+ * Returns: MPOOL_SUCCESS, or MPOOL_FAILURE if the library was built with 
+ * MPOOL_NO_STATS, in which case only @capacity and @bytes_reserved are set.
+ *
+ * The counters are kept with relaxed atomics, so they cost next to nothing
+ * but are only exact when no other thread is using the pool. Blocks sitting 
+ * in thread caches count as free.
+ */
+mpool_error mpool_get_stats (struct mpool* pool, struct mpool_stats* stats);
+
+/* Amount of buckets mpool_get_lock_waits() has */
+#define MPOOL_LOCK_WAIT_BUCKETS 32
+
+/**
+ * mpool_get_lock_waits() - Get the histogram of how long lock waits took
+ * @pool: struct mpool to check
+ * @buckets: Where to put the buckets
+ * @n: Size of @buckets, the first min(@n, MPOOL_LOCK_WAIT_BUCKETS) are set
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_ERR_INVALID_ARG if @n is negative, or 
+ * MPOOL_FAILURE if the library was built with MPOOL_NO_STATS, in which case 
+ * the buckets are set to 0.
+ *
+ * Only the acquisitions counted by lock_contended in struct mpool_stats are 
+ * timed. Bucket i counts waits of 2^i to 2^(i+1) - 1 nanoseconds, the last 
+ * bucket everything longer.
+ */
+mpool_error mpool_get_lock_waits (struct mpool* pool, uint64_t* buckets, int n);
+
+/**
+ * struct mpool_hooks - Callbacks for tracing a pool, see mpool_set_hooks()
+ *
+ * @on_alloc: A block was handed out
+ * @on_free: A block was given back. It may be in use again by the time this is
+ * called, so only its address is of any use.
+ * @on_grow: The pool's capacity went from @old_capacity to @new_capacity, by
+ * mpool_realloc() or the growth policy
+ * @on_empty: An allocation failed with MPOOL_EMPTY_POOL at @capacity
+ * @arg: Passed to every callback as it is
+ *
+ * Any of the callbacks may be NULL.
+ */
+struct mpool_hooks {
+	void (*on_alloc) (struct mpool* pool, void* block, void* arg);
+	void (*on_free) (struct mpool* pool, void* block, void* arg);
+	void (*on_grow) (struct mpool* pool, int32_t old_capacity, 
+			int32_t new_capacity, void* arg);
+	void (*on_empty) (struct mpool* pool, int32_t capacity, void* arg);
+	void* arg;
+};
+
+/**
+ * mpool_set_hooks() - Have a pool call back on allocs, frees and growth
+ * @pool: Pool structure that has been init with init_mpool()
+ * @hooks: Callbacks to use, or NULL to stop calling any
+ *
+ * Returns: MPOOL_SUCCESS, or MPOOL_FAILURE if the library was built with 
+ * MPOOL_NO_HOOKS
+ *
+ * The callbacks run in whichever thread made the event happen, sometimes with
+ * one of the pool's locks held, so they should be quick and must not call 
+ * back into @pool. Blocks retired with mpool_retire() are seen by @on_free 
+ * once they are reclaimed. Without hooks set each event costs a branch, and 
+ * nothing at all when built with MPOOL_NO_HOOKS.
+ *
+ * Like mpool_thread_cache_enable(), this must be called before the pool is 
+ * shared with other threads.
+ */
+mpool_error mpool_set_hooks (struct mpool* pool, const struct mpool_hooks* hooks);
+
 /**
  * free_mpool() - Free the struct mpool* structure and all related memory
  * @pool: struct pool to free 
@@ -216,6 +841,187 @@ int32_t mpool_capacity (struct mpool* pool);
 mpool_error free_mpool (struct mpool* pool);
 
 
+/**
+ * mpool_thread_cache_enable() - Put a per-thread cache in front of the pool
+ * @pool: Pool structure that has been init with init_mpool()
+ * @magazine_size: Blocks moved between a thread and the pool at a time, or 0
+ * to use the default (32)
+ *
+ * Returns: MPOOL_SUCCESS if the caches were enabled, MPOOL_FAILURE if they 
+ * already were (or the pool has an owner, see mpool_set_owner(), or threads 
+ * aren't supported), else the corresponding error.
+ *
+ * Once enabled, every thread that allocs/deallocs from the pool keeps up to 
+ * two magazines of @magazine_size free blocks to itself. mpool_alloc() and 
+ * mpool_dealloc() only touch the pool's lock when a magazine runs empty or 
+ * full, and then move a whole magazine at a time. 
+ *
+ * This must be called before the pool is shared with other threads, and can't
+ * be turned off again. Blocks sitting in another thread's cache can't be 
+ * alloc'd by the calling thread, so mpool_alloc() may report MPOOL_EMPTY_POOL 
+ * while up to 2 x @magazine_size blocks per thread are still free.
+ *
+ * A thread's caches are handed back to their pools when the thread exits, and
+ * free_mpool() throws away the caches of every thread.
+ */
+mpool_error mpool_thread_cache_enable (struct mpool* pool, int32_t magazine_size);
+
+/**
+ * mpool_thread_cache_flush() - Give the calling thread's cached blocks back
+ * @pool: Pool structure that has been init with init_mpool()
+ *
+ * Returns: MPOOL_SUCCESS if everything worked, else the corresponding error
+ * code.
+ *
+ * This is useful for a thread that is about to go idle for a while, so its 
+ * cached blocks may be used by other threads. Does nothing if thread caches 
+ * aren't enabled on @pool.
+ */
+mpool_error mpool_thread_cache_flush (struct mpool* pool);
+
+/**
+ * mpool_set_owner() - Make the calling thread the owner of the pool
+ * @pool: Pool that has been init with init_mpool()
+ *
+ * Returns: MPOOL_SUCCESS, or MPOOL_FAILURE if the pool already has an owner,
+ * has thread caches (see mpool_thread_cache_enable()) or there is no 
+ * multithreading support.
+ *
+ * This is for pools that one thread allocates from and other threads free 
+ * into, like a producer handing objects down a pipeline. The owner keeps its
+ * own list of free blocks that it uses without any locking. A block freed by 
+ * any other thread is pushed onto a lock-free queue instead of the pool's 
+ * free list, and the owner picks up the whole queue at once the next time it
+ * runs out of blocks, so the two threads never fight over the same lock. 
+ * Other threads may still allocate, from the pool's free list as usual.
+ *
+ * It should be called before the pool is shared with other threads. Like the
+ * thread caches, blocks held by the owner aren't marked free for safe mode 
+ * if it is turned on later.
+ */
+mpool_error mpool_set_owner (struct mpool* pool);
+
+/**
+ * mpool_epoch_enter() - Start a read-side critical section on the pool
+ * @pool: Pool whose blocks are about to be read
+ *
+ * Returns: MPOOL_SUCCESS, else the corresponding error code
+ *
+ * Blocks given to mpool_retire() aren't reused until every thread that was
+ * inside a critical section at the time has left it with mpool_epoch_exit().
+ * So readers walking blocks without a lock (ie the nodes of a lock-free list)
+ * may keep using any block they reached inside the section, even if a writer 
+ * unlinks and retires it meanwhile. Sections may be nested, and should be 
+ * short: a thread sitting in one holds back every retired block of the pool.
+ *
+ * A thread is registered with the pool the first time it calls this (or 
+ * mpool_retire()), and unregistered when it exits. Entering is then a store 
+ * and a fence, leaving a store.
+ */
+mpool_error mpool_epoch_enter (struct mpool* pool);
+
+/**
+ * mpool_epoch_exit() - End a critical section started by mpool_epoch_enter()
+ * @pool: Same pool as given to mpool_epoch_enter()
+ *
+ * Returns: MPOOL_SUCCESS, or MPOOL_FAILURE if the thread isn't inside one
+ */
+mpool_error mpool_epoch_exit (struct mpool* pool);
+
+/**
+ * mpool_retire() - Give a block back once no reader can still see it
+ * @pool: Pool the block came from
+ * @item: Block that is no longer reachable by new readers
+ *
+ * Returns: MPOOL_SUCCESS, else the same codes as mpool_dealloc()
+ *
+ * Use this instead of mpool_dealloc() for blocks that lock-free readers may 
+ * be looking at, see mpool_epoch_enter(). The block is checked like 
+ * mpool_dealloc() would (ie for double frees in safe mode), then kept on a 
+ * list of the calling thread's. Every 64 blocks retired the thread tries to 
+ * advance the pool's epoch, which only happens if every thread in a critical
+ * section has seen the current one, and the blocks retired two epochs ago are
+ * given back to the pool in one go.
+ *
+ * Blocks retired by a thread that exits are held by the pool until they are
+ * safe. Without multithreading support this is just mpool_dealloc().
+ */
+mpool_error mpool_retire (struct mpool* pool, void* item);
+
+/**
+ * mpool_epoch_reclaim() - Give back the retired blocks that are safe now
+ * @pool: Pool to reclaim for
+ *
+ * Returns: MPOOL_SUCCESS, else the corresponding error code
+ *
+ * mpool_retire() only tries to advance the epoch in batches. This tries right
+ * away, for when a thread is done retiring for now, and hands back what the 
+ * calling thread retired (and what exited threads did) that no reader still
+ * in a critical section can see.
+ */
+mpool_error mpool_epoch_reclaim (struct mpool* pool);
+
+/**
+ * init_mpool_set() - Initialize a set of pools for variable sized allocations
+ * @sizes: Block size of each size class, in increasing order. May be NULL for
+ * the powers of two from 16 up to 4096.
+ * @count: Amount of @sizes, ignored if @sizes is NULL
+ * @capacity: Initial capacity of each class
+ * @attr: Settings used for every class, see init_mpool_attr(). May be NULL.
+ * @set: Pointer to where the struct mpool_set* should be initialized
+ *
+ * Returns: MPOOL_SUCCESS if the set is ready to use, MPOOL_ERR_INVALID_ARG if
+ * @sizes isn't strictly increasing, else the corresponding error code.
+ *
+ * Each size class is a normal struct mpool, so a request is rounded up only 
+ * as far as the next class instead of to one large block size. Giving the 
+ * classes a growth policy in @attr is recommended, as otherwise each class 
+ * runs empty on its own after @capacity allocations.
+ */
+mpool_error init_mpool_set (const size_t* sizes, int count, int32_t capacity, 
+		const struct mpool_attr* attr, struct mpool_set** set);
+
+/**
+ * mpool_set_alloc() - Get a block of at least @size bytes from the set
+ * @set: Set that has been init with init_mpool_set()
+ * @size: Amount of bytes needed
+ * @error: The resulting error code from function will be placed here
+ *
+ * Returns: Pointer to the block, or NULL with *@error set. A @size larger than
+ * the largest class gives MPOOL_ERR_INVALID_ARG.
+ */
+void* mpool_set_alloc (struct mpool_set* set, size_t size, mpool_error* error);
+
+/**
+ * mpool_set_dealloc() - Give a block back to the set
+ * @set: Set the block came from
+ * @item: Block to give back
+ *
+ * Returns: MPOOL_SUCCESS, MPOOL_ERR_INVALID_ADDRESS if @item isn't inside any
+ * class of the set, or whatever mpool_dealloc() returns for its class.
+ *
+ * No size is needed, the class is found from the address of @item by looking
+ * it up in the blobs of each class, O(classes x log blobs).
+ */
+mpool_error mpool_set_dealloc (struct mpool_set* set, void* item);
+
+/**
+ * mpool_set_class() - Get the pool that serves a size
+ * @set: Set to look in
+ * @size: Amount of bytes
+ *
+ * Returns: The pool of the smallest class holding @size bytes, or NULL if 
+ * @size is larger than every class. The pool can be used with any of the 
+ * mpool_* functions (ie to enable thread caches), but must not be free'd.
+ */
+struct mpool* mpool_set_class (struct mpool_set* set, size_t size);
+
+/**
+ * free_mpool_set() - Free the set and all of its pools
+ * @set: Set to free
+ */
+mpool_error free_mpool_set (struct mpool_set* set);
+
 /**
  * set_safe_mode() - Turn safe mode on at a loss of performance.
  *
@@ -235,7 +1041,20 @@ mpool_error free_mpool (struct mpool* pool);
  * 	  back memory that the pool can't garuntee will still be valid. However, 
  * 	  once you add it back to the pool, the pool will then hand this memory 
  * 	  back out. When safe mode is on, you can garuntee that mpool_alloc() will
- * 	  _always_ return a valid address from the pool.
+ * 	  _always_ return a valid address from the pool. These addresses get 
+ * 	  MPOOL_ERR_INVALID_ADDRESS.
+ *
+ * 	- Check that memory handed back isn't already free, which would put the 
+ * 	  same block on the free list twice. These get MPOOL_ERR_DOUBLE_FREE.
+ *
+ * 	Both checks are a lookup in the pool's table of blobs plus one bit in a 
+ * 	per-blob bitmap, so they cost O(log blobs) no matter how large the pool
+ * 	is.
+ *
+ * 	Safe mode is best turned on before the pool is handed to other threads,
+ * 	either with this function or MPOOL_SAFE_MODE (see init_mpool_attr()). If it
+ * 	is turned on after blocks have been handed out, blocks that were sitting 
+ * 	in a thread cache at the time won't be caught on their first double free.
  *
  */
 mpool_error set_safe_mode(struct mpool* pool);
@@ -261,3 +1080,9 @@ int32_t get_safe_mode(struct mpool* pool);
  * doing anything.
  */
 void print_mpool_error(FILE* fh, char* message, mpool_error err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * mpool.hpp --- Typed C++ wrappers around the fixed size memory pool
+ *
+ * Copyright (c) 2017 William Hazell
+ *
+ * Author: William Hazell
+ * Date: 05/2017
+ * Contact: liam.hazell@gmail.com
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef MPOOL_HPP
+#define MPOOL_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "mpool.h"
+
+namespace mp {
+
+/**
+ * class error - Thrown when one of the mpool_* functions fails
+ *
+ * Running out of memory (MPOOL_ERR_ALLOC or MPOOL_EMPTY_POOL) throws
+ * std::bad_alloc instead, like operator new does.
+ */
+class error : public std::runtime_error {
+public:
+	explicit error (mpool_error code)
+		: std::runtime_error("mpool error " + std::to_string(code)), code_(code) {}
+
+	mpool_error code () const noexcept { return code_; }
+
+private:
+	mpool_error code_;
+};
+
+/**
+ * check() - Turn an mpool_error into an exception
+ * @err: Error code returned by one of the mpool_* functions
+ */
+inline void check (mpool_error err)
+{
+	if (err == MPOOL_SUCCESS)
+		return;
+	if (err == MPOOL_ERR_ALLOC || err == MPOOL_EMPTY_POOL)
+		throw std::bad_alloc();
+	throw error(err);
+}
+
+
+/**
+ * class pool - Pool of objects of type T
+ *
+ * The block size and alignment come from sizeof(T) and alignof(T), so any
+ * alignment asked for in the attr is only ever raised. The pool is free'd
+ * with free_mpool() when this goes out of scope, whatever objects are left in
+ * it are not destroyed.
+ *
+ * mp::pool<item> items(1000);
+ * item* it = items.construct(1, "one");
+ * items.destroy(it);
+ */
+template <typename T>
+class pool {
+public:
+	explicit pool (int32_t capacity, const mpool_attr* attr = nullptr)
+	{
+		mpool_attr a = attr ? *attr : mpool_attr();
+		if (a.alignment < alignof(T))
+			a.alignment = alignof(T);
+		check(init_mpool_attr(sizeof(T), capacity, &a, &pool_));
+	}
+
+	~pool () { free_mpool(pool_); }
+
+	pool (const pool&) = delete;
+	pool& operator= (const pool&) = delete;
+
+	pool (pool&& other) noexcept : pool_(other.pool_) { other.pool_ = nullptr; }
+
+	pool& operator= (pool&& other) noexcept
+	{
+		std::swap(pool_, other.pool_);
+		return *this;
+	}
+
+	/* Memory for one T, nothing is constructed in it */
+	T* allocate ()
+	{
+		mpool_error err;
+		void* p = mpool_alloc(pool_, &err);
+		check(err);
+		return static_cast<T*>(p);
+	}
+
+	void deallocate (T* p) { check(mpool_dealloc(p, pool_)); }
+
+	/* Take a block and construct a T in it with @args */
+	template <typename... Args>
+	T* construct (Args&&... args)
+	{
+		T* p = allocate();
+		try {
+			return ::new (static_cast<void*>(p)) T(std::forward<Args>(args)...);
+		} catch (...) {
+			mpool_dealloc(p, pool_);
+			throw;
+		}
+	}
+
+	/* Destroy an object made by construct() and give its block back */
+	void destroy (T* p)
+	{
+		if (p == nullptr)
+			return;
+		p->~T();
+		deallocate(p);
+	}
+
+	int32_t capacity () const { return mpool_capacity(pool_); }
+
+	/* The underlying pool, for the rest of the mpool_* functions */
+	struct mpool* get () const noexcept { return pool_; }
+
+private:
+	struct mpool* pool_ = nullptr;
+};
+
+
+/**
+ * class fixed_pool - Pool of at most N objects of type T, stored inline
+ *
+ * Everything is known at compile time, so there is no struct mpool, no heap 
+ * memory and no error codes: the blocks are an array inside the object, and
+ * the free ones are a stack of indices (uint16_t when N fits, else uint32_t).
+ * allocate() and deallocate() are a few instructions each and inline fully.
+ *
+ * This is for small pools with one user, ie one per connection. There is no
+ * locking, growth or safe mode, and objects still in the pool when it goes 
+ * out of scope aren't destroyed.
+ *
+ * mp::fixed_pool<request, 64> requests;
+ * request* r = requests.construct();
+ */
+template <typename T, std::size_t N>
+class fixed_pool {
+	static_assert(N > 0 && N <= UINT32_MAX, "fixed_pool needs 1 to 2^32-1 blocks");
+
+public:
+	using index_type = typename std::conditional<N <= UINT16_MAX, uint16_t, 
+		uint32_t>::type;
+
+	static constexpr std::size_t capacity = N;
+
+	/* The first allocations come from the start of the storage */
+	fixed_pool () noexcept : top_(N)
+	{
+		for (std::size_t i = 0; i < N; i++)
+			free_[i] = static_cast<index_type>(N - 1 - i);
+	}
+
+	fixed_pool (const fixed_pool&) = delete;
+	fixed_pool& operator= (const fixed_pool&) = delete;
+
+	/* Memory for one T, or NULL if all N are in use */
+	T* allocate () noexcept
+	{
+		if (top_ == 0)
+			return nullptr;
+		return reinterpret_cast<T*>(&storage_[free_[--top_]]);
+	}
+
+	/* @p must have come from allocate() of this pool and not be free */
+	void deallocate (T* p) noexcept
+	{
+		free_[top_++] = static_cast<index_type>(reinterpret_cast<_slot*>(p) - 
+			storage_.data());
+	}
+
+	/* Take a block and construct a T in it, throws std::bad_alloc if full */
+	template <typename... Args>
+	T* construct (Args&&... args)
+	{
+		T* p = allocate();
+		if (p == nullptr)
+			throw std::bad_alloc();
+		try {
+			return ::new (static_cast<void*>(p)) T(std::forward<Args>(args)...);
+		} catch (...) {
+			deallocate(p);
+			throw;
+		}
+	}
+
+	void destroy (T* p) noexcept
+	{
+		if (p == nullptr)
+			return;
+		p->~T();
+		deallocate(p);
+	}
+
+	/* Whether @p points into the storage of this pool */
+	bool contains (const T* p) const noexcept
+	{
+		const _slot* s = reinterpret_cast<const _slot*>(p);
+		return s >= storage_.data() && s < storage_.data() + N;
+	}
+
+	std::size_t available () const noexcept { return top_; }
+
+private:
+	struct _slot {
+		alignas(T) unsigned char bytes[sizeof(T)];
+	};
+
+	std::array<_slot, N> storage_;
+	std::array<index_type, N> free_;
+	index_type top_;
+};
+
+
+/**
+ * class allocator - Standard allocator taking single objects from a set
+ *
+ * Node based containers (std::list, std::map, std::unordered_map and so on)
+ * allocate one node at a time, and those come from the class of a
+ * struct mpool_set that fits the node. Arrays (ie the buckets of an
+ * std::unordered_map) and objects too large for every class go to operator
+ * new instead.
+ *
+ * An allocator makes its own set, which is shared by every copy of it and
+ * every allocator rebound from it, and free'd once the last of those is gone.
+ * So each container gets a set of its own unless they are given copies of
+ * the same allocator:
+ *
+ * mp::allocator<int> alloc;
+ * std::list<int, mp::allocator<int>> a(alloc), b(alloc);
+ */
+template <typename T>
+class allocator {
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	allocator () : allocator(64) {}
+
+	/**
+	 * @capacity: Initial capacity of each size class
+	 * @attr: Settings for every class, see init_mpool_set(). NULL gives the
+	 * classes a growth factor of 2 so they never run empty.
+	 */
+	explicit allocator (int32_t capacity, const mpool_attr* attr = nullptr)
+	{
+		mpool_attr a = attr ? *attr : mpool_attr();
+		if (attr == nullptr)
+			a.growth_factor = 2.0;
+		if (a.alignment < alignof(std::max_align_t))
+			a.alignment = alignof(std::max_align_t);
+
+		struct mpool_set* set = nullptr;
+		check(init_mpool_set(nullptr, 0, capacity, &a, &set));
+		set_ = std::shared_ptr<struct mpool_set>(set, free_mpool_set);
+		alignment_ = a.alignment;
+		pool_ = _class_for(set_.get(), alignment_);
+	}
+
+	template <typename U>
+	allocator (const allocator<U>& other) noexcept
+		: set_(other.set_), alignment_(other.alignment_),
+		pool_(_class_for(set_.get(), alignment_)) {}
+
+	T* allocate (std::size_t n)
+	{
+		if (n != 1 || pool_ == nullptr)
+			return static_cast<T*>(_new(n * sizeof(T)));
+
+		mpool_error err;
+		void* p = mpool_alloc(pool_, &err);
+		check(err);
+		return static_cast<T*>(p);
+	}
+
+	void deallocate (T* p, std::size_t n) noexcept
+	{
+		if (n != 1 || pool_ == nullptr)
+			_delete(p);
+		else
+			mpool_dealloc(p, pool_);
+	}
+
+	/* The set the blocks come from */
+	struct mpool_set* set () const noexcept { return set_.get(); }
+
+	template <typename U>
+	bool operator== (const allocator<U>& other) const noexcept
+	{
+		return set_ == other.set_;
+	}
+
+	template <typename U>
+	bool operator!= (const allocator<U>& other) const noexcept
+	{
+		return set_ != other.set_;
+	}
+
+private:
+	template <typename U> friend class allocator;
+
+	/* The class T's come from, or NULL if they go to operator new */
+	static struct mpool* _class_for (struct mpool_set* set, std::size_t alignment)
+	{
+		if (alignof(T) > alignment)
+			return nullptr;
+		return mpool_set_class(set, sizeof(T));
+	}
+
+	static void* _new (std::size_t size)
+	{
+#ifdef __cpp_aligned_new
+		if (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			return ::operator new(size, std::align_val_t(alignof(T)));
+#endif
+		return ::operator new(size);
+	}
+
+	static void _delete (T* p) noexcept
+	{
+#ifdef __cpp_aligned_new
+		if (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			return ::operator delete(p, std::align_val_t(alignof(T)));
+#endif
+		::operator delete(p);
+	}
+
+	std::shared_ptr<struct mpool_set> set_;
+	std::size_t alignment_;
+	struct mpool* pool_;
+};
+
+} /* namespace mp */
+
+#endif
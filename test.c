@@ -1,6 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include "mpool.h"
 
 
@@ -15,6 +22,1280 @@ void init_struct (struct test_struct* ts, int v)
 	ts->field2 = v;
 }
 
+/* Alloc and dealloc through a thread cache, then exit so the cache is flushed */
+void* cache_worker (void* arg) 
+{
+	struct mpool* pool = arg;
+	void* items[16];
+	mpool_error err;
+
+	for (int i = 0; i < 16; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+	}
+	for (int i = 0; i < 16; i++) 
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+	return NULL;
+}
+
+void test_thread_cache (void) 
+{
+	struct mpool* pool = NULL;
+	void* items[64];
+	pthread_t threads[2];
+	mpool_error err;
+
+	assert(init_mpool(sizeof(struct test_struct), 64, &pool) == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_enable(pool, 8) == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_enable(pool, 8) == MPOOL_FAILURE);
+
+	for (int i = 0; i < 2; i++)
+		pthread_create(&threads[i], NULL, cache_worker, pool);
+	for (int i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Everything the workers cached must be back in the pool */
+	for (int i = 0; i < 64; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+		for (int j = 0; j < i; j++)
+			assert(items[i] != items[j]);
+	}
+	mpool_alloc(pool, &err);
+	assert(err == MPOOL_EMPTY_POOL);
+
+	for (int i = 0; i < 64; i++) 
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_flush(pool) == MPOOL_SUCCESS);
+	free_mpool(pool);
+}
+
+/* Hammer a small pool, every block is stamped with its owner while held */
+void* lock_free_worker (void* arg) 
+{
+	struct mpool* pool = arg;
+	long self = (long)(size_t) pthread_self();
+	mpool_error err;
+
+	for (int i = 0; i < 100000; i++) {
+		long* held[4];
+		for (int j = 0; j < 4; j++) {
+			held[j] = mpool_alloc(pool, &err);
+			assert(err == MPOOL_SUCCESS);
+			*held[j] = self;
+		}
+		for (int j = 0; j < 4; j++) {
+			assert(*held[j] == self);
+			assert(mpool_dealloc(held[j], pool) == MPOOL_SUCCESS);
+		}
+	}
+	return NULL;
+}
+
+void test_lock_free (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	pthread_t threads[4];
+	mpool_error err;
+
+	attr.flags = MPOOL_LOCK_FREE;
+	assert(init_mpool_attr(sizeof(long), 16, &attr, &pool) == MPOOL_SUCCESS);
+
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, lock_free_worker, pool);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Addresses that aren't blocks can't get onto the stack */
+	void* item = mpool_alloc(pool, &err);
+	assert(err == MPOOL_SUCCESS);
+	assert(mpool_dealloc((char*) item + 1, pool) == MPOOL_ERR_INVALID_ADDRESS);
+	assert(mpool_dealloc(item, pool) == MPOOL_SUCCESS);
+
+	attr.flags = ~0u;
+	assert(init_mpool_attr(sizeof(long), 16, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+	free_mpool(pool);
+}
+
+void test_bulk (void) 
+{
+	struct mpool* pool = NULL;
+	void* items[40];
+	mpool_error err;
+
+	assert(init_mpool(sizeof(struct test_struct), 32, &pool) == MPOOL_SUCCESS);
+
+	assert(mpool_alloc_bulk(pool, items, 20, &err) == 20);
+	assert(err == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items + 20, 20, &err) == 12);
+	assert(err == MPOOL_EMPTY_POOL);
+	for (int i = 0; i < 32; i++) 
+		for (int j = 0; j < i; j++)
+			assert(items[i] != items[j]);
+
+	assert(mpool_dealloc_bulk(pool, items, 32) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 32, &err) == 32);
+
+	/* One bad address means nothing goes back */
+	set_safe_mode(pool);
+	void* bad[2] = { items[0], (void*) 10000 };
+	assert(mpool_dealloc_bulk(pool, bad, 2) == MPOOL_ERR_INVALID_ADDRESS);
+	void* twice[2] = { items[0], items[0] };
+	assert(mpool_dealloc_bulk(pool, twice, 2) == MPOOL_ERR_DOUBLE_FREE);
+	assert(mpool_dealloc_bulk(pool, items, 32) == MPOOL_SUCCESS);
+	free_mpool(pool);
+
+	/* Safe from the start, every block begins free */
+	struct mpool_attr attr = { 0 };
+	attr.flags = MPOOL_SAFE_MODE;
+	assert(init_mpool_attr(sizeof(struct test_struct), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(get_safe_mode(pool) == 1);
+	assert(mpool_dealloc(mpool_alloc(pool, &err), pool) == MPOOL_SUCCESS);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_ERR_INVALID_ADDRESS);
+	items[0] = mpool_alloc(pool, &err);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_SUCCESS);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_ERR_DOUBLE_FREE);
+	free_mpool(pool);
+}
+
+/* Allocate past the starting capacity, then give it all back */
+void* grow_worker (void* arg) 
+{
+	struct mpool* pool = arg;
+	void* items[500];
+	mpool_error err;
+
+	for (int i = 0; i < 500; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+	}
+	for (int i = 0; i < 500; i++) 
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+	return NULL;
+}
+
+void test_growth (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	pthread_t threads[4];
+	void* items[40];
+	mpool_error err;
+
+	attr.growth_factor = 2.0;
+	attr.max_capacity = 40;
+	assert(init_mpool_attr(sizeof(struct test_struct), 10, &attr, &pool) == MPOOL_SUCCESS);
+
+	for (int i = 0; i < 40; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+	}
+	assert(mpool_capacity(pool) == 40);
+	mpool_alloc(pool, &err);
+	assert(err == MPOOL_EMPTY_POOL);
+	assert(mpool_dealloc_bulk(pool, items, 40) == MPOOL_SUCCESS);
+	free_mpool(pool);
+
+	/* Many threads growing a safe mode pool at once */
+	attr.flags = MPOOL_SAFE_MODE;
+	attr.max_capacity = 0;
+	attr.min_grow = 64;
+	assert(init_mpool_attr(sizeof(struct test_struct), 1, &attr, &pool) == MPOOL_SUCCESS);
+	for (int i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, grow_worker, pool);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	/* At most 2000 blocks are out at once, so it only ever grows to 2080 */
+	assert(mpool_capacity(pool) >= 500 && mpool_capacity(pool) <= 2080);
+	free_mpool(pool);
+
+	attr.growth_factor = 0.5;
+	assert(init_mpool_attr(sizeof(struct test_struct), 1, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+}
+
+void test_lazy (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	void* items[1000];
+	mpool_error err;
+
+	attr.flags = MPOOL_LAZY | MPOOL_SAFE_MODE;
+	assert(init_mpool_attr(sizeof(struct test_struct), 1000, &attr, &pool) == MPOOL_SUCCESS);
+
+	/* Blocks are carved in address order, and never past the high-water mark */
+	items[0] = mpool_alloc(pool, &err);
+	assert(err == MPOOL_SUCCESS);
+	assert(mpool_dealloc((char*) items[0] + mpool_stride(pool), pool) == MPOOL_ERR_INVALID_ADDRESS);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_SUCCESS);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_ERR_DOUBLE_FREE);
+	assert(mpool_alloc(pool, &err) == items[0]);
+
+	for (int i = 1; i < 1000; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS && items[i] != items[i - 1]);
+	}
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(mpool_dealloc_bulk(pool, items, 1000) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 1000, &err) == 1000);
+
+	/* New blobs are carved too */
+	assert(mpool_realloc(1500, pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 1000, &err) == 500 && err == MPOOL_EMPTY_POOL);
+	free_mpool(pool);
+
+	/* Thread caches carve too */
+	attr.flags = MPOOL_LAZY;
+	assert(init_mpool_attr(sizeof(struct test_struct), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_enable(pool, 0) == MPOOL_SUCCESS);
+	assert(mpool_alloc(pool, &err) != NULL && err == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_flush(pool) == MPOOL_SUCCESS);
+	free_mpool(pool);
+
+	attr.flags = MPOOL_LAZY | MPOOL_LOCK_FREE;
+	attr.min_grow = 100;
+	assert(init_mpool_attr(sizeof(struct test_struct), 0, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 1000, &err) == 1000);
+	assert(mpool_capacity(pool) == 1000);
+	free_mpool(pool);
+}
+
+/* Allocates every block of @pool once, then gives them all back */
+void check_partition (struct mpool* pool) 
+{
+	int32_t capacity = mpool_capacity(pool);
+	void** items = malloc(sizeof(void*) * (size_t) capacity);
+	mpool_error err;
+
+	assert(items != NULL);
+	assert(mpool_alloc_bulk(pool, items, capacity, &err) == capacity);
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	/* Safe mode fails this if a block was handed out twice */
+	assert(mpool_dealloc_bulk(pool, items, capacity) == MPOOL_SUCCESS);
+	free(items);
+}
+
+void test_parallel_init (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	int32_t capacity = 300000; /* Over 16MB of 64 byte blocks */
+
+	attr.init_threads = 257;
+	assert(init_mpool_attr(64, capacity, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+
+	attr.flags = MPOOL_SAFE_MODE;
+	attr.init_threads = 3;
+	attr.nshards = 2;
+	assert(init_mpool_attr(64, capacity, &attr, &pool) == MPOOL_SUCCESS);
+	check_partition(pool);
+	assert(mpool_realloc(capacity * 2, pool) == MPOOL_SUCCESS);
+	check_partition(pool);
+	free_mpool(pool);
+
+	/* First touch needs shards to spread over, and no node of its own */
+	attr.flags = MPOOL_SAFE_MODE | MPOOL_FIRST_TOUCH;
+	attr.nshards = 1;
+	assert(init_mpool_attr(64, capacity, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+	attr.nshards = 4;
+	attr.flags |= MPOOL_NUMA_BIND;
+	assert(init_mpool_attr(64, capacity, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+	attr.flags &= ~MPOOL_NUMA_BIND;
+	assert(init_mpool_attr(64, capacity, &attr, &pool) == MPOOL_SUCCESS);
+	check_partition(pool);
+	free_mpool(pool);
+
+	/* Lazy pools are only prefaulted */
+	attr.flags = MPOOL_SAFE_MODE | MPOOL_LAZY | MPOOL_PREFAULT;
+	attr.init_threads = 4;
+	assert(init_mpool_attr(64, capacity, &attr, &pool) == MPOOL_SUCCESS);
+	check_partition(pool);
+	free_mpool(pool);
+}
+
+struct grow_traffic {
+	struct mpool* pool;
+	_Atomic int done;
+};
+
+/* Allocs and frees in safe mode until the pool is done growing */
+void* grow_traffic_worker (void* arg) 
+{
+	struct grow_traffic* traffic = arg;
+	void* held[8] = { NULL };
+	mpool_error err;
+
+	for (int i = 0; !atomic_load(&traffic->done) || i < 1000; i++) {
+		void** slot = &held[i % 8];
+		if (*slot != NULL)
+			assert(mpool_dealloc(*slot, traffic->pool) == MPOOL_SUCCESS);
+		*slot = mpool_alloc(traffic->pool, &err);
+		assert(*slot != NULL || err == MPOOL_EMPTY_POOL);
+		if (*slot != NULL)
+			memset(*slot, 0, sizeof(struct test_struct));
+	}
+	for (int i = 0; i < 8; i++)
+		if (held[i] != NULL)
+			assert(mpool_dealloc(held[i], traffic->pool) == MPOOL_SUCCESS);
+	return NULL;
+}
+
+void test_concurrent_realloc (void) 
+{
+	const uint32_t flags[] = { MPOOL_SAFE_MODE, MPOOL_SAFE_MODE | MPOOL_LOCK_FREE };
+
+	for (int f = 0; f < 2; f++) {
+		struct mpool_attr attr = { 0 };
+		struct grow_traffic traffic = { NULL, 0 };
+		pthread_t threads[4];
+
+		attr.flags = flags[f];
+		attr.nshards = 2;
+		assert(init_mpool_attr(sizeof(struct test_struct), 16, &attr, 
+			&traffic.pool) == MPOOL_SUCCESS);
+		for (int i = 0; i < 4; i++)
+			assert(pthread_create(&threads[i], NULL, grow_traffic_worker, &traffic) == 0);
+
+		/* The blob table is swapped under the workers' feet each time */
+		for (int i = 0; i < 200; i++)
+			assert(mpool_realloc(mpool_capacity(traffic.pool) + 16, traffic.pool) 
+				== MPOOL_SUCCESS);
+		atomic_store(&traffic.done, 1);
+		for (int i = 0; i < 4; i++)
+			pthread_join(threads[i], NULL);
+
+		assert(mpool_capacity(traffic.pool) == 16 * 201);
+		check_partition(traffic.pool);
+		free_mpool(traffic.pool);
+	}
+}
+
+void test_set (void) 
+{
+	struct mpool_set* set = NULL;
+	struct mpool_attr attr = { 0 };
+	const size_t sizes[] = { 8, 24, 100 };
+	void* items[3];
+	mpool_error err;
+
+	attr.flags = MPOOL_SAFE_MODE;
+	assert(init_mpool_set(sizes, 3, 2, &attr, &set) == MPOOL_SUCCESS);
+#ifndef MPOOL_DEBUG
+	assert(mpool_stride(mpool_set_class(set, 9)) == 24);
+#endif
+	assert(mpool_set_class(set, 101) == NULL);
+
+	items[0] = mpool_set_alloc(set, 1, &err);
+	items[1] = mpool_set_alloc(set, 24, &err);
+	items[2] = mpool_set_alloc(set, 99, &err);
+	assert(err == MPOOL_SUCCESS);
+	assert(mpool_set_alloc(set, 101, &err) == NULL && err == MPOOL_ERR_INVALID_ARG);
+
+	/* Each block goes back to its own class */
+	for (int i = 0; i < 3; i++)
+		assert(mpool_set_dealloc(set, items[i]) == MPOOL_SUCCESS);
+	assert(mpool_set_dealloc(set, items[1]) == MPOOL_ERR_DOUBLE_FREE);
+	assert(mpool_set_dealloc(set, &err) == MPOOL_ERR_INVALID_ADDRESS);
+	assert(mpool_set_alloc(set, 20, &err) == items[1]);
+	free_mpool_set(set);
+
+	assert(init_mpool_set(NULL, 0, 10, NULL, &set) == MPOOL_SUCCESS);
+#ifndef MPOOL_DEBUG
+	assert(mpool_stride(mpool_set_class(set, 4096)) == 4096);
+#endif
+	free_mpool_set(set);
+
+	const size_t bad[] = { 32, 16 };
+	assert(init_mpool_set(bad, 2, 10, NULL, &set) == MPOOL_ERR_INVALID_ARG);
+}
+
+void test_stats (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_stats stats;
+	void* items[10];
+	mpool_error err;
+
+	assert(init_mpool(sizeof(struct test_struct), 10, &pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 10, &err) == 10);
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(mpool_dealloc_bulk(pool, items, 4) == MPOOL_SUCCESS);
+	assert(mpool_dealloc(items[9], pool) == MPOOL_SUCCESS);
+	assert(mpool_realloc(20, pool) == MPOOL_SUCCESS);
+
+	assert(mpool_get_stats(pool, &stats) == MPOOL_SUCCESS);
+	assert(stats.capacity == 20);
+	assert(stats.in_use == 5 && stats.peak_in_use == 10);
+	assert(stats.allocs == 10 && stats.frees == 5);
+	assert(stats.empty_failures == 1 && stats.grows == 1);
+	assert(stats.bytes_reserved == 20 * mpool_stride(pool));
+
+	/* A spike that never empties the pool is still the peak */
+	assert(mpool_alloc_bulk(pool, items, 10, &err) == 10);
+	assert(mpool_dealloc_bulk(pool, items, 10) == MPOOL_SUCCESS);
+	assert(mpool_get_stats(pool, &stats) == MPOOL_SUCCESS);
+	assert(stats.in_use == 5 && stats.peak_in_use == 15);
+	assert(stats.bytes_used == 5 * sizeof(struct test_struct));
+	assert(mpool_get_stats(pool, NULL) == MPOOL_ERR_NULL_ARG);
+	free_mpool(pool);
+}
+
+struct hook_counts {
+	int allocs, frees, grows, empty;
+	int32_t capacity;
+	void* last;
+};
+
+void count_alloc (struct mpool* pool, void* block, void* arg) 
+{
+	(void) pool;
+	((struct hook_counts*) arg)->allocs++;
+	((struct hook_counts*) arg)->last = block;
+}
+
+void count_free (struct mpool* pool, void* block, void* arg) 
+{
+	(void) pool;
+	((struct hook_counts*) arg)->frees++;
+	((struct hook_counts*) arg)->last = block;
+}
+
+void count_grow (struct mpool* pool, int32_t old_capacity, int32_t new_capacity, 
+		void* arg) 
+{
+	assert(new_capacity > old_capacity && mpool_capacity(pool) == new_capacity);
+	((struct hook_counts*) arg)->grows++;
+	((struct hook_counts*) arg)->capacity = new_capacity;
+}
+
+void count_empty (struct mpool* pool, int32_t capacity, void* arg) 
+{
+	(void) pool;
+	((struct hook_counts*) arg)->empty++;
+	((struct hook_counts*) arg)->capacity = capacity;
+}
+
+void* contend_worker (void* arg) 
+{
+	mpool_error err;
+	for (int i = 0; i < 20000; i++) {
+		void* item = mpool_alloc(arg, &err);
+		assert(item != NULL);
+		assert(mpool_dealloc(item, arg) == MPOOL_SUCCESS);
+	}
+	return NULL;
+}
+
+void test_hooks (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_hooks hooks = { count_alloc, count_free, count_grow, count_empty, NULL };
+	struct hook_counts counts = { 0 };
+	struct mpool_stats stats;
+	void* items[10];
+	mpool_error err;
+
+	hooks.arg = &counts;
+	assert(init_mpool(sizeof(struct test_struct), 5, &pool) == MPOOL_SUCCESS);
+	assert(mpool_set_hooks(NULL, &hooks) == MPOOL_ERR_NULL_ARG);
+	assert(mpool_set_hooks(pool, &hooks) == MPOOL_SUCCESS);
+
+	assert(mpool_alloc_bulk(pool, items, 4, &err) == 4);
+	assert((items[4] = mpool_alloc(pool, &err)) != NULL && counts.last == items[4]);
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(counts.allocs == 5 && counts.empty == 1 && counts.capacity == 5);
+
+	assert(mpool_realloc(10, pool) == MPOOL_SUCCESS);
+	assert(counts.grows == 1 && counts.capacity == 10);
+	assert(mpool_dealloc(items[4], pool) == MPOOL_SUCCESS && counts.last == items[4]);
+	assert(mpool_dealloc_bulk(pool, items, 4) == MPOOL_SUCCESS);
+	assert(counts.frees == 5);
+
+	/* Failed frees aren't seen */
+	assert(mpool_dealloc(NULL, pool) == MPOOL_ERR_NULL_ARG);
+	assert(mpool_set_hooks(pool, NULL) == MPOOL_SUCCESS);
+	assert((items[0] = mpool_alloc(pool, &err)) != NULL);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_SUCCESS);
+	assert(counts.allocs == 5 && counts.frees == 5);
+	free_mpool(pool);
+
+	/* Every contended lock lands in exactly one bucket of the histogram */
+	pthread_t threads[4];
+	uint64_t waits = 0;
+	assert(init_mpool(sizeof(struct test_struct), 64, &pool) == MPOOL_SUCCESS);
+	for (int i = 0; i < 4; i++)
+		assert(pthread_create(&threads[i], NULL, contend_worker, pool) == 0);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	uint64_t buckets[MPOOL_LOCK_WAIT_BUCKETS + 1];
+	buckets[MPOOL_LOCK_WAIT_BUCKETS] = 12345;
+	assert(mpool_get_stats(pool, &stats) == MPOOL_SUCCESS);
+	assert(mpool_get_lock_waits(pool, buckets, MPOOL_LOCK_WAIT_BUCKETS + 1) == MPOOL_SUCCESS);
+	for (int i = 0; i < MPOOL_LOCK_WAIT_BUCKETS; i++)
+		waits += buckets[i];
+	assert(waits == stats.lock_contended && buckets[MPOOL_LOCK_WAIT_BUCKETS] == 12345);
+	assert(mpool_get_lock_waits(pool, buckets, -1) == MPOOL_ERR_INVALID_ARG);
+	assert(mpool_get_lock_waits(pool, NULL, 1) == MPOOL_ERR_NULL_ARG);
+	free_mpool(pool);
+
+	/* Allocs and frees are counted per shard, the sums must still match up */
+	assert(init_mpool_sharded(sizeof(struct test_struct), 64, 4, &pool) == MPOOL_SUCCESS);
+	for (int i = 0; i < 4; i++)
+		assert(pthread_create(&threads[i], NULL, contend_worker, pool) == 0);
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	assert(mpool_get_stats(pool, &stats) == MPOOL_SUCCESS);
+	assert(stats.allocs == 4 * 20000 && stats.frees == 4 * 20000);
+	assert(stats.in_use == 0 && stats.peak_in_use <= 4);
+	free_mpool(pool);
+}
+
+void* remote_free_worker (void* arg) 
+{
+	void** items = arg;
+	for (int i = 0; i < 100; i++)
+		assert(mpool_dealloc(items[i], items[100]) == MPOOL_SUCCESS);
+	return NULL;
+}
+
+void test_owner (void) 
+{
+	struct mpool* pool = NULL;
+	void* items[101];
+	pthread_t thread;
+	mpool_error err;
+
+	assert(init_mpool(sizeof(struct test_struct), 100, &pool) == MPOOL_SUCCESS);
+	assert(mpool_set_owner(pool) == MPOOL_SUCCESS);
+	assert(mpool_set_owner(pool) == MPOOL_FAILURE);
+	assert(mpool_thread_cache_enable(pool, 0) == MPOOL_FAILURE);
+
+	for (int i = 0; i < 100; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+	}
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+
+	/* Blocks freed by another thread come back to the owner */
+	items[100] = pool;
+	pthread_create(&thread, NULL, remote_free_worker, items);
+	pthread_join(thread, NULL);
+	for (int i = 0; i < 100; i++) {
+		assert(mpool_alloc(pool, &err) != NULL);
+		assert(err == MPOOL_SUCCESS);
+	}
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	free_mpool(pool);
+}
+
+void test_sharded (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	pthread_t threads[4];
+	void* items[100];
+	mpool_error err;
+
+	/* Every shard is reachable from any thread */
+	assert(init_mpool_sharded(sizeof(struct test_struct), 100, 8, &pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 60, &err) == 60);
+	for (int i = 60; i < 100; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+	}
+	for (int i = 0; i < 100; i++) 
+		for (int j = 0; j < i; j++)
+			assert(items[i] != items[j]);
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(mpool_dealloc_bulk(pool, items, 100) == MPOOL_SUCCESS);
+	free_mpool(pool);
+
+	for (int lf = 0; lf < 2; lf++) {
+		attr.flags = lf ? MPOOL_LOCK_FREE : 0;
+		attr.nshards = 4;
+		assert(init_mpool_attr(sizeof(long), 16, &attr, &pool) == MPOOL_SUCCESS);
+		for (int i = 0; i < 4; i++)
+			pthread_create(&threads[i], NULL, lock_free_worker, pool);
+		for (int i = 0; i < 4; i++)
+			pthread_join(threads[i], NULL);
+		free_mpool(pool);
+	}
+
+	assert(init_mpool_sharded(sizeof(long), 16, -1, &pool) == MPOOL_ERR_INVALID_ARG);
+}
+
+void test_reset (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	void* items[200];
+	mpool_error err;
+
+	attr.flags = MPOOL_SAFE_MODE;
+	attr.nshards = 2;
+	assert(init_mpool_attr(sizeof(struct test_struct), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_enable(pool, 8) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 100, &err) == 100);
+	assert(mpool_realloc(200, pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items + 100, 20, &err) == 20);
+
+	/* Some blocks are left in the thread cache, they must not come back twice */
+	for (int i = 0; i < 10; i++)
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+
+	assert(mpool_reset(pool, 0) == MPOOL_SUCCESS);
+	assert(mpool_capacity(pool) == 200);
+	assert(mpool_dealloc(items[50], pool) == MPOOL_ERR_INVALID_ADDRESS);
+	for (int i = 0; i < 200; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+		for (int j = 0; j < i; j++)
+			assert(items[i] != items[j]);
+	}
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_SUCCESS);
+	assert(mpool_dealloc(items[0], pool) == MPOOL_ERR_DOUBLE_FREE);
+
+	assert(mpool_reset(pool, 1) == MPOOL_SUCCESS);
+	assert(mpool_capacity(pool) == 100);
+	assert(mpool_alloc_bulk(pool, items, 200, &err) == 100 && err == MPOOL_EMPTY_POOL);
+	free_mpool(pool);
+}
+
+void test_trim (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	void* items[400];
+	mpool_error err;
+
+	attr.flags = MPOOL_SAFE_MODE;
+	attr.nshards = 2;
+	assert(init_mpool_attr(sizeof(struct test_struct), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_enable(pool, 8) == MPOOL_SUCCESS);
+	assert(mpool_realloc(200, pool) == MPOOL_SUCCESS);
+	assert(mpool_realloc(400, pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 400, &err) == 400);
+	for (int i = 0; i < 400; i++)
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+
+	/* The 200 block blob goes first, then one of the 100 block ones */
+	assert(mpool_trim(pool, 150, 0) == MPOOL_SUCCESS);
+	assert(mpool_capacity(pool) == 200);
+	assert(mpool_trim(pool, 0, 0) == MPOOL_SUCCESS);
+	assert(mpool_capacity(pool) == 0);
+	free_mpool(pool);
+
+	/* A block in use keeps its blob, the rest of it is uncarved again */
+	attr.flags = MPOOL_SAFE_MODE | MPOOL_MMAP;
+	assert(init_mpool_attr(sizeof(struct test_struct), 2000, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 400, &err) == 400);
+	assert(mpool_realloc(2400, pool) == MPOOL_SUCCESS);
+	for (int i = 1; i < 400; i++)
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+	assert(mpool_trim(pool, 0, 1) == MPOOL_SUCCESS);
+	assert(mpool_capacity(pool) == 2000);
+	assert(mpool_dealloc(items[1], pool) != MPOOL_SUCCESS);
+	for (int i = 1; i < 400; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS && items[i] != items[0]);
+	}
+	assert(mpool_alloc_bulk(pool, items, 400, &err) == 400);
+	assert(mpool_trim(NULL, 0, 0) == MPOOL_ERR_NULL_ARG);
+	assert(mpool_trim(pool, -1, 0) == MPOOL_ERR_INVALID_ARG);
+	free_mpool(pool);
+
+	attr.flags = MPOOL_LOCK_FREE;
+	assert(init_mpool_attr(sizeof(struct test_struct), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_realloc(300, pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 300, &err) == 300);
+	for (int i = 0; i < 300; i++)
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+	assert(mpool_trim(pool, 100, 1) == MPOOL_SUCCESS);
+	assert(mpool_capacity(pool) == 100);
+	assert(mpool_alloc_bulk(pool, items, 300, &err) == 100 && err == MPOOL_EMPTY_POOL);
+	free_mpool(pool);
+}
+
+void test_handles (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	uint32_t handles[100];
+	mpool_error err;
+
+	attr.flags = MPOOL_HANDLES;
+	assert(init_mpool_attr(sizeof(struct test_struct), 50, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_realloc(100, pool) == MPOOL_SUCCESS);
+	for (int i = 0; i < 100; i++) {
+		handles[i] = mpool_alloc_handle(pool, &err);
+		assert(err == MPOOL_SUCCESS && handles[i] != MPOOL_NULL_HANDLE);
+		struct test_struct* ts = mpool_handle_to_ptr(pool, handles[i]);
+		assert(ts != NULL && mpool_ptr_to_handle(pool, ts) == handles[i]);
+		init_struct(ts, i);
+	}
+	assert(mpool_alloc_handle(pool, &err) == MPOOL_NULL_HANDLE && err == MPOOL_EMPTY_POOL);
+	for (int i = 0; i < 100; i++)
+		assert(((struct test_struct*) mpool_handle_to_ptr(pool, handles[i]))->field1 == i);
+
+	/* A freed block's old handle is refused, even once the block is reused */
+	void* item = mpool_handle_to_ptr(pool, handles[7]);
+	assert(mpool_dealloc_handle(pool, handles[7]) == MPOOL_SUCCESS);
+	assert(mpool_handle_to_ptr(pool, handles[7]) == NULL);
+	assert(mpool_dealloc_handle(pool, handles[7]) == MPOOL_ERR_INVALID_ADDRESS);
+	uint32_t again = mpool_alloc_handle(pool, &err);
+	assert(mpool_handle_to_ptr(pool, again) == item && again != handles[7]);
+	assert(mpool_dealloc(item, pool) == MPOOL_SUCCESS);
+	assert(mpool_handle_to_ptr(pool, again) == NULL);
+
+	/* Handles outside the pool */
+	assert(mpool_handle_to_ptr(pool, MPOOL_NULL_HANDLE) == NULL);
+	assert(mpool_handle_to_ptr(pool, 1000) == NULL);
+	assert(mpool_ptr_to_handle(pool, &attr) == MPOOL_NULL_HANDLE);
+
+	/* A free that fails keeps the handles of the blocks it was given working */
+	void* pair[2] = { mpool_handle_to_ptr(pool, handles[0]), &attr };
+	assert(mpool_dealloc_bulk(pool, pair, 2) == MPOOL_ERR_INVALID_ADDRESS);
+	assert(mpool_handle_to_ptr(pool, handles[0]) == pair[0]);
+	assert(mpool_dealloc_handle(pool, handles[0]) == MPOOL_SUCCESS);
+
+	/* A reset frees every block, so none of the old handles work after it */
+	assert(mpool_reset(pool, 0) == MPOOL_SUCCESS);
+	for (int i = 0; i < 100; i++)
+		assert(mpool_handle_to_ptr(pool, handles[i]) == NULL);
+	assert(mpool_alloc_handle(pool, &err) != MPOOL_NULL_HANDLE && err == MPOOL_SUCCESS);
+
+	/* Every block of a pool with handles must have one */
+	assert(mpool_realloc(1 << MPOOL_HANDLE_INDEX_BITS, pool) == MPOOL_ERR_INVALID_REALLOC_SIZE);
+	free_mpool(pool);
+	assert(init_mpool_attr(sizeof(struct test_struct), 1 << MPOOL_HANDLE_INDEX_BITS, &attr, 
+		&pool) == MPOOL_ERR_INVALID_ARG);
+	attr.max_capacity = 1 << MPOOL_HANDLE_INDEX_BITS;
+	assert(init_mpool_attr(sizeof(struct test_struct), 10, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+
+	/* Without MPOOL_HANDLES the generation is always 0 */
+	assert(init_mpool(sizeof(struct test_struct), 10, &pool) == MPOOL_SUCCESS);
+	handles[0] = mpool_alloc_handle(pool, &err);
+	assert(handles[0] >> MPOOL_HANDLE_INDEX_BITS == 0);
+	assert(mpool_dealloc_handle(pool, handles[0]) == MPOOL_SUCCESS);
+	assert(mpool_handle_to_ptr(pool, handles[0]) != NULL);
+	free_mpool(pool);
+}
+
+struct sweep {
+	struct mpool* pool;
+	int seen[300];
+	void* last;
+};
+
+/* Marks each block visited, and frees the ones with an odd value */
+int sweep_odd (void* item, void* ctx)
+{
+	struct sweep* sw = ctx;
+	struct test_struct* ts = item;
+
+	assert((uintptr_t) item > (uintptr_t) sw->last);
+	sw->last = item;
+	sw->seen[ts->field1]++;
+	if (ts->field1 % 2)
+		assert(mpool_dealloc(item, sw->pool) == MPOOL_SUCCESS);
+	return 0;
+}
+
+int count_blocks (void* item, void* ctx)
+{
+	(void) item;
+	return ++*(int*) ctx == 5;
+}
+
+void test_foreach (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	struct test_struct* items[300];
+	mpool_error err;
+	int count = 0;
+
+	attr.flags = MPOOL_SAFE_MODE | MPOOL_LAZY;
+	attr.growth_factor = 2.0;
+	assert(init_mpool_attr(sizeof(struct test_struct), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_foreach_allocated(pool, count_blocks, &count) == MPOOL_SUCCESS && count == 0);
+	for (int i = 0; i < 300; i++) {
+		items[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+		init_struct(items[i], i);
+	}
+	for (int i = 0; i < 300; i += 3)
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+
+	/* Each block still in use is visited once, even as blocks are freed */
+	struct sweep sw = { pool, { 0 }, NULL };
+	assert(mpool_foreach_allocated(pool, sweep_odd, &sw) == MPOOL_SUCCESS);
+	for (int i = 0; i < 300; i++) {
+		assert(sw.seen[i] == (i % 3 != 0));
+		if (i % 2 && i % 3)
+			assert(mpool_dealloc(items[i], pool) == MPOOL_ERR_DOUBLE_FREE);
+	}
+
+	/* Stopped early by the callback */
+	assert(mpool_foreach_allocated(pool, count_blocks, &count) == MPOOL_SUCCESS && count == 5);
+	assert(mpool_foreach_allocated(pool, NULL, NULL) == MPOOL_ERR_NULL_ARG);
+	free_mpool(pool);
+
+	assert(init_mpool(sizeof(struct test_struct), 10, &pool) == MPOOL_SUCCESS);
+	assert(mpool_foreach_allocated(pool, count_blocks, &count) == MPOOL_ERR_INVALID_ARG);
+	free_mpool(pool);
+}
+
+void test_shm (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool* other = NULL;
+	uint32_t handles[64];
+	char name[64];
+	int fds[2];
+	mpool_error err;
+
+	snprintf(name, sizeof(name), "/mpool-test-%d", (int) getpid());
+	assert(init_mpool_shm(name, 0, 64, &pool) == MPOOL_ERR_INVALID_ARG);
+	assert(init_mpool_shm(name, sizeof(struct test_struct), 0, &pool) == MPOOL_FAILURE);
+	assert(init_mpool_shm(name, sizeof(struct test_struct), 64, &pool) == MPOOL_SUCCESS);
+	assert(init_mpool_shm(name, 16, 0, &other) == MPOOL_ERR_INVALID_ARG);
+	assert(mpool_realloc(128, pool) == MPOOL_FAILURE);
+	assert(mpool_thread_cache_enable(pool, 8) == MPOOL_FAILURE);
+
+	/* The child takes every block and hands them over by handle */
+	assert(pipe(fds) == 0);
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		int ok = init_mpool_shm(name, sizeof(struct test_struct), 0, &other) == MPOOL_SUCCESS;
+		for (int i = 0; ok && i < 64; i++) {
+			struct test_struct* ts = mpool_alloc(other, &err);
+			ok = ts != NULL;
+			if (ok) {
+				init_struct(ts, i);
+				handles[i] = mpool_ptr_to_handle(other, ts);
+			}
+		}
+		ok = ok && mpool_alloc(other, &err) == NULL && err == MPOOL_EMPTY_POOL;
+		ok = ok && write(fds[1], handles, sizeof(handles)) == sizeof(handles);
+		free_mpool(other);
+		_exit(ok ? 0 : 1);
+	}
+	int status;
+	assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	assert(read(fds[0], handles, sizeof(handles)) == sizeof(handles));
+	close(fds[0]);
+	close(fds[1]);
+
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	for (int i = 0; i < 64; i++) {
+		struct test_struct* ts = mpool_handle_to_ptr(pool, handles[i]);
+		assert(ts != NULL && ts->field1 == i);
+		assert(mpool_dealloc(ts, pool) == MPOOL_SUCCESS);
+	}
+	assert(mpool_dealloc(&status, pool) == MPOOL_ERR_INVALID_ADDRESS);
+
+	/* A second attach in the same process sees the freed blocks */
+	assert(init_mpool_shm(name, sizeof(struct test_struct), 64, &other) == MPOOL_SUCCESS);
+	void* items[64];
+	assert(mpool_alloc_bulk(other, items, 64, &err) == 64);
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(mpool_dealloc_bulk(other, items, 64) == MPOOL_SUCCESS);
+	assert(mpool_alloc(pool, &err) != NULL);
+	free_mpool(other);
+	free_mpool(pool);
+
+	assert(mpool_shm_unlink(name) == MPOOL_SUCCESS);
+	assert(mpool_shm_unlink(name) == MPOOL_FAILURE);
+}
+
+/* A block of a file backed pool, linked to the next one by handle */
+struct node {
+	int value;
+	uint32_t next;
+};
+
+void test_file (void) 
+{
+	struct mpool* pool = NULL;
+	char path[64];
+	mpool_error err;
+
+	snprintf(path, sizeof(path), "/tmp/mpool-test-%d", (int) getpid());
+	assert(mpool_open_file(path, sizeof(struct node), 0, &pool) == MPOOL_FAILURE);
+	assert(mpool_open_file(path, sizeof(struct node), 100, &pool) == MPOOL_SUCCESS);
+
+	/* Build a list, free a few blocks, and keep the head's handle */
+	uint32_t head = MPOOL_NULL_HANDLE;
+	struct node* nodes[50];
+	for (int i = 0; i < 50; i++) {
+		nodes[i] = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS);
+		nodes[i]->value = i;
+		nodes[i]->next = head;
+		head = mpool_ptr_to_handle(pool, nodes[i]);
+	}
+	void* spare = mpool_alloc(pool, &err);
+	assert(mpool_dealloc(spare, pool) == MPOOL_SUCCESS);
+	assert(mpool_get_root(pool) == MPOOL_NULL_HANDLE);
+	assert(mpool_set_root(pool, head) == MPOOL_SUCCESS);
+	assert(mpool_sync(pool) == MPOOL_SUCCESS);
+	free_mpool(pool);
+
+	assert(mpool_open_file(path, sizeof(struct node) + 8, 0, &pool) == MPOOL_ERR_INVALID_ARG);
+	assert(mpool_open_file(path, sizeof(struct node), 0, &pool) == MPOOL_SUCCESS);
+	assert(mpool_capacity(pool) == 100);
+	int expect = 49;
+	for (uint32_t h = mpool_get_root(pool); h != MPOOL_NULL_HANDLE; expect--) {
+		struct node* n = mpool_handle_to_ptr(pool, h);
+		assert(n != NULL && n->value == expect);
+		h = n->next;
+	}
+	assert(expect == -1);
+
+	/* The freed block comes back first, then the other 49 unused ones */
+	void* items[100];
+	assert(mpool_alloc_bulk(pool, items, 100, &err) == 50 && err == MPOOL_EMPTY_POOL);
+	assert(mpool_sync(NULL) == MPOOL_ERR_NULL_ARG);
+	free_mpool(pool);
+
+	assert(init_mpool(sizeof(struct node), 10, &pool) == MPOOL_SUCCESS);
+	assert(mpool_sync(pool) == MPOOL_FAILURE);
+	assert(mpool_set_root(pool, 1) == MPOOL_FAILURE && mpool_get_root(pool) == MPOOL_NULL_HANDLE);
+	free_mpool(pool);
+	unlink(path);
+
+	/* A file whose maker died before finishing the header, until it is removed */
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	assert(fd >= 0 && ftruncate(fd, 4096) == 0);
+	close(fd);
+	assert(mpool_open_file(path, sizeof(struct node), 100, &pool) == MPOOL_ERR_CORRUPTED);
+	assert(unlink(path) == 0);
+	assert(mpool_open_file(path, sizeof(struct node), 100, &pool) == MPOOL_SUCCESS);
+	free_mpool(pool);
+	unlink(path);
+}
+
+struct reader {
+	struct mpool* pool;
+	int* block;
+	_Atomic int state;	/* 0 -> starting, 1 -> inside, 2 -> may leave */
+};
+
+/* Holds a critical section open, reading its block, until told to leave */
+void* epoch_reader (void* arg)
+{
+	struct reader* r = arg;
+
+	assert(mpool_epoch_enter(r->pool) == MPOOL_SUCCESS);
+	int value = *r->block;
+	atomic_store(&r->state, 1);
+	while (atomic_load(&r->state) != 2)
+		sched_yield();
+	assert(*r->block == value);
+	assert(mpool_epoch_exit(r->pool) == MPOOL_SUCCESS);
+	return NULL;
+}
+
+void test_epoch (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	void* items[100];
+	mpool_error err;
+
+	attr.flags = MPOOL_SAFE_MODE;
+	assert(init_mpool_attr(sizeof(int), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 100, &err) == 100);
+	assert(mpool_epoch_exit(pool) == MPOOL_FAILURE);
+
+	/* Nothing retired comes back while a reader is in its critical section */
+	*(int*) items[0] = 42;
+	struct reader r = { pool, items[0], 0 };
+	pthread_t thread;
+	assert(pthread_create(&thread, NULL, epoch_reader, &r) == 0);
+	while (atomic_load(&r.state) != 1)
+		sched_yield();
+
+	for (int i = 0; i < 100; i++)
+		assert(mpool_retire(pool, items[i]) == MPOOL_SUCCESS);
+	assert(mpool_retire(pool, items[0]) == MPOOL_ERR_DOUBLE_FREE);
+	for (int i = 0; i < 4; i++)
+		assert(mpool_epoch_reclaim(pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+
+	atomic_store(&r.state, 2);
+	pthread_join(thread, NULL);
+	assert(mpool_epoch_reclaim(pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 100, &err) == 100);
+
+	/* Without readers retired blocks come back in batches on their own */
+	assert(mpool_epoch_enter(pool) == MPOOL_SUCCESS);
+	assert(mpool_epoch_enter(pool) == MPOOL_SUCCESS);
+	assert(mpool_epoch_exit(pool) == MPOOL_SUCCESS);
+	assert(mpool_epoch_exit(pool) == MPOOL_SUCCESS);
+	for (int round = 0; round < 10; round++) {
+		for (int i = 0; i < 100; i++)
+			assert(mpool_retire(pool, items[i]) == MPOOL_SUCCESS);
+		for (int i = 0; i < 100; i++) {
+			items[i] = mpool_alloc(pool, &err);
+			if (items[i] == NULL) {
+				assert(mpool_epoch_reclaim(pool) == MPOOL_SUCCESS);
+				items[i] = mpool_alloc(pool, &err);
+			}
+			assert(items[i] != NULL);
+		}
+	}
+	free_mpool(pool);
+}
+
+struct waiter {
+	struct mpool* pool;
+	void* block;
+	_Atomic int started;
+};
+
+/* Waits as long as it takes for a block of a full pool */
+void* wait_worker (void* arg)
+{
+	struct waiter* w = arg;
+	mpool_error err;
+
+	atomic_store(&w->started, 1);
+	w->block = mpool_alloc_wait(w->pool, -1, &err);
+	assert(err == MPOOL_SUCCESS && w->block != NULL);
+	return NULL;
+}
+
+/* Gives a block back from another thread than the owner, a bit later */
+void* late_free_worker (void* arg)
+{
+	struct waiter* w = arg;
+
+	usleep(100000);
+	assert(mpool_dealloc(w->block, w->pool) == MPOOL_SUCCESS);
+	return NULL;
+}
+
+void test_wait (void) 
+{
+	struct mpool* pool = NULL;
+	mpool_error err;
+
+	assert(init_mpool(sizeof(int), 2, &pool) == MPOOL_SUCCESS);
+	void* a = mpool_try_alloc(pool, &err);
+	void* b = mpool_alloc_wait(pool, 0, &err);
+	assert(a != NULL && b != NULL && err == MPOOL_SUCCESS);
+	assert(mpool_try_alloc(pool, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(mpool_alloc_wait(pool, 0, &err) == NULL && err == MPOOL_EMPTY_POOL);
+	assert(mpool_alloc_wait(pool, 1000000, &err) == NULL && err == MPOOL_EMPTY_POOL);
+
+	/* A waiter sleeps until a block comes back, however late */
+	struct waiter w = { pool, NULL, 0 };
+	pthread_t thread;
+	assert(pthread_create(&thread, NULL, wait_worker, &w) == 0);
+	while (atomic_load(&w.started) == 0)
+		sched_yield();
+	usleep(10000);
+	assert(mpool_dealloc(a, pool) == MPOOL_SUCCESS);
+	pthread_join(thread, NULL);
+	assert(w.block == a);
+
+	/* Growing the pool wakes waiters too */
+	w = (struct waiter) { pool, NULL, 0 };
+	assert(pthread_create(&thread, NULL, wait_worker, &w) == 0);
+	while (atomic_load(&w.started) == 0)
+		sched_yield();
+	usleep(10000);
+	assert(mpool_realloc(3, pool) == MPOOL_SUCCESS);
+	pthread_join(thread, NULL);
+	assert(w.block != NULL && w.block != a && w.block != b);
+	free_mpool(pool);
+
+	/* A remote free wakes an owner that waits, long before its timeout */
+	struct timespec start, end;
+	assert(init_mpool(sizeof(int), 1, &pool) == MPOOL_SUCCESS);
+	assert(mpool_set_owner(pool) == MPOOL_SUCCESS);
+	w = (struct waiter) { pool, mpool_alloc(pool, &err), 0 };
+	assert(w.block != NULL && pthread_create(&thread, NULL, late_free_worker, &w) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	a = mpool_alloc_wait(pool, 2000000000, &err);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	assert(a == w.block && err == MPOOL_SUCCESS);
+	assert((end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec) < 1000000000);
+	pthread_join(thread, NULL);
+	free_mpool(pool);
+}
+
+void test_ordered (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	void* items[200];
+	mpool_error err;
+
+	attr.flags = MPOOL_ADDRESS_ORDERED | MPOOL_LOCK_FREE;
+	assert(init_mpool_attr(sizeof(int), 200, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+	attr.flags = MPOOL_ADDRESS_ORDERED;
+	attr.growth_factor = 2.0;
+	attr.max_capacity = 200;
+	assert(init_mpool_attr(sizeof(int), 100, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_thread_cache_enable(pool, 0) == MPOOL_FAILURE);
+
+	/* Grows into a second blob, which may be at a lower address */
+	for (int i = 0; i < 200; i++)
+		assert((items[i] = mpool_alloc(pool, &err)) != NULL);
+	assert(mpool_capacity(pool) == 200);
+
+	/* Whatever order blocks are freed in, the lowest are handed out first */
+	int32_t freed = 0;
+	for (int i = 199; i >= 0; i -= 3, freed++)
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+	for (int i = 0; i < 200; i += 7) {
+		if (i % 3 == 199 % 3)
+			continue;
+		assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+		freed++;
+	}
+	assert(mpool_dealloc(items[199], pool) == MPOOL_ERR_DOUBLE_FREE);
+
+	void* prev = mpool_try_alloc(pool, &err);
+	assert(prev != NULL);
+	int32_t got = mpool_alloc_bulk(pool, items, 200, &err);
+	assert(got == freed - 1 && err == MPOOL_EMPTY_POOL);
+	for (int32_t i = 0; i < got; i++) {
+		assert((char*) items[i] > (char*) prev);
+		prev = items[i];
+	}
+	free_mpool(pool);
+
+	/* A double free in the middle of a bulk free leaves the rest in use */
+	void* more[10];
+	attr = (struct mpool_attr) { 0 };
+	attr.flags = MPOOL_ADDRESS_ORDERED;
+	assert(init_mpool_attr(sizeof(int), 10, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 10, &err) == 10);
+	assert(mpool_dealloc(items[5], pool) == MPOOL_SUCCESS);
+	assert(mpool_dealloc_bulk(pool, items, 10) == MPOOL_ERR_DOUBLE_FREE);
+	assert(mpool_alloc_bulk(pool, more, 10, &err) == 1 && more[0] == items[5]);
+	free_mpool(pool);
+}
+
+/* Whether all @size bytes at @p are 0 */
+int is_zero (const void* p, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		if (((const unsigned char*) p)[i] != 0)
+			return 0;
+	return 1;
+}
+
+void test_calloc (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	char* items[64];
+
+	/* The error may be left out like for mpool_alloc() */
+	assert(init_mpool(64, 1, &pool) == MPOOL_SUCCESS);
+	assert(mpool_calloc(pool, NULL) != NULL);
+	assert(mpool_calloc(pool, NULL) == NULL);
+	free_mpool(pool);
+
+	/* Fresh blocks of tracking pools are known to be 0 already, used ones not */
+	unsigned flags[] = { MPOOL_MMAP, MPOOL_TRACK_FRESH, MPOOL_TRACK_FRESH | MPOOL_LAZY, 
+		MPOOL_TRACK_FRESH | MPOOL_ADDRESS_ORDERED };
+	for (int f = 0; f < 4; f++) {
+		attr.flags = flags[f];
+		assert(init_mpool_attr(64, 64, &attr, &pool) == MPOOL_SUCCESS);
+		for (int i = 0; i < 32; i++) {
+			assert((items[i] = mpool_calloc(pool, NULL)) != NULL);
+			assert(is_zero(items[i], 64));
+			memset(items[i], 0xff, 64);
+		}
+		for (int i = 0; i < 32; i += 2)
+			assert(mpool_dealloc(items[i], pool) == MPOOL_SUCCESS);
+		for (int i = 0; i < 48; i++)
+			assert(is_zero(mpool_calloc(pool, NULL), 64));
+		free_mpool(pool);
+	}
+}
+
+/* Only debug builds catch these, and under ASan they'd be reported as they happen */
+void test_debug (void) 
+{
+#if defined(MPOOL_DEBUG) && !defined(__SANITIZE_ADDRESS__)
+	struct mpool* pool = NULL;
+	mpool_error err;
+
+	assert(init_mpool(32, 4, &pool) == MPOOL_SUCCESS);
+	char* a = mpool_alloc(pool, &err);
+	char* b = mpool_alloc(pool, &err);
+
+	/* Writing past the end of a block */
+	memset(a, 0, 33);
+	assert(mpool_dealloc(a, pool) == MPOOL_ERR_CORRUPTED);
+	assert(mpool_dealloc(b + 1, pool) == MPOOL_ERR_INVALID_ADDRESS);
+
+	/* Freeing twice and writing after free, even without safe mode */
+	assert(mpool_dealloc(b, pool) == MPOOL_SUCCESS);
+	assert(mpool_dealloc(b, pool) == MPOOL_ERR_DOUBLE_FREE);
+	b[16] = 1;
+	assert(mpool_alloc(pool, &err) == NULL && err == MPOOL_ERR_CORRUPTED);
+	assert(mpool_alloc(pool, &err) != NULL && err == MPOOL_SUCCESS);
+	free_mpool(pool);
+#endif
+}
+
+void test_aligned (void) 
+{
+	struct mpool* pool = NULL;
+	mpool_error err;
+
+	assert(init_mpool_aligned(24, 100, 64, &pool) == MPOOL_SUCCESS);
+	assert(mpool_stride(pool) == 64);
+	for (int i = 0; i < 100; i++) {
+		void* item = mpool_alloc(pool, &err);
+		assert(err == MPOOL_SUCCESS && ((uintptr_t) item % 64) == 0);
+	}
+	assert(mpool_realloc(200, pool) == MPOOL_SUCCESS);
+	assert(((uintptr_t) mpool_alloc(pool, &err) % 64) == 0);
+	free_mpool(pool);
+
+	assert(init_mpool_aligned(1, 10, 0, &pool) == MPOOL_SUCCESS);
+#ifndef MPOOL_DEBUG
+	assert(mpool_stride(pool) == sizeof(void*));
+#endif
+	free_mpool(pool);
+
+	assert(init_mpool_aligned(24, 100, 48, &pool) == MPOOL_ERR_INVALID_ARG);
+	assert(mpool_stride(NULL) == 0);
+}
+
+void test_mmap (void) 
+{
+	struct mpool* pool = NULL;
+	struct mpool_attr attr = { 0 };
+	void* items[1000];
+	mpool_error err;
+
+	/* Huge pages may not be available, the pool must still work */
+	attr.flags = MPOOL_HUGEPAGES | MPOOL_PREFAULT;
+	attr.min_grow = 1000;
+	assert(init_mpool_attr(sizeof(struct test_struct), 1000, &attr, &pool) == MPOOL_SUCCESS);
+	assert(mpool_alloc_bulk(pool, items, 1000, &err) == 1000);
+	assert(mpool_alloc(pool, &err) != NULL);
+	assert(mpool_capacity(pool) == 2000);
+	free_mpool(pool);
+
+	attr.flags = MPOOL_NUMA_BIND;
+	attr.numa_node = -1;
+	assert(init_mpool_attr(sizeof(struct test_struct), 10, &attr, &pool) == MPOOL_ERR_INVALID_ARG);
+}
+
 int main(void) 
 {
 	struct test_struct* data_arr[200];
@@ -76,9 +1357,48 @@ int main(void)
 		assert(ts->field2 == i);
 	}
 	
+	/* Free blocks store the list pointer inside of them, so a bogus address
+	 * can only be handed back safely with safe mode on.
+	 */
 	printf("Trying to get error:\n");
+	set_safe_mode(pool);
 	err = mpool_dealloc( (void*)10000, pool);
 	print_mpool_error(stdout, "Got: ", err);
+	assert(err == MPOOL_ERR_INVALID_ADDRESS);
+
+	/* Safe mode was turned on while everything was handed out */
+	err = mpool_dealloc(data_arr[0], pool);
+	assert(err == MPOOL_SUCCESS);
+	err = mpool_dealloc(data_arr[0], pool);
+	assert(err == MPOOL_ERR_DOUBLE_FREE);
+	err = mpool_dealloc((char*) data_arr[1] + 1, pool);
+	assert(err == MPOOL_ERR_INVALID_ADDRESS);
 	free_mpool(pool);
 
+	test_thread_cache();
+	test_lock_free();
+	test_bulk();
+	test_growth();
+	test_mmap();
+	test_aligned();
+	test_lazy();
+	test_parallel_init();
+	test_concurrent_realloc();
+	test_set();
+	test_stats();
+	test_hooks();
+	test_owner();
+	test_sharded();
+	test_reset();
+	test_trim();
+	test_handles();
+	test_foreach();
+	test_shm();
+	test_file();
+	test_epoch();
+	test_wait();
+	test_ordered();
+	test_calloc();
+	test_debug();
+
 }